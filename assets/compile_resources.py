@@ -768,7 +768,49 @@ def print_all(args):
   print_overworld()
   print_overworld_tables()
 
-def write_assets_to_file(print_header = False):
+def lz4_compress_block(src):
+  # Greedy LZ4 block compressor. The last 5 bytes are always literals and
+  # no match starts in the last 12 bytes, as the format requires.
+  n = len(src)
+  out = bytearray()
+  def put_len(v):
+    while v >= 255:
+      out.append(255)
+      v -= 255
+    out.append(v)
+  def put_seq(lit_start, lit_end, offs, mlen):
+    lit = lit_end - lit_start
+    token = min(lit, 15) << 4
+    if mlen:
+      token |= min(mlen - 4, 15)
+    out.append(token)
+    if lit >= 15:
+      put_len(lit - 15)
+    out.extend(src[lit_start:lit_end])
+    if mlen:
+      out.extend(struct.pack('<H', offs))
+      if mlen - 4 >= 15:
+        put_len(mlen - 4 - 15)
+  table = {}
+  anchor = i = 0
+  match_limit = n - 12
+  while i < match_limit:
+    key = src[i:i+4]
+    j = table.get(key)
+    table[key] = i
+    if j is None or i - j > 0xffff:
+      i += 1
+      continue
+    mlen = 4
+    while i + mlen < n - 5 and src[j + mlen] == src[i + mlen]:
+      mlen += 1
+    put_seq(anchor, i, i - j, mlen)
+    i += mlen
+    anchor = i
+  put_seq(anchor, n, 0, 0)
+  return bytes(out)
+
+def write_assets_to_file(print_header = False, compress = False):
   key_sig = b''
   all_data = []
   if print_header:
@@ -781,6 +823,16 @@ enum {
 extern const uint8 *g_asset_ptrs[kNumberOfAssets];
 extern uint32 g_asset_sizes[kNumberOfAssets];
 extern MemBlk FindInAssetArray(int asset, int idx);
+extern const uint8 *LoadAsset(int asset);
+// Keeps the asset containing p loaded, for assets that are modified or
+// referenced through pointers that are kept across frames.
+extern void PinAsset(const void *p);
+
+// Assets in a compressed zelda3_assets.dat are decompressed on first use
+static inline const uint8 *GetAsset(int asset) {
+  const uint8 *p = g_asset_ptrs[asset];
+  return p ? p : LoadAsset(asset);
+}
 ''' % len(assets))
 
   for i, (k, (tp, data)) in enumerate(assets.items()):
@@ -788,7 +840,7 @@ extern MemBlk FindInAssetArray(int asset, int idx);
       if tp == 'packed':
         print('#define %s(idx) FindInAssetArray(%d, idx)' % (k, i))
       else:
-        print('#define %s ((%s*)g_asset_ptrs[%d])' % (k, tp, i))
+        print('#define %s ((%s*)GetAsset(%d))' % (k, tp, i))
         print('#define %s_SIZE (g_asset_sizes[%d])' % (k, i))
     key_sig += k.encode('utf8') + b'\0'
     all_data.append(data)
@@ -798,10 +850,19 @@ extern MemBlk FindInAssetArray(int asset, int idx);
   if print_header:
     print('#define kAssets_Sig %s' % ", ".join((str(a) for a in assets_sig)))
 
+  # The compressed variant has a different magic and stores each asset as a
+  # separate LZ4 block, preceded by the compressed sizes.
+  if compress:
+    assets_sig = b'Zelda3_v0lz4  \n\0' + assets_sig[16:]
+
   hdr = assets_sig + b'\x00' * 32 + struct.pack('II', len(all_data), len(key_sig))
 
   encoded_sizes = array.array('I', [len(i) for i in all_data])
 
+  if compress:
+    all_data = [lz4_compress_block(v) for v in all_data]
+    encoded_sizes += array.array('I', [len(i) for i in all_data])
+
   file_data = hdr + encoded_sizes + key_sig
 
   for v in all_data:
@@ -813,7 +874,7 @@ extern MemBlk FindInAssetArray(int asset, int idx);
 
 def main(args):
   print_all(args)
-  write_assets_to_file(args.print_assets_header)
+  write_assets_to_file(args.print_assets_header, args.compress_assets)
 
 if __name__ == "__main__":
   ROM = util.load_rom(sys.argv[1] if len(sys.argv) >= 2 else None)
@@ -821,6 +882,7 @@ if __name__ == "__main__":
     sprites_from_png = False
     languages = None
     print_assets_header = False
+    compress_assets = False
   main(DefaultArgs())
 else:
   ROM = util.ROM
@@ -14,6 +14,9 @@ optional = parser.add_argument_group('Language settings')
 optional.add_argument('--extract-dialogue', action='store_true', help = 'Extract dialogue from a translated ROM')
 optional.add_argument('--languages', action='store', metavar='L1,L2', help = 'Comma separated list of additional languages to build (de,fr,fr-c,en,es,pl,pt,redux,nl,sv).')
 
+optional = parser.add_argument_group('Assets file')
+optional.add_argument('--compress-assets', action='store_true', help="Compress each asset with LZ4, they're decompressed on first use")
+
 optional = parser.add_argument_group('Debug things')
 optional.add_argument('--no-build', action='store_true', help="Don't actually build zelda3_assets.dat")
 optional.add_argument('--print-strings', action='store_true', help="Print all dialogue strings")
@@ -0,0 +1,101 @@
+# Decodes the cpu_trace.bin written by the binary cpu tracer (CpuTraceLength in
+# zelda3.ini) into the same text format as getProcessorStateCpu.
+import struct
+import sys
+
+# Tables copied from snes/tracing.c
+OPCODE_NAMES = [
+  "brk          ", "ora ($%02x,x)  ", "cop #$%02x     ", "ora $%02x,s    ", "tsb $%02x      ", "ora $%02x      ", "asl $%02x      ", "ora [$%02x]    ", "php          ", "ora #$%04x   ", "asl          ", "phd          ", "tsb $%04x    ", "ora $%04x    ", "asl $%04x    ", "ora $%06x  ",
+  "bpl $%04x    ", "ora ($%02x),y  ", "ora ($%02x)    ", "ora ($%02x,s),y", "trb $%02x      ", "ora $%02x,x    ", "asl $%02x,x    ", "ora [$%02x],y  ", "clc          ", "ora $%04x,y  ", "inc          ", "tcs          ", "trb $%04x    ", "ora $%04x,x  ", "asl $%04x,x  ", "ora $%06x,x",
+  "jsr $%04x    ", "and ($%02x,x)  ", "jsl $%06x  ", "and $%02x,s    ", "bit $%02x      ", "and $%02x      ", "rol $%02x      ", "and [$%02x]    ", "plp          ", "and #$%04x   ", "rol          ", "pld          ", "bit $%04x    ", "and $%04x    ", "rol $%04x    ", "and $%06x  ",
+  "bmi $%04x    ", "and ($%02x),y  ", "and ($%02x)    ", "and ($%02x,s),y", "bit $%02x,x    ", "and $%02x,x    ", "rol $%02x,x    ", "and [$%02x],y  ", "sec          ", "and $%04x,y  ", "dec          ", "tsc          ", "bit $%04x,x  ", "and $%04x,x  ", "rol $%04x,x  ", "and $%06x,x",
+  "rti          ", "eor ($%02x,x)  ", "wdm #$%02x     ", "eor $%02x,s    ", "mvp $%02x, $%02x ", "eor $%02x      ", "lsr $%02x      ", "eor [$%02x]    ", "pha          ", "eor #$%04x   ", "lsr          ", "phk          ", "jmp $%04x    ", "eor $%04x    ", "lsr $%04x    ", "eor $%06x  ",
+  "bvc $%04x    ", "eor ($%02x),y  ", "eor ($%02x)    ", "eor ($%02x,s),y", "mvn $%02x, $%02x ", "eor $%02x,x    ", "lsr $%02x,x    ", "eor [$%02x],y  ", "cli          ", "eor $%04x,y  ", "phy          ", "tcd          ", "jml $%06x  ", "eor $%04x,x  ", "lsr $%04x,x  ", "eor $%06x,x",
+  "rts          ", "adc ($%02x,x)  ", "per $%04x    ", "adc $%02x,s    ", "stz $%02x      ", "adc $%02x      ", "ror $%02x      ", "adc [$%02x]    ", "pla          ", "adc #$%04x   ", "ror          ", "rtl          ", "jmp ($%04x)  ", "adc $%04x    ", "ror $%04x    ", "adc $%06x  ",
+  "bvs $%04x    ", "adc ($%02x),y  ", "adc ($%02x)    ", "adc ($%02x,s),y", "stz $%02x,x    ", "adc $%02x,x    ", "ror $%02x,x    ", "adc [$%02x],y  ", "sei          ", "adc $%04x,y  ", "ply          ", "tdc          ", "jmp ($%04x,x)", "adc $%04x,x  ", "ror $%04x,x  ", "adc $%06x,x",
+  "bra $%04x    ", "sta ($%02x,x)  ", "brl $%04x    ", "sta $%02x,s    ", "sty $%02x      ", "sta $%02x      ", "stx $%02x      ", "sta [$%02x]    ", "dey          ", "bit #$%04x   ", "txa          ", "phb          ", "sty $%04x    ", "sta $%04x    ", "stx $%04x    ", "sta $%06x  ",
+  "bcc $%04x    ", "sta ($%02x),y  ", "sta ($%02x)    ", "sta ($%02x,s),y", "sty $%02x,x    ", "sta $%02x,x    ", "stx $%02x,y    ", "sta [$%02x],y  ", "tya          ", "sta $%04x,y  ", "txs          ", "txy          ", "stz $%04x    ", "sta $%04x,x  ", "stz $%04x,x  ", "sta $%06x,x",
+  "ldy #$%04x   ", "lda ($%02x,x)  ", "ldx #$%04x   ", "lda $%02x,s    ", "ldy $%02x      ", "lda $%02x      ", "ldx $%02x      ", "lda [$%02x]    ", "tay          ", "lda #$%04x   ", "tax          ", "plb          ", "ldy $%04x    ", "lda $%04x    ", "ldx $%04x    ", "lda $%06x  ",
+  "bcs $%04x    ", "lda ($%02x),y  ", "lda ($%02x)    ", "lda ($%02x,s),y", "ldy $%02x,x    ", "lda $%02x,x    ", "ldx $%02x,y    ", "lda [$%02x],y  ", "clv          ", "lda $%04x,y  ", "tsx          ", "tyx          ", "ldy $%04x,x  ", "lda $%04x,x  ", "ldx $%04x,y  ", "lda $%06x,x",
+  "cpy #$%04x   ", "cmp ($%02x,x)  ", "rep #$%02x     ", "cmp $%02x,s    ", "cpy $%02x      ", "cmp $%02x      ", "dec $%02x      ", "cmp [$%02x]    ", "iny          ", "cmp #$%04x   ", "dex          ", "wai          ", "cpy $%04x    ", "cmp $%04x    ", "dec $%04x    ", "cmp $%06x  ",
+  "bne $%04x    ", "cmp ($%02x),y  ", "cmp ($%02x)    ", "cmp ($%02x,s),y", "pei $%02x      ", "cmp $%02x,x    ", "dec $%02x,x    ", "cmp [$%02x],y  ", "cld          ", "cmp $%04x,y  ", "phx          ", "stp          ", "jml [$%04x]  ", "cmp $%04x,x  ", "dec $%04x,x  ", "cmp $%06x,x",
+  "cpx #$%04x   ", "sbc ($%02x,x)  ", "sep #$%02x     ", "sbc $%02x,s    ", "cpx $%02x      ", "sbc $%02x      ", "inc $%02x      ", "sbc [$%02x]    ", "inx          ", "sbc #$%04x   ", "nop          ", "xba          ", "cpx $%04x    ", "sbc $%04x    ", "inc $%04x    ", "sbc $%06x  ",
+  "beq $%04x    ", "sbc ($%02x),y  ", "sbc ($%02x)    ", "sbc ($%02x,s),y", "pea #$%04x   ", "sbc $%02x,x    ", "inc $%02x,x    ", "sbc [$%02x],y  ", "sed          ", "sbc $%04x,y  ", "plx          ", "xce          ", "jsr ($%04x,x)", "sbc $%04x,x  ", "inc $%04x,x  ", "sbc $%06x,x",
+]
+
+OPCODE_NAMES_SP = [
+  None, None, None, None, None, None, None, None, None, "ora #$%02x     ", None, None, None, None, None, None,
+  None, None, None, None, None, None, None, None, None, None, None, None, None, None, None, None,
+  None, None, None, None, None, None, None, None, None, "and #$%02x     ", None, None, None, None, None, None,
+  None, None, None, None, None, None, None, None, None, None, None, None, None, None, None, None,
+  None, None, None, None, None, None, None, None, None, "eor #$%02x     ", None, None, None, None, None, None,
+  None, None, None, None, None, None, None, None, None, None, None, None, None, None, None, None,
+  None, None, None, None, None, None, None, None, None, "adc #$%02x     ", None, None, None, None, None, None,
+  None, None, None, None, None, None, None, None, None, None, None, None, None, None, None, None,
+  None, None, None, None, None, None, None, None, None, "bit #$%02x     ", None, None, None, None, None, None,
+  None, None, None, None, None, None, None, None, None, None, None, None, None, None, None, None,
+  "ldy #$%02x     ", None, "ldx #$%02x     ", None, None, None, None, None, None, "lda #$%02x     ", None, None, None, None, None, None,
+  None, None, None, None, None, None, None, None, None, None, None, None, None, None, None, None,
+  "cpy #$%02x     ", None, None, None, None, None, None, None, None, "cmp #$%02x     ", None, None, None, None, None, None,
+  None, None, None, None, None, None, None, None, None, None, None, None, None, None, None, None,
+  "cpx #$%02x     ", None, None, None, None, None, None, None, None, "sbc #$%02x     ", None, None, None, None, None, None,
+  None, None, None, None, None, None, None, None, None, None, None, None, None, None, None, None,
+]
+
+OPCODE_TYPE = [
+  0, 1, 1, 1, 1, 1, 1, 1, 0, 4, 0, 0, 2, 2, 2, 3,
+  6, 1, 1, 1, 1, 1, 1, 1, 0, 2, 0, 0, 2, 2, 2, 3,
+  2, 1, 3, 1, 1, 1, 1, 1, 0, 4, 0, 0, 2, 2, 2, 3,
+  6, 1, 1, 1, 1, 1, 1, 1, 0, 2, 0, 0, 2, 2, 2, 3,
+  0, 1, 1, 1, 8, 1, 1, 1, 0, 4, 0, 0, 2, 2, 2, 3,
+  6, 1, 1, 1, 8, 1, 1, 1, 0, 2, 0, 0, 3, 2, 2, 3,
+  0, 1, 7, 1, 1, 1, 1, 1, 0, 4, 0, 0, 2, 2, 2, 3,
+  6, 1, 1, 1, 1, 1, 1, 1, 0, 2, 0, 0, 2, 2, 2, 3,
+  6, 1, 7, 1, 1, 1, 1, 1, 0, 4, 0, 0, 2, 2, 2, 3,
+  6, 1, 1, 1, 1, 1, 1, 1, 0, 2, 0, 0, 2, 2, 2, 3,
+  5, 1, 5, 1, 1, 1, 1, 1, 0, 4, 0, 0, 2, 2, 2, 3,
+  6, 1, 1, 1, 1, 1, 1, 1, 0, 2, 0, 0, 2, 2, 2, 3,
+  5, 1, 1, 1, 1, 1, 1, 1, 0, 4, 0, 0, 2, 2, 2, 3,
+  6, 1, 1, 1, 1, 1, 1, 1, 0, 2, 0, 0, 2, 2, 2, 3,
+  5, 1, 1, 1, 1, 1, 1, 1, 0, 4, 0, 0, 2, 2, 2, 3,
+  6, 1, 1, 1, 2, 1, 1, 1, 0, 2, 0, 0, 2, 2, 2, 3,
+]
+
+def disassemble(pc, b, mf, xf):
+  op, byte, byte2 = b[0], b[1], b[2]
+  word = byte2 << 8 | byte
+  longv = b[3] << 16 | word
+  t = OPCODE_TYPE[op]
+  if t == 0:
+    return OPCODE_NAMES[op]
+  if t == 1:
+    return OPCODE_NAMES[op] % byte
+  if t == 2:
+    return OPCODE_NAMES[op] % word
+  if t == 3:
+    return OPCODE_NAMES[op] % longv
+  if t == 4 or t == 5:
+    return OPCODE_NAMES_SP[op] % byte if (mf if t == 4 else xf) else OPCODE_NAMES[op] % word
+  if t == 6:
+    return OPCODE_NAMES[op] % ((pc + 2 + (byte ^ 0x80) - 0x80) & 0xffff)
+  if t == 7:
+    return OPCODE_NAMES[op] % ((pc + 3 + (word ^ 0x8000) - 0x8000) & 0xffff)
+  return OPCODE_NAMES[op] % (byte2, byte)
+
+RECORD = struct.Struct('<I4s5H4BHI4s')
+
+data = open(sys.argv[1], 'rb').read()
+magic, version, record_size, count = struct.unpack_from('<4sIII', data)
+if magic != b'CPUT' or version != 1 or record_size != RECORD.size:
+  sys.exit('%s: not a cpu trace' % sys.argv[1])
+
+for i in range(count):
+  pc, b, a, x, y, sp, dp, db, p, e, writes, _, write_adr, write_val = RECORD.unpack_from(data, 16 + i * RECORD.size)
+  line = 'CPU %02x:%04x %s A:%04x X:%04x Y:%04x SP:%04x DP:%04x DB:%02x %s %s' % (
+    pc >> 16, pc & 0xffff, disassemble(pc & 0xffff, b, p & 0x20, p & 0x10), a, x, y, sp, dp, db, 'E' if e else 'e',
+    ''.join(c.upper() if p & (0x80 >> j) else c for j, c in enumerate('nvmxdizc')))
+  if writes:
+    line += ' [%06x]=%s' % (write_adr, ' '.join('%02x' % v for v in write_val[:writes]))
+    if writes > 4:
+      line += ' (+%d)' % (writes - 4)
+  print(line)
@@ -13,6 +13,15 @@ import numpy as np
 #   4 byte: num pcm samples to play from here
 #   2 byte: # samples to skip + flags
 # }
+#
+# Seek index, written next to the .opuz file as .opuz.idx
+# 4 byte: OPZI
+# 4 byte: VERSION = 0
+# 4 byte: size of the .opuz file
+# 4 byte: number of packets
+# Foreach packet {
+#   4 byte: file offset of the packet. Packet i starts at sample i * 960.
+# }
 
 def encode_to_msu_opus(msu_infile, bitrate = 128000):
   raw_msu1 = bytearray(open(msu_infile, 'rb').read())
@@ -106,10 +115,17 @@ def convert_to_opuz(filename, repeat):
 
   play_ranges = calc_play_ranges(play_ranges)
 
+  def serialize_index(header_size, file_size):
+    r = b'OPZI' + struct.pack('<III', 0, file_size, len(framelist))
+    for sample, fileoffs in framelist:
+      r += struct.pack('<I', fileoffs + header_size)
+    return r
+
   header = serialize_header(play_ranges)
   if filename.endswith('.pcm'):
     filename = filename[:-4]
   open(filename + '.opuz', 'wb').write(header + result)
+  open(filename + '.opuz.idx', 'wb').write(serialize_index(len(header), len(header) + len(result)))
 
 kMsuTracksWithRepeat = [
   1,0,1,1,1,1,1,1,0,1,0,1,1,1,1,0,
@@ -8,6 +8,10 @@
 #include <limits.h>
 #include "dsp_regs.h"
 #include "dsp.h"
+#include "src/arena.h"
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#endif
 
 #define MY_CHANGES 1
 
@@ -61,13 +65,13 @@ static int16_t dsp_getSample(Dsp* dsp, int ch, int sampleNum, int offset);
 static void dsp_handleNoise(Dsp* dsp);
 
 Dsp* dsp_init(uint8_t *apu_ram) {
-  Dsp* dsp = (Dsp*)malloc(sizeof(Dsp));
+  Dsp* dsp = (Dsp*)ArenaAlloc("dsp", sizeof(Dsp));
   dsp->apu_ram = apu_ram;
   return dsp;
 }
 
 void dsp_free(Dsp* dsp) {
-  free(dsp);
+  // The memory belongs to the arena
 }
 
 void dsp_reset(Dsp* dsp) {
@@ -158,27 +162,69 @@ void dsp_cycle(Dsp* dsp) {
   dsp->evenCycle = !dsp->evenCycle;
 }
 
+// Tap i of the FIR reads entry (firBufferIndex + i + 1) & 7, so the last tap is the
+// sample that was just read. Returns the sum of the first 7 taps and the last tap.
+static void dsp_firTaps(Dsp* dsp, int* sumL, int* sumR, int* lastL, int* lastR) {
+  int idx = dsp->firBufferIndex;
+#if defined(__SSE2__) || defined(_M_X64)
+  // Rotate the history through memory so that the taps are contiguous
+  int16_t hist[32];
+  __m128i bl = _mm_loadu_si128((const __m128i *)dsp->firBufferL);
+  __m128i br = _mm_loadu_si128((const __m128i *)dsp->firBufferR);
+  _mm_storeu_si128((__m128i *)&hist[0], bl);
+  _mm_storeu_si128((__m128i *)&hist[8], bl);
+  _mm_storeu_si128((__m128i *)&hist[16], br);
+  _mm_storeu_si128((__m128i *)&hist[24], br);
+  bl = _mm_loadu_si128((const __m128i *)&hist[idx + 1]);
+  br = _mm_loadu_si128((const __m128i *)&hist[16 + idx + 1]);
+  __m128i coefs = _mm_loadl_epi64((const __m128i *)dsp->firValues);
+  coefs = _mm_srai_epi16(_mm_unpacklo_epi8(coefs, coefs), 8);
+  // Each product is shifted before summing, like the hardware
+  __m128i lo = _mm_mullo_epi16(bl, coefs), hi = _mm_mulhi_epi16(bl, coefs);
+  __m128i l0 = _mm_srai_epi32(_mm_unpacklo_epi16(lo, hi), 6);
+  __m128i l1 = _mm_srai_epi32(_mm_unpackhi_epi16(lo, hi), 6);
+  lo = _mm_mullo_epi16(br, coefs), hi = _mm_mulhi_epi16(br, coefs);
+  __m128i r0 = _mm_srai_epi32(_mm_unpacklo_epi16(lo, hi), 6);
+  __m128i r1 = _mm_srai_epi32(_mm_unpackhi_epi16(lo, hi), 6);
+  // Sum all 8 taps of both channels at once, then take out the last tap
+  __m128i l = _mm_add_epi32(l0, l1), r = _mm_add_epi32(r0, r1);
+  __m128i t = _mm_add_epi32(_mm_unpacklo_epi32(l, r), _mm_unpackhi_epi32(l, r));  // l0+l2 r0+r2 l1+l3 r1+r3
+  t = _mm_add_epi32(t, _mm_srli_si128(t, 8));
+  *lastL = _mm_cvtsi128_si32(_mm_srli_si128(l1, 12));
+  *lastR = _mm_cvtsi128_si32(_mm_srli_si128(r1, 12));
+  *sumL = _mm_cvtsi128_si32(t) - *lastL;
+  *sumR = _mm_cvtsi128_si32(_mm_srli_si128(t, 4)) - *lastR;
+#else
+  int sl = 0, sr = 0;
+  for (int i = 0, j = idx + 1; i < 7; i++, j++) {
+    sl += (dsp->firBufferL[j & 7] * dsp->firValues[i]) >> 6;
+    sr += (dsp->firBufferR[j & 7] * dsp->firValues[i]) >> 6;
+  }
+  *sumL = sl, *sumR = sr;
+  *lastL = (dsp->firBufferL[idx] * dsp->firValues[7]) >> 6;
+  *lastR = (dsp->firBufferR[idx] * dsp->firValues[7]) >> 6;
+#endif
+}
+
 static void dsp_handleEcho(Dsp* dsp, int* outputL, int* outputR) {
   // get value out of ram
   uint16_t adr = dsp->echoBufferAdr + dsp->echoBufferIndex * 4;
-  dsp->firBufferL[dsp->firBufferIndex] = (
-    dsp->apu_ram[adr] + (dsp->apu_ram[(adr + 1) & 0xffff] << 8)
-  );
-  dsp->firBufferL[dsp->firBufferIndex] >>= 1;
-  dsp->firBufferR[dsp->firBufferIndex] = (
-    dsp->apu_ram[(adr + 2) & 0xffff] + (dsp->apu_ram[(adr + 3) & 0xffff] << 8)
-  );
-  dsp->firBufferR[dsp->firBufferIndex] >>= 1;
-  // calculate FIR-sum
+  uint8_t *ram = dsp->apu_ram;
+  if (adr <= 0xfffc) {
+    dsp->firBufferL[dsp->firBufferIndex] = (int16_t)(ram[adr] | ram[adr + 1] << 8) >> 1;
+    dsp->firBufferR[dsp->firBufferIndex] = (int16_t)(ram[adr + 2] | ram[adr + 3] << 8) >> 1;
+  } else {
+    dsp->firBufferL[dsp->firBufferIndex] = (int16_t)(ram[adr] | ram[(adr + 1) & 0xffff] << 8) >> 1;
+    dsp->firBufferR[dsp->firBufferIndex] = (int16_t)(ram[(adr + 2) & 0xffff] | ram[(adr + 3) & 0xffff] << 8) >> 1;
+  }
+  // calculate FIR-sum, it only matters if it's heard or fed back
   int sumL = 0, sumR = 0;
-  for(int i = 0; i < 8; i++) {
-    sumL += (dsp->firBufferL[(dsp->firBufferIndex + i + 1) & 0x7] * dsp->firValues[i]) >> 6;
-    sumR += (dsp->firBufferR[(dsp->firBufferIndex + i + 1) & 0x7] * dsp->firValues[i]) >> 6;
-    if(i == 6) {
-      // clip to 16-bit before last addition
-      sumL = ((int16_t) (sumL & 0xffff)); // clip 16-bit
-      sumR = ((int16_t) (sumR & 0xffff)); // clip 16-bit
-    }
+  if (dsp->echoVolumeL | dsp->echoVolumeR | dsp->feedbackVolume) {
+    int lastL, lastR;
+    dsp_firTaps(dsp, &sumL, &sumR, &lastL, &lastR);
+    // clip to 16-bit before last addition
+    sumL = (int16_t)(sumL & 0xffff) + lastL;
+    sumR = (int16_t)(sumR & 0xffff) + lastR;
   }
   sumL = sumL < -0x8000 ? -0x8000 : (sumL > 0x7fff ? 0x7fff : sumL); // clamp 16-bit
   sumR = sumR < -0x8000 ? -0x8000 : (sumR > 0x7fff ? 0x7fff : sumR); // clamp 16-bit
@@ -205,10 +251,10 @@ static void dsp_handleEcho(Dsp* dsp, int* outputL, int* outputR) {
   inL &= 0xfffe;
   inR &= 0xfffe;
   if(dsp->echoWrites) {
-    dsp->apu_ram[adr] = inL & 0xff;
-    dsp->apu_ram[(adr + 1) & 0xffff] = inL >> 8;
-    dsp->apu_ram[(adr + 2) & 0xffff] = inR & 0xff;
-    dsp->apu_ram[(adr + 3) & 0xffff] = inR >> 8;
+    ram[adr] = inL & 0xff;
+    ram[(adr + 1) & 0xffff] = inL >> 8;
+    ram[(adr + 2) & 0xffff] = inR & 0xff;
+    ram[(adr + 3) & 0xffff] = inR >> 8;
   }
   // handle indexes
   dsp->firBufferIndex++;
@@ -235,6 +281,18 @@ static void dsp_cycleChannel(Dsp* dsp, int ch) {
     dsp_decodeBrr(dsp, ch);
   }
   dsp->channel[ch].pitchCounter = newCounter;
+  // A released voice with zero gain stays silent until the next key on. This covers
+  // the music voices while the msu plays, since pausing the music keys them off.
+  // The decoder above keeps running because the filter history and ENDX carry over,
+  // but the interpolation and the envelope have no effect and are skipped.
+#if MY_CHANGES
+  if (dsp->channel[ch].adsrState == 4 && dsp->channel[ch].gain == 0) {
+    dsp->ram[(ch << 4) | 8] = 0;
+    dsp->ram[(ch << 4) | 9] = 0;
+    dsp->channel[ch].sampleOut = 0;
+    return;
+  }
+#endif
   int16_t sample = 0;
   if(dsp->channel[ch].useNoise) {
     sample = dsp->noiseSample;
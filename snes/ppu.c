@@ -7,7 +7,13 @@
 #include <assert.h>
 #include "ppu.h"
 #include "src/types.h"
+#include "src/arena.h"
 #include "snes.h"
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#endif
 
 static const uint8 kSpriteSizes[8][2] = {
   {8, 16}, {8, 32}, {8, 64}, {16, 32},
@@ -35,13 +41,18 @@ enum {
 };
 
 Ppu* ppu_init(Ppu* snes) {
-  Ppu* ppu = (Ppu * )malloc(sizeof(Ppu));
+  Ppu* ppu = (Ppu * )ArenaAlloc("ppu", sizeof(Ppu));
   ppu->extraLeftRight = kPpuExtraLeftRight;
+  ppu->parallelFor = NULL;
+  ppu->mode7Lines = NULL;
+  ppu->mode7LineCount = 0;
+  memset(ppu->bgCache, 0, sizeof(ppu->bgCache));
+  ppu->lineCache = NULL;
   return ppu;
 }
 
 void ppu_free(Ppu* ppu) {
-  free(ppu);
+  // The memory belongs to the arena
 }
 
 void ppu_reset(Ppu* ppu) {
@@ -93,6 +104,7 @@ void ppu_reset(Ppu* ppu) {
   ppu->window1right = 0;
   ppu->window2left = 0;
   ppu->window2right = 0;
+  ppu->windowsValid = 0;
   ppu->clipMode = 0;
   ppu->preventMathMode = 0;
   ppu->addSubscreen = false;
@@ -123,32 +135,235 @@ void ppu_saveload(Ppu *ppu, SaveLoadFunc *func, void *ctx) {
   func(ctx, tmp, 123);
 }
 
+// Packs 8-bit color channels into the given kPpuRenderFlags_PixelFormatMask format
+static FORCEINLINE uint32 PpuPackColor(uint32 pixel_format, uint32 r, uint32 g, uint32 b) {
+  if (pixel_format == kPpuRenderFlags_Rgb565)
+    return (r >> 3) << 11 | (g >> 2) << 5 | (b >> 3);
+  else if (pixel_format == kPpuRenderFlags_Rgba8888)
+    return b << 16 | g << 8 | r;
+  else
+    return r << 16 | g << 8 | b;
+}
+
+static FORCEINLINE size_t PpuBytesPerPixel(const Ppu *ppu) {
+  return (ppu->renderFlags & kPpuRenderFlags_PixelFormatMask) == kPpuRenderFlags_Rgb565 ? 2 : 4;
+}
+
+// Mask that clears the lowest bit of each channel, so a pixel can be halved with a shift
+static FORCEINLINE uint32 PpuHalfColorMask(const Ppu *ppu) {
+  return (ppu->renderFlags & kPpuRenderFlags_PixelFormatMask) == kPpuRenderFlags_Rgb565 ? 0xf7de : 0xfefefe;
+}
+
 int PpuGetCurrentRenderScale(Ppu *ppu, uint32_t render_flags) {
   bool hq = ppu->mode == 7 && !ppu->forcedBlank &&
     (render_flags & (kPpuRenderFlags_4x4Mode7 | kPpuRenderFlags_NewRenderer)) == (kPpuRenderFlags_4x4Mode7 | kPpuRenderFlags_NewRenderer);
   return hq ? 4 : 1;
 }
 
+// Everything that a line of the new renderer depends on, besides vram, cgram and oam.
+// It's zeroed before being filled in, so that it can be compared with memcmp.
+typedef struct PpuLineState {
+  uint8 renderFlags, extraLeftRight, extraLeftCur, extraRightCur;
+  uint8 screenEnabled[2], screenWindowed[2];
+  uint8 mosaicEnabled, mosaicSize, objSize, mode;
+  uint16 objTileAdr1, objTileAdr2;
+  uint8 window1left, window1right, window2left, window2right;
+  uint32 windowsel;
+  uint8 clipMode, preventMathMode, mathEnabled, brightness;
+  bool addSubscreen, subtractColor, halfColor, forcedBlank;
+  uint8 fixedColorR, fixedColorG, fixedColorB;
+  bool m7largeField, m7charFill, m7xFlip, m7yFlip;
+  int16 m7matrix[8];
+  BgLayer bgLayer[4];
+} PpuLineState;
+
+typedef struct PpuLineCacheEntry {
+  PpuLineState state;
+  uint32 frame;
+  bool valid;
+} PpuLineCacheEntry;
+
+// Keeps the output of each line together with the state it was drawn with. The
+// game writes vram, cgram and oam directly, so they are compared with a copy to
+// find the frame where each 1K word block of vram, the cgram or the oam changed.
+struct PpuLineCache {
+  uint32 frame;
+  uint32 vramChanged[32], cgramChanged, oamChanged;
+  PpuLineState state;
+  bool pending;
+  uint16 vram[0x8000];
+  uint16 cgram[0x100];
+  uint16 oam[0x110];
+  PpuLineCacheEntry lines[240];
+  uint8 pixels[240][kPpuXPixels * 4];
+};
+
+static void PpuLineState_Get(Ppu *ppu, PpuLineState *s) {
+  memset(s, 0, sizeof(PpuLineState));
+  s->renderFlags = ppu->renderFlags;
+  s->extraLeftRight = ppu->extraLeftRight;
+  s->extraLeftCur = ppu->extraLeftCur;
+  s->extraRightCur = ppu->extraRightCur;
+  memcpy(s->screenEnabled, ppu->screenEnabled, sizeof(s->screenEnabled));
+  memcpy(s->screenWindowed, ppu->screenWindowed, sizeof(s->screenWindowed));
+  s->mosaicEnabled = ppu->mosaicEnabled;
+  s->mosaicSize = ppu->mosaicSize;
+  s->objSize = ppu->objSize;
+  s->mode = ppu->mode;
+  s->objTileAdr1 = ppu->objTileAdr1;
+  s->objTileAdr2 = ppu->objTileAdr2;
+  s->window1left = ppu->window1left;
+  s->window1right = ppu->window1right;
+  s->window2left = ppu->window2left;
+  s->window2right = ppu->window2right;
+  s->windowsel = ppu->windowsel;
+  s->clipMode = ppu->clipMode;
+  s->preventMathMode = ppu->preventMathMode;
+  s->mathEnabled = ppu->mathEnabled;
+  // Lines are drawn with brightnessMap, which is built at the start of the frame
+  s->brightness = ppu->lastBrightnessMult;
+  s->addSubscreen = ppu->addSubscreen;
+  s->subtractColor = ppu->subtractColor;
+  s->halfColor = ppu->halfColor;
+  s->forcedBlank = ppu->forcedBlank;
+  s->fixedColorR = ppu->fixedColorR;
+  s->fixedColorG = ppu->fixedColorG;
+  s->fixedColorB = ppu->fixedColorB;
+  s->m7largeField = ppu->m7largeField;
+  s->m7charFill = ppu->m7charFill;
+  s->m7xFlip = ppu->m7xFlip;
+  s->m7yFlip = ppu->m7yFlip;
+  memcpy(s->m7matrix, ppu->m7matrix, sizeof(s->m7matrix));
+  for (int i = 0; i < 4; i++) {
+    s->bgLayer[i].hScroll = ppu->bgLayer[i].hScroll;
+    s->bgLayer[i].vScroll = ppu->bgLayer[i].vScroll;
+    s->bgLayer[i].tilemapWider = ppu->bgLayer[i].tilemapWider;
+    s->bgLayer[i].tilemapHigher = ppu->bgLayer[i].tilemapHigher;
+    s->bgLayer[i].tilemapAdr = ppu->bgLayer[i].tilemapAdr;
+    s->bgLayer[i].tileAdr = ppu->bgLayer[i].tileAdr;
+  }
+}
+
+// Bitmask of the 1K word blocks of vram in [start, start + words)
+static uint32 PpuVramBlocks(uint start, uint words) {
+  uint32 mask = 0;
+  for (uint i = 0, n = ((start & 0x3ff) + words + 0x3ff) >> 10; i < n; i++)
+    mask |= 1u << (((start & 0x7fff) >> 10) + i & 31);
+  return mask;
+}
+
+// The vram blocks that a line drawn with this state can read
+static uint32 PpuLineState_VramBlocks(const PpuLineState *s) {
+  if (s->mode != 1)
+    return ~0u;
+  uint32 mask = PpuVramBlocks(s->objTileAdr1, 0x2000) | PpuVramBlocks(s->objTileAdr2, 0x2000);
+  for (int i = 0; i < 3; i++)
+    mask |= PpuVramBlocks(s->bgLayer[i].tilemapAdr, 0x1000) | PpuVramBlocks(s->bgLayer[i].tileAdr, i < 2 ? 0x4000 : 0x2000);
+  return mask;
+}
+
+static void PpuLineCache_CheckMemory(Ppu *ppu, PpuLineCache *c) {
+  for (int i = 0; i < 32; i++) {
+    if (memcmp(&c->vram[i * 1024], &ppu->vram[i * 1024], 1024 * sizeof(uint16))) {
+      memcpy(&c->vram[i * 1024], &ppu->vram[i * 1024], 1024 * sizeof(uint16));
+      c->vramChanged[i] = c->frame;
+    }
+  }
+  if (memcmp(c->cgram, ppu->cgram, sizeof(c->cgram))) {
+    memcpy(c->cgram, ppu->cgram, sizeof(c->cgram));
+    c->cgramChanged = c->frame;
+  }
+  if (memcmp(c->oam, ppu->oam, sizeof(c->oam))) {
+    memcpy(c->oam, ppu->oam, sizeof(c->oam));
+    c->oamChanged = c->frame;
+  }
+}
+
+// Copies the line from the last frame if it would be drawn exactly the same. Otherwise
+// remembers the state, so PpuLineCache_Store can save the line once it's drawn.
+static bool PpuLineCache_Lookup(Ppu *ppu, int line) {
+  PpuLineCache *c = ppu->lineCache;
+  c->pending = false;
+  if (!(ppu->renderFlags & kPpuRenderFlags_NewRenderer) || line >= 225 + ppu->extraBottomCur ||
+      ppu->mode == 7 && (ppu->renderFlags & kPpuRenderFlags_4x4Mode7))
+    return false;
+  if (ppu->lineCacheCheckMemory) {
+    ppu->lineCacheCheckMemory = false;
+    PpuLineCache_CheckMemory(ppu, c);
+  }
+  PpuLineState_Get(ppu, &c->state);
+  c->pending = true;
+  PpuLineCacheEntry *e = &c->lines[line - 1];
+  if (!e->valid || memcmp(&e->state, &c->state, sizeof(PpuLineState)) != 0)
+    return false;
+  uint32 changed = UintMax(c->cgramChanged, c->oamChanged);
+  for (uint32 mask = PpuLineState_VramBlocks(&c->state), i = 0; mask; mask >>= 1, i++) {
+    if (mask & 1)
+      changed = UintMax(changed, c->vramChanged[i]);
+  }
+  if (changed > e->frame)
+    return false;
+  c->pending = false;
+  memcpy(&ppu->renderBuffer[(line - 1) * ppu->renderPitch], c->pixels[line - 1],
+         PpuBytesPerPixel(ppu) * (256 + ppu->extraLeftRight * 2));
+  ppu->lineCacheHits++;
+  ppu->lineCopied[(line - 1) >> 5] |= 1u << ((line - 1) & 31);
+  return true;
+}
+
+static void PpuLineCache_Store(Ppu *ppu, int line) {
+  PpuLineCache *c = ppu->lineCache;
+  if (!c->pending)
+    return;
+  PpuLineCacheEntry *e = &c->lines[line - 1];
+  e->state = c->state;
+  e->frame = c->frame;
+  e->valid = true;
+  memcpy(c->pixels[line - 1], &ppu->renderBuffer[(line - 1) * ppu->renderPitch],
+         PpuBytesPerPixel(ppu) * (256 + ppu->extraLeftRight * 2));
+  ppu->lineCacheMisses++;
+}
+
 void PpuBeginDrawing(Ppu *ppu, uint8_t *pixels, size_t pitch, uint32_t render_flags) {
   ppu->renderFlags = render_flags;
+  ppu->bgCacheFrame++;
+  ppu->lineCacheHits = ppu->lineCacheMisses = 0;
+  memset(ppu->lineCopied, 0, sizeof(ppu->lineCopied));
+  if (render_flags & kPpuRenderFlags_LineCache) {
+    if (!ppu->lineCache)
+      ppu->lineCache = ArenaAlloc("ppu line cache", sizeof(PpuLineCache));
+    // Vram, cgram and oam are written directly between frames
+    ppu->lineCache->frame++;
+    ppu->lineCacheCheckMemory = true;
+  }
   ppu->renderPitch = (uint)pitch;
   ppu->renderBuffer = pixels;
 
-  // Cache the brightness computation
-  if (ppu->brightness != ppu->lastBrightnessMult) {
+  // Cache the brightness computation, in the pixel format of the output
+  uint8 pixel_format = render_flags & kPpuRenderFlags_PixelFormatMask;
+  if (ppu->brightness != ppu->lastBrightnessMult || pixel_format != ppu->lastPixelFormat) {
     uint8_t ppu_brightness = ppu->brightness;
     ppu->lastBrightnessMult = ppu_brightness;
-    for (int i = 0; i < 32; i++)
-      ppu->brightnessMultHalf[i * 2] = ppu->brightnessMultHalf[i * 2 + 1] = ppu->brightnessMult[i] =
-      ((i << 3) | (i >> 2)) * ppu_brightness / 15;
-    // Store 31 extra entries to remove the need for clamping to 31.
-    memset(&ppu->brightnessMult[32], ppu->brightnessMult[31], 31);
+    ppu->lastPixelFormat = pixel_format;
+    PpuBrightnessMap *map = &ppu->brightnessMap[0], *half = &ppu->brightnessMap[1];
+    for (int i = 0; i < 64; i++) {
+      uint32 v = ((IntMin(i, 31) << 3) | (IntMin(i, 31) >> 2)) * ppu_brightness / 15;
+      map->r[i] = PpuPackColor(pixel_format, v, 0, 0);
+      map->g[i] = PpuPackColor(pixel_format, 0, v, 0);
+      map->b[i] = PpuPackColor(pixel_format, 0, 0, v);
+    }
+    for (int i = 0; i < 64; i++) {
+      half->r[i] = map->r[i >> 1];
+      half->g[i] = map->g[i >> 1];
+      half->b[i] = map->b[i >> 1];
+    }
   }
 
   if (PpuGetCurrentRenderScale(ppu, ppu->renderFlags) == 4) {
+    const PpuBrightnessMap *map = &ppu->brightnessMap[0];
     for (int i = 0; i < 256; i++) {
       uint32 color = ppu->cgram[i];
-      ppu->colorMapRgb[i] = ppu->brightnessMult[color & 0x1f] << 16 | ppu->brightnessMult[(color >> 5) & 0x1f] << 8 | ppu->brightnessMult[(color >> 10) & 0x1f];
+      ppu->colorMapRgb[i] = map->r[color & 0x1f] | map->g[(color >> 5) & 0x1f] | map->b[(color >> 10) & 0x1f];
     }
   }
 }
@@ -169,18 +384,22 @@ void ppu_runLine(Ppu *ppu, int line) {
         j = (j + 1 == mod ? 0 : j + 1);
       }
     }
+    if ((ppu->renderFlags & kPpuRenderFlags_LineCache) && PpuLineCache_Lookup(ppu, line))
+      return;
     // evaluate sprites
     ClearBackdrop(&ppu->objBuffer);
     ppu->lineHasSprites = !ppu->forcedBlank && ppu_evaluateSprites(ppu, line - 1);
 
     // outside of visible range?
     if (line >= 225 + ppu->extraBottomCur) {
-      memset(&ppu->renderBuffer[(line - 1) * ppu->renderPitch], 0, sizeof(uint32) * (256 + ppu->extraLeftRight * 2));
+      memset(&ppu->renderBuffer[(line - 1) * ppu->renderPitch], 0, PpuBytesPerPixel(ppu) * (256 + ppu->extraLeftRight * 2));
       return;
     }
 
     if (ppu->renderFlags & kPpuRenderFlags_NewRenderer) {
       PpuDrawWholeLine(ppu, line);
+      if (ppu->renderFlags & kPpuRenderFlags_LineCache)
+        PpuLineCache_Store(ppu, line);
     } else {
       if (ppu->mode == 7)
         ppu_calculateMode7Starts(ppu, line);
@@ -188,20 +407,15 @@ void ppu_runLine(Ppu *ppu, int line) {
         ppu_handlePixel(ppu, x, line);
 
       uint8 *dst = ppu->renderBuffer + ((line - 1) * ppu->renderPitch);
+      size_t bpp = PpuBytesPerPixel(ppu);
       if (ppu->extraLeftRight != 0) {
-        memset(dst, 0, sizeof(uint32) * ppu->extraLeftRight);
-        memset(dst + sizeof(uint32) * (256 + ppu->extraLeftRight), 0, sizeof(uint32) * ppu->extraLeftRight);
+        memset(dst, 0, bpp * ppu->extraLeftRight);
+        memset(dst + bpp * (256 + ppu->extraLeftRight), 0, bpp * ppu->extraLeftRight);
       }
     }
   }
 }
 
-typedef struct PpuWindows {
-  int16 edges[6];
-  uint8 nr;
-  uint8 bits;
-} PpuWindows;
-
 static void PpuWindows_Clear(PpuWindows *win, Ppu *ppu, uint layer) {
   win->edges[0] = -(layer != 2 ? ppu->extraLeftCur : 0);
   win->edges[1] = 256 + (layer != 2 ? ppu->extraRightCur : 0);
@@ -270,6 +484,16 @@ static void PpuWindows_Calc(PpuWindows *win, Ppu *ppu, uint layer) {
   win->bits = w1_bits | w2_bits;
 }
 
+// The window registers are usually the same for the whole frame, so the spans are
+// only computed again after ppu_write changes one of them.
+static FORCEINLINE const PpuWindows *PpuWindows_Get(Ppu *ppu, uint layer) {
+  if (!(ppu->windowsValid & (1 << layer))) {
+    PpuWindows_Calc(&ppu->windows[layer], ppu, layer);
+    ppu->windowsValid |= 1 << layer;
+  }
+  return &ppu->windows[layer];
+}
+
 // Draw a whole line of a 4bpp background layer into bgBuffers
 static void PpuDrawBackground_4bpp(Ppu *ppu, uint y, bool sub, uint layer, PpuZbufType zhi, PpuZbufType zlo) {
 #define DO_PIXEL(i) do { \
@@ -283,7 +507,10 @@ static void PpuDrawBackground_4bpp(Ppu *ppu, uint y, bool sub, uint layer, PpuZb
   if (!IS_SCREEN_ENABLED(ppu, sub, layer))
     return;  // layer is completely hidden
   PpuWindows win;
-  IS_SCREEN_WINDOWED(ppu, sub, layer) ? PpuWindows_Calc(&win, ppu, layer) : PpuWindows_Clear(&win, ppu, layer);
+  if (IS_SCREEN_WINDOWED(ppu, sub, layer))
+    win = *PpuWindows_Get(ppu, layer);
+  else
+    PpuWindows_Clear(&win, ppu, layer);
   BgLayer *bglayer = &ppu->bgLayer[layer];
   y += bglayer->vScroll;
   int sc_offs = bglayer->tilemapAdr + (((y >> 3) & 0x1f) << 5);
@@ -381,7 +608,10 @@ static void PpuDrawBackground_2bpp(Ppu *ppu, uint y, bool sub, uint layer, PpuZb
   if (!IS_SCREEN_ENABLED(ppu, sub, layer))
     return;  // layer is completely hidden
   PpuWindows win;
-  IS_SCREEN_WINDOWED(ppu, sub, layer) ? PpuWindows_Calc(&win, ppu, layer) : PpuWindows_Clear(&win, ppu, layer);
+  if (IS_SCREEN_WINDOWED(ppu, sub, layer))
+    win = *PpuWindows_Get(ppu, layer);
+  else
+    PpuWindows_Clear(&win, ppu, layer);
   BgLayer *bglayer = &ppu->bgLayer[layer];
   y += bglayer->vScroll;
   int sc_offs = bglayer->tilemapAdr + (((y >> 3) & 0x1f) << 5);
@@ -478,7 +708,10 @@ static void PpuDrawBackground_4bpp_mosaic(Ppu *ppu, uint y, bool sub, uint layer
   if (!IS_SCREEN_ENABLED(ppu, sub, layer))
     return;  // layer is completely hidden
   PpuWindows win;
-  IS_SCREEN_WINDOWED(ppu, sub, layer) ? PpuWindows_Calc(&win, ppu, layer) : PpuWindows_Clear(&win, ppu, layer);
+  if (IS_SCREEN_WINDOWED(ppu, sub, layer))
+    win = *PpuWindows_Get(ppu, layer);
+  else
+    PpuWindows_Clear(&win, ppu, layer);
   BgLayer *bglayer = &ppu->bgLayer[layer];
   y = ppu->mosaicModulo[y] + bglayer->vScroll;
   int sc_offs = bglayer->tilemapAdr + (((y >> 3) & 0x1f) << 5);
@@ -537,7 +770,10 @@ static void PpuDrawBackground_2bpp_mosaic(Ppu *ppu, int y, bool sub, uint layer,
   if (!IS_SCREEN_ENABLED(ppu, sub, layer))
     return;  // layer is completely hidden
   PpuWindows win;
-  IS_SCREEN_WINDOWED(ppu, sub, layer) ? PpuWindows_Calc(&win, ppu, layer) : PpuWindows_Clear(&win, ppu, layer);
+  if (IS_SCREEN_WINDOWED(ppu, sub, layer))
+    win = *PpuWindows_Get(ppu, layer);
+  else
+    PpuWindows_Clear(&win, ppu, layer);
   BgLayer *bglayer = &ppu->bgLayer[layer];
   y = ppu->mosaicModulo[y] + bglayer->vScroll;
   int sc_offs = bglayer->tilemapAdr + (((y >> 3) & 0x1f) << 5);
@@ -597,7 +833,10 @@ static void PpuDrawSprites(Ppu *ppu, uint y, uint sub, bool clear_backdrop) {
   if (!IS_SCREEN_ENABLED(ppu, sub, layer))
     return;  // layer is completely hidden
   PpuWindows win;
-  IS_SCREEN_WINDOWED(ppu, sub, layer) ? PpuWindows_Calc(&win, ppu, layer) : PpuWindows_Clear(&win, ppu, layer);
+  if (IS_SCREEN_WINDOWED(ppu, sub, layer))
+    win = *PpuWindows_Get(ppu, layer);
+  else
+    PpuWindows_Clear(&win, ppu, layer);
   for (size_t windex = 0; windex < win.nr; windex++) {
     if (win.bits & (1 << windex))
       continue;  // layer is disabled for this window part
@@ -616,13 +855,147 @@ static void PpuDrawSprites(Ppu *ppu, uint y, uint sub, bool clear_backdrop) {
   }
 }
 
+// The pixels of a whole 512x512 background layer, so that drawing a line is a copy
+// from the current scroll position. Each byte is the priority in bit 7, then the
+// palette and the color, or 0 if transparent. The tilemap and the tiles are kept
+// too, to find what changed in vram since the last frame.
+struct PpuBgCache {
+  bool valid;
+  uint8 bpp;
+  bool tilemapWider, tilemapHigher;
+  uint16 tilemapAdr, tileAdr;
+  uint32 frame;
+  uint16 tilemap[64 * 64];
+  uint16 tiles[1024 * 16];
+  uint8 pixels[512 * 512];
+};
+
+static void PpuBgCache_DrawTile(Ppu *ppu, PpuBgCache *c, uint tx, uint ty, uint tile) {
+  uint words = c->bpp * 4;
+  uint8 base = (tile & 0x2000 ? 0x80 : 0) | (tile & 0x1c00) >> (c->bpp == 4 ? 6 : 8);
+  int shift = (tile & 0x4000) ? 0 : 7, step = (tile & 0x4000) ? 1 : -1;
+  uint8 *dst = &c->pixels[ty * 8 * 512 + tx * 8];
+  for (uint r = 0; r < 8; r++, dst += 512) {
+    const uint16 *addr = &ppu->vram[(c->tileAdr + ((tile & 0x8000) ? 7 - r : r) + (tile & 0x3ff) * words) & 0x7fff];
+    uint32 bits = (c->bpp == 4) ? addr[0] | addr[8] << 16 : addr[0];
+    for (int x = 0, i = shift; x < 8; x++, i += step) {
+      uint pixel = (bits >> i) & 1 | (bits >> (7 + i)) & 2 | (bits >> (14 + i)) & 4 | (bits >> (21 + i)) & 8;
+      dst[x] = pixel ? base | pixel : 0;
+    }
+  }
+}
+
+// Brings the cached pixels of a layer up to date with vram. Vram is compared only on
+// the first line of each frame that uses the layer, since the game writes it directly.
+static PpuBgCache *PpuBgCache_Update(Ppu *ppu, uint layer, uint bpp) {
+  PpuBgCache *c = ppu->bgCache[layer];
+  if (!c)
+    c = ppu->bgCache[layer] = ArenaAlloc("ppu bg cache", sizeof(PpuBgCache));
+  BgLayer *bglayer = &ppu->bgLayer[layer];
+  bool full = !c->valid || c->bpp != bpp || c->tilemapAdr != bglayer->tilemapAdr || c->tileAdr != bglayer->tileAdr ||
+              c->tilemapWider != bglayer->tilemapWider || c->tilemapHigher != bglayer->tilemapHigher;
+  if (!full && c->frame == ppu->bgCacheFrame)
+    return c;
+  c->valid = true;
+  c->frame = ppu->bgCacheFrame;
+  c->bpp = bpp;
+  c->tilemapAdr = bglayer->tilemapAdr;
+  c->tileAdr = bglayer->tileAdr;
+  c->tilemapWider = bglayer->tilemapWider;
+  c->tilemapHigher = bglayer->tilemapHigher;
+
+  // Tiles start on a multiple of their size, so a tile never wraps around vram
+  uint words = bpp * 4;
+  uint8 dirty[1024 / 8] = { 0 };
+  for (uint t = 0; t < 1024; t++) {
+    const uint16 *src = &ppu->vram[(c->tileAdr + t * words) & 0x7fff];
+    if (full || memcmp(&c->tiles[t * words], src, words * sizeof(uint16))) {
+      memcpy(&c->tiles[t * words], src, words * sizeof(uint16));
+      dirty[t >> 3] |= 1 << (t & 7);
+    }
+  }
+  uint offs_x = c->tilemapWider ? 0x400 : 0;
+  uint offs_y = c->tilemapHigher ? (c->tilemapWider ? 0x800 : 0x400) : 0;
+  for (uint ty = 0; ty < 64; ty++) {
+    uint row_offs = c->tilemapAdr + (ty >> 5) * offs_y + (ty & 31) * 32;
+    const uint16 *rows[2] = { &ppu->vram[row_offs & 0x7fff], &ppu->vram[(row_offs + offs_x) & 0x7fff] };
+    uint16 *cached = &c->tilemap[ty * 64];
+    for (uint tx = 0; tx < 64; tx++) {
+      uint tile = rows[tx >> 5][tx & 31];
+      if (tile != cached[tx] || full || (dirty[(tile & 0x3ff) >> 3] & 1 << (tile & 7))) {
+        cached[tx] = tile;
+        PpuBgCache_DrawTile(ppu, c, tx, ty, tile);
+      }
+    }
+  }
+  return c;
+}
+
+// Draw a whole line of a 4bpp or 2bpp background layer into bgBuffers, from the layer cache
+static void PpuDrawBackground_cached(Ppu *ppu, uint y, bool sub, uint layer, PpuZbufType zhi, PpuZbufType zlo, uint bpp) {
+  if (!IS_SCREEN_ENABLED(ppu, sub, layer))
+    return;  // layer is completely hidden
+  PpuWindows win;
+  if (IS_SCREEN_WINDOWED(ppu, sub, layer))
+    win = *PpuWindows_Get(ppu, layer);
+  else
+    PpuWindows_Clear(&win, ppu, layer);
+  PpuBgCache *c = PpuBgCache_Update(ppu, layer, bpp);
+  BgLayer *bglayer = &ppu->bgLayer[layer];
+  const uint8 *row = &c->pixels[((y + bglayer->vScroll) & 511) * 512];
+  uint color_mask = (bpp == 4) ? 15 : 3;
+#if defined(__SSE2__) || defined(_M_X64)
+  // The z compare is unsigned, so it's done signed with the top bits flipped
+  __m128i vzero = _mm_setzero_si128(), vflip = _mm_set1_epi16(-0x8000), vprio = _mm_set1_epi16(0x80);
+  __m128i vzhi = _mm_set1_epi16(zhi), vzlo = _mm_set1_epi16(zlo);
+  __m128i vcolor = _mm_set1_epi16(color_mask), vpalette = _mm_set1_epi16(0x7f & ~color_mask);
+#endif
+  for (size_t windex = 0; windex < win.nr; windex++) {
+    if (win.bits & (1 << windex))
+      continue;  // layer is disabled for this window part
+    uint x = win.edges[windex] + bglayer->hScroll;
+    uint w = win.edges[windex + 1] - win.edges[windex];
+    PpuZbufType *dstz = ppu->bgBuffers[sub].data + win.edges[windex] + kPpuExtraLeftRight;
+    while (w) {
+      uint n = UintMin(w, 512 - (x & 511));
+      const uint8 *src = row + (x & 511);
+      uint i = 0;
+#if defined(__SSE2__) || defined(_M_X64)
+      for (; i + 8 <= n; i += 8) {
+        __m128i v = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)(src + i)), vzero);
+        __m128i prio = _mm_cmpeq_epi16(_mm_and_si128(v, vprio), vprio);
+        __m128i z = _mm_or_si128(_mm_and_si128(prio, vzhi), _mm_andnot_si128(prio, vzlo));
+        z = _mm_add_epi16(z, _mm_and_si128(v, vpalette));
+        __m128i d = _mm_loadu_si128((const __m128i *)(dstz + i));
+        __m128i take = _mm_andnot_si128(_mm_cmpeq_epi16(v, vzero),
+                                        _mm_cmpgt_epi16(_mm_xor_si128(z, vflip), _mm_xor_si128(d, vflip)));
+        z = _mm_add_epi16(z, _mm_and_si128(v, vcolor));
+        _mm_storeu_si128((__m128i *)(dstz + i), _mm_or_si128(_mm_and_si128(take, z), _mm_andnot_si128(take, d)));
+      }
+#endif
+      for (; i < n; i++) {
+        uint v = src[i];
+        if (v) {
+          PpuZbufType z = ((v & 0x80) ? zhi : zlo) + (v & 0x7f & ~color_mask);
+          if (z > dstz[i])
+            dstz[i] = z + (v & color_mask);
+        }
+      }
+      dstz += n, x += n, w -= n;
+    }
+  }
+}
+
 // Assumes it's drawn on an empty backdrop
 static void PpuDrawBackground_mode7(Ppu *ppu, uint y, bool sub, PpuZbufType z) {
   int layer = 0;
   if (!IS_SCREEN_ENABLED(ppu, sub, layer))
     return;  // layer is completely hidden
   PpuWindows win;
-  IS_SCREEN_WINDOWED(ppu, sub, layer) ? PpuWindows_Calc(&win, ppu, layer) : PpuWindows_Clear(&win, ppu, layer);
+  if (IS_SCREEN_WINDOWED(ppu, sub, layer))
+    win = *PpuWindows_Get(ppu, layer);
+  else
+    PpuWindows_Clear(&win, ppu, layer);
 
   // expand 13-bit values to signed values
   int hScroll = ((int16_t)(ppu->m7matrix[6] << 3)) >> 3;
@@ -693,20 +1066,169 @@ void PpuSetMode7PerspectiveCorrection(Ppu *ppu, int low, int high) {
   ppu->mode7PerspectiveHigh = 1.0f / high;
 }
 
+bool PpuIsRowCopied(Ppu *ppu, int row) {
+  return (uint)row < 256 && (ppu->lineCopied[row >> 5] >> (row & 31) & 1);
+}
+
 void PpuSetExtraSideSpace(Ppu *ppu, int left, int right, int bottom) {
   ppu->extraLeftCur = UintMin(left, ppu->extraLeftRight);
   ppu->extraRightCur = UintMin(right, ppu->extraLeftRight);
   ppu->extraBottomCur = UintMin(bottom, 16);
+  ppu->windowsValid = 0;
 }
 
 static FORCEINLINE float FloatInterpolate(float x, float xmin, float xmax, float ymin, float ymax) {
   return ymin + (ymax - ymin) * (x - xmin) * (1.0f / (xmax - xmin));
 }
 
+// Everything needed to draw one line of upsampled mode7, captured when the
+// line is reached so that it can be drawn later on another thread.
+typedef struct PpuMode7Line {
+  uint8 *render_buffer_ptr;
+  uint32 xcur[4], ycur[4], m0[4];
+  uint32 m2;
+  bool half_color;
+  bool has_sprites;
+  uint8 extra_left, extra_right;
+  uint8 obj[kPpuXPixels];
+} PpuMode7Line;
+
+enum {
+  kPpuMaxDeferredMode7Lines = 256,
+};
+
+// Draws |n| upsampled mode7 pixels of |bpp| bytes each. n is a multiple of 4.
+static FORCEINLINE void PpuDrawMode7Pixels(const Ppu *ppu, uint8 *dst, size_t n, uint32 xcur, uint32 ycur,
+                                           uint32 m0, uint32 m2, bool half_color, size_t bpp) {
+  const uint16 *vram = ppu->vram;
+  const uint32 *color_map = ppu->colorMapRgb;
+  uint32 color_mask = half_color ? PpuHalfColorMask(ppu) : 0xffffff;
+  int color_shift = half_color;
+  size_t i = 0;
+#if defined(__AVX2__)
+  // The vram indexes are at most 0x3fff, so the 32-bit gathers never read
+  // past the end of vram.
+  __m256i xv = _mm256_add_epi32(_mm256_set1_epi32(xcur), _mm256_mullo_epi32(_mm256_set1_epi32(m0), _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7)));
+  __m256i yv = _mm256_add_epi32(_mm256_set1_epi32(ycur), _mm256_mullo_epi32(_mm256_set1_epi32(m2), _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7)));
+  __m256i xstep = _mm256_set1_epi32(m0 * 8), ystep = _mm256_set1_epi32(m2 * 8);
+  __m256i m7f = _mm256_set1_epi32(0x7f), m7 = _mm256_set1_epi32(7), mff = _mm256_set1_epi32(0xff);
+  __m256i vmask = _mm256_set1_epi32(color_mask);
+  for (; i + 8 <= n; i += 8) {
+    __m256i tile_idx = _mm256_or_si256(_mm256_slli_epi32(_mm256_and_si256(_mm256_srli_epi32(yv, 25), m7f), 7),
+                                       _mm256_and_si256(_mm256_srli_epi32(xv, 25), m7f));
+    __m256i tile = _mm256_and_si256(_mm256_i32gather_epi32((const int *)vram, tile_idx, 2), mff);
+    __m256i pixel_idx = _mm256_or_si256(_mm256_slli_epi32(tile, 6),
+                        _mm256_or_si256(_mm256_slli_epi32(_mm256_and_si256(_mm256_srli_epi32(yv, 22), m7), 3),
+                                        _mm256_and_si256(_mm256_srli_epi32(xv, 22), m7)));
+    __m256i pixel = _mm256_and_si256(_mm256_srli_epi32(_mm256_i32gather_epi32((const int *)vram, pixel_idx, 2), 8), mff);
+    pixel = _mm256_andnot_si256(_mm256_srai_epi32(xv, 31), pixel);
+    __m256i color = _mm256_i32gather_epi32((const int *)color_map, pixel, 4);
+    color = _mm256_srli_epi32(_mm256_and_si256(color, vmask), color_shift);
+    if (bpp == 2)
+      _mm_storeu_si128((__m128i *)(dst + i * 2), _mm_packus_epi32(_mm256_castsi256_si128(color), _mm256_extracti128_si256(color, 1)));
+    else
+      _mm256_storeu_si256((__m256i *)(dst + i * 4), color);
+    xv = _mm256_add_epi32(xv, xstep);
+    yv = _mm256_add_epi32(yv, ystep);
+  }
+  xcur += m0 * (uint32)i;
+  ycur += m2 * (uint32)i;
+#elif defined(__SSE2__) || defined(_M_X64)
+  // No gathers, but the address math for 4 pixels is done at once.
+  __m128i xv = _mm_add_epi32(_mm_set1_epi32(xcur), _mm_setr_epi32(0, m0, m0 * 2, m0 * 3));
+  __m128i yv = _mm_add_epi32(_mm_set1_epi32(ycur), _mm_setr_epi32(0, m2, m2 * 2, m2 * 3));
+  __m128i xstep = _mm_set1_epi32(m0 * 4), ystep = _mm_set1_epi32(m2 * 4);
+  __m128i m7f = _mm_set1_epi32(0x7f), m7 = _mm_set1_epi32(7);
+  for (; i + 4 <= n; i += 4) {
+    uint32 tile_idx[4], sub_idx[4], sign[4];
+    _mm_storeu_si128((__m128i *)tile_idx, _mm_or_si128(_mm_slli_epi32(_mm_and_si128(_mm_srli_epi32(yv, 25), m7f), 7),
+                                                       _mm_and_si128(_mm_srli_epi32(xv, 25), m7f)));
+    _mm_storeu_si128((__m128i *)sub_idx, _mm_or_si128(_mm_slli_epi32(_mm_and_si128(_mm_srli_epi32(yv, 22), m7), 3),
+                                                      _mm_and_si128(_mm_srli_epi32(xv, 22), m7)));
+    _mm_storeu_si128((__m128i *)sign, _mm_srai_epi32(xv, 31));
+    for (int k = 0; k < 4; k++) {
+      uint32 pixel = vram[(vram[tile_idx[k]] & 0xff) * 64 + sub_idx[k]] >> 8;
+      uint32 color = (color_map[pixel & ~sign[k]] & color_mask) >> color_shift;
+      if (bpp == 2)
+        ((uint16 *)dst)[i + k] = color;
+      else
+        ((uint32 *)dst)[i + k] = color;
+    }
+    xv = _mm_add_epi32(xv, xstep);
+    yv = _mm_add_epi32(yv, ystep);
+  }
+  xcur += m0 * (uint32)i;
+  ycur += m2 * (uint32)i;
+#endif
+  for (; i < n; i++) {
+    uint32 tile = vram[(ycur >> 25 & 0x7f) * 128 + (xcur >> 25 & 0x7f)] & 0xff;
+    uint32 pixel = vram[tile * 64 + (ycur >> 22 & 7) * 8 + (xcur >> 22 & 7)] >> 8;
+    pixel = (xcur & 0x80000000) ? 0 : pixel;
+    uint32 color = (color_map[pixel] & color_mask) >> color_shift;
+    if (bpp == 2)
+      ((uint16 *)dst)[i] = color;
+    else
+      ((uint32 *)dst)[i] = color;
+    xcur += m0, ycur += m2;
+  }
+}
+
+// Draws sub row |j| of an upsampled mode7 line, including sprites and side borders.
+static FORCEINLINE void PpuDrawMode7UpsampledRowBpp(const Ppu *ppu, const PpuMode7Line *line, int j, size_t bpp) {
+  size_t pitch = ppu->renderPitch;
+  uint8 *row = line->render_buffer_ptr + pitch * j;
+  uint8 *dst = row + (ppu->extraLeftRight - line->extra_left) * 4 * bpp;
+  size_t draw_width = 256 + line->extra_left + line->extra_right;
+
+  PpuDrawMode7Pixels(ppu, dst, draw_width * 4, line->xcur[j], line->ycur[j], line->m0[j], line->m2, line->half_color, bpp);
+
+  if (line->has_sprites) {
+    const uint8 *pixels = line->obj;
+    for (size_t i = 0; i < draw_width; i++, dst += 4 * bpp) {
+      uint32 pixel = pixels[i];
+      if (pixel) {
+        uint32 color = ppu->colorMapRgb[pixel];
+        if (bpp == 2)
+          ((uint16 *)dst)[3] = ((uint16 *)dst)[2] = ((uint16 *)dst)[1] = ((uint16 *)dst)[0] = color;
+        else
+          ((uint32 *)dst)[3] = ((uint32 *)dst)[2] = ((uint32 *)dst)[1] = ((uint32 *)dst)[0] = color;
+      }
+    }
+  }
+
+  if (ppu->extraLeftRight - line->extra_left != 0) {
+    size_t n = 4 * bpp * (ppu->extraLeftRight - line->extra_left);
+    memset(row, 0, n);
+  }
+  if (ppu->extraLeftRight - line->extra_right != 0) {
+    size_t n = 4 * bpp * (ppu->extraLeftRight - line->extra_right);
+    memset(row + (256 + ppu->extraLeftRight * 2 - (ppu->extraLeftRight - line->extra_right)) * 4 * bpp, 0, n);
+  }
+}
+
+static void PpuDrawMode7UpsampledRow(const Ppu *ppu, const PpuMode7Line *line, int j) {
+  if (PpuBytesPerPixel(ppu) == 2)
+    PpuDrawMode7UpsampledRowBpp(ppu, line, j, 2);
+  else
+    PpuDrawMode7UpsampledRowBpp(ppu, line, j, 4);
+}
+
+static void PpuDrawDeferredMode7Row(void *ctx, int i) {
+  Ppu *ppu = (Ppu *)ctx;
+  PpuDrawMode7UpsampledRow(ppu, &ppu->mode7Lines[i >> 2], i & 3);
+}
+
 // Upsampled version of mode7 rendering. Draws everything in 4x the normal resolution.
 // Draws directly to the pixel buffer and bypasses any math, and supports only
 // a subset of the normal features (all that zelda needs)
+// With a parallel for function set, the line is only captured here and drawn
+// together with the others in PpuEndDrawing.
 static void PpuDrawMode7Upsampled(Ppu *ppu, uint y) {
+  PpuMode7Line tmp_line, *line = &tmp_line;
+  bool deferred = ppu->parallelFor && ppu->mode7Lines && ppu->mode7LineCount < kPpuMaxDeferredMode7Lines;
+  if (deferred)
+    line = &ppu->mode7Lines[ppu->mode7LineCount++];
+
   // expand 13-bit values to signed values
   uint32 xCenter = ((int16_t)(ppu->m7matrix[4] << 3)) >> 3, yCenter = ((int16_t)(ppu->m7matrix[5] << 3)) >> 3;
   uint32 clippedH = (((int16_t)(ppu->m7matrix[6] << 3)) >> 3) - xCenter;
@@ -719,19 +1241,18 @@ static void PpuDrawMode7Upsampled(Ppu *ppu, uint y) {
     for (int i = 0; i < 4; i++)
       m0v[i] = 4096.0f / FloatInterpolate((int)y + kInterpolateOffsets[i], 0, 223, ppu->mode7PerspectiveLow, ppu->mode7PerspectiveHigh);
   }
-  size_t pitch = ppu->renderPitch;
-  uint8 *render_buffer_ptr = &ppu->renderBuffer[(y - 1) * 4 * pitch];
-  uint8 *dst_start = render_buffer_ptr + (ppu->extraLeftRight - ppu->extraLeftCur) * 16;
-  size_t draw_width = 256 + ppu->extraLeftCur + ppu->extraRightCur;
-  uint8 *dst_curline = dst_start;
+  line->render_buffer_ptr = &ppu->renderBuffer[(y - 1) * 4 * ppu->renderPitch];
+  line->extra_left = ppu->extraLeftCur;
+  line->extra_right = ppu->extraRightCur;
+  line->half_color = ppu->halfColor;
   uint32 m1 = ppu->m7matrix[1] << 12;  // xpos increment per vert movement
   uint32 m2 = ppu->m7matrix[2] << 12;  // ypos increment per horiz movement
+  line->m2 = m2;
   for (int j = 0; j < 4; j++) {
     uint32 m0 = m0v[j], m3 = m0;
     uint32 xpos = m0 * clippedH + m1 * (clippedV + y) + (xCenter << 20), xcur;
     uint32 ypos = m2 * clippedH + m3 * (clippedV + y) + (yCenter << 20), ycur;
 
-    uint32 tile, pixel;
     xpos -= (m0 + m1) >> 1;
     ypos -= (m2 + m3) >> 1;
     xcur = (xpos << 2) + j * m1;
@@ -739,63 +1260,62 @@ static void PpuDrawMode7Upsampled(Ppu *ppu, uint y) {
 
     xcur -= ppu->extraLeftCur * 4 * m0;
     ycur -= ppu->extraLeftCur * 4 * m2;
+    line->xcur[j] = xcur;
+    line->ycur[j] = ycur;
+    line->m0[j] = m0;
+  }
 
-    uint8 *dst = dst_curline;
-    uint8 *dst_end = dst_curline + draw_width * 16;
+  // The obj buffer is reused by the next line, so keep a copy of the colors.
+  line->has_sprites = ppu->lineHasSprites;
+  if (ppu->lineHasSprites) {
+    const PpuZbufType *pixels = ppu->objBuffer.data + (kPpuExtraLeftRight - ppu->extraLeftCur);
+    size_t draw_width = 256 + ppu->extraLeftCur + ppu->extraRightCur;
+    for (size_t i = 0; i < draw_width; i++)
+      line->obj[i] = (uint8)pixels[i];
+  }
 
-#define DRAW_PIXEL(mode) \
-    tile = ppu->vram[(ycur >> 25 & 0x7f) * 128 + (xcur >> 25 & 0x7f)] & 0xff;  \
-    pixel = ppu->vram[tile * 64 + (ycur >> 22 & 7) * 8 + (xcur >> 22 & 7)] >> 8; \
-    pixel = (xcur & 0x80000000) ? 0 : pixel; \
-    *(uint32*)dst = (mode ? (ppu->colorMapRgb[pixel] & 0xfefefe) >> 1 : ppu->colorMapRgb[pixel]); \
-    xcur += m0, ycur += m2, dst += 4;
+  if (!deferred) {
+    for (int j = 0; j < 4; j++)
+      PpuDrawMode7UpsampledRow(ppu, line, j);
+  }
+}
 
-    if (!ppu->halfColor) {
-      do {
-        DRAW_PIXEL(0);
-        DRAW_PIXEL(0);
-        DRAW_PIXEL(0);
-        DRAW_PIXEL(0);
-      } while (dst != dst_end);
-    } else {
-      do {
-        DRAW_PIXEL(1);
-        DRAW_PIXEL(1);
-        DRAW_PIXEL(1);
-        DRAW_PIXEL(1);
-      } while (dst != dst_end);
-    }
-#undef DRAW_PIXEL
+void PpuCopyState(Ppu *dst, const Ppu *src) {
+  // The caches of |dst| stay, they are checked against the copied state when drawing.
+  // The per line buffers and colorMapRgb are rebuilt while drawing.
+  dst->extraLeftCur = src->extraLeftCur;
+  dst->extraRightCur = src->extraRightCur;
+  dst->extraLeftRight = src->extraLeftRight;
+  dst->extraBottomCur = src->extraBottomCur;
+  dst->mode7PerspectiveLow = src->mode7PerspectiveLow;
+  dst->mode7PerspectiveHigh = src->mode7PerspectiveHigh;
+  memcpy(&dst->screenEnabled, &src->screenEnabled, offsetof(Ppu, brightnessMap) - offsetof(Ppu, screenEnabled));
+  memcpy(dst->cgram, src->cgram, sizeof(dst->cgram));
+  memcpy(dst->vram, src->vram, sizeof(dst->vram));
+}
 
-    dst_curline += pitch;
-  }
+void PpuSaveLoadDrawState(Ppu *ppu, SaveLoadFunc *func, void *ctx) {
+  // The same state as PpuCopyState
+  func(ctx, &ppu->extraLeftCur, 4);
+  func(ctx, &ppu->mode7PerspectiveLow, sizeof(float) * 2);
+  func(ctx, &ppu->screenEnabled, offsetof(Ppu, brightnessMap) - offsetof(Ppu, screenEnabled));
+  func(ctx, ppu->cgram, sizeof(ppu->cgram));
+  func(ctx, ppu->vram, sizeof(ppu->vram));
+}
 
-  if (ppu->lineHasSprites) {
-    uint8 *dst = dst_start;
-    PpuZbufType *pixels = ppu->objBuffer.data + (kPpuExtraLeftRight - ppu->extraLeftCur);
-    for (size_t i = 0; i < draw_width; i++, dst += 16) {
-      uint32 pixel = pixels[i] & 0xff;
-      if (pixel) {
-        uint32 color = ppu->colorMapRgb[pixel];
-        ((uint32 *)dst)[3] = ((uint32 *)dst)[2] = ((uint32 *)dst)[1] = ((uint32 *)dst)[0] = color;
-        ((uint32 *)(dst + pitch * 1))[3] = ((uint32 *)(dst + pitch * 1))[2] = ((uint32 *)(dst + pitch * 1))[1] = ((uint32 *)(dst + pitch * 1))[0] = color;
-        ((uint32 *)(dst + pitch * 2))[3] = ((uint32 *)(dst + pitch * 2))[2] = ((uint32 *)(dst + pitch * 2))[1] = ((uint32 *)(dst + pitch * 2))[0] = color;
-        ((uint32 *)(dst + pitch * 3))[3] = ((uint32 *)(dst + pitch * 3))[2] = ((uint32 *)(dst + pitch * 3))[1] = ((uint32 *)(dst + pitch * 3))[0] = color;
-      }
-    }
+void PpuSetParallelFor(Ppu *ppu, PpuParallelForFunc *func) {
+  ppu->parallelFor = func;
+  if (func && !ppu->mode7Lines) {
+    ppu->mode7Lines = ArenaAlloc("ppu mode7 lines", sizeof(PpuMode7Line) * kPpuMaxDeferredMode7Lines);
   }
+  ppu->mode7LineCount = 0;
+}
 
-  if (ppu->extraLeftRight - ppu->extraLeftCur != 0) {
-    size_t n = 4 * sizeof(uint32) * (ppu->extraLeftRight - ppu->extraLeftCur);
-    for(int i = 0; i < 4; i++)
-      memset(render_buffer_ptr + pitch * i, 0, n);
+void PpuEndDrawing(Ppu *ppu) {
+  if (ppu->mode7LineCount != 0) {
+    ppu->parallelFor(&PpuDrawDeferredMode7Row, ppu, ppu->mode7LineCount * 4);
+    ppu->mode7LineCount = 0;
   }
-  if (ppu->extraLeftRight - ppu->extraRightCur != 0) {
-    size_t n = 4 * sizeof(uint32) * (ppu->extraLeftRight - ppu->extraRightCur);
-    for (int i = 0; i < 4; i++)
-      memset(render_buffer_ptr + pitch * i + (256 + ppu->extraLeftRight * 2 - (ppu->extraLeftRight - ppu->extraRightCur)) * 4 * sizeof(uint32), 0, n);
-  }
-#undef DRAW_PIXEL
 }
 
 static void PpuDrawBackgrounds(Ppu *ppu, int y, bool sub) {
@@ -818,18 +1338,25 @@ static void PpuDrawBackgrounds(Ppu *ppu, int y, bool sub) {
     if (ppu->lineHasSprites)
       PpuDrawSprites(ppu, y, sub, true);
 
+    bool cached = ppu->renderFlags & kPpuRenderFlags_BgLayerCache;
     if (IS_MOSAIC_ENABLED(ppu, 0))
       PpuDrawBackground_4bpp_mosaic(ppu, y, sub, 0, 0xc000, 0x8000);
+    else if (cached)
+      PpuDrawBackground_cached(ppu, y, sub, 0, 0xc000, 0x8000, 4);
     else
       PpuDrawBackground_4bpp(ppu, y, sub, 0, 0xc000, 0x8000);
 
     if (IS_MOSAIC_ENABLED(ppu, 1))
       PpuDrawBackground_4bpp_mosaic(ppu, y, sub, 1, 0xb100, 0x7100);
+    else if (cached)
+      PpuDrawBackground_cached(ppu, y, sub, 1, 0xb100, 0x7100, 4);
     else
       PpuDrawBackground_4bpp(ppu, y, sub, 1, 0xb100, 0x7100);
 
     if (IS_MOSAIC_ENABLED(ppu, 2))
       PpuDrawBackground_2bpp_mosaic(ppu, y, sub, 2, 0xf200, 0x1200);
+    else if (cached)
+      PpuDrawBackground_cached(ppu, y, sub, 2, 0xf200, 0x1200, 2);
     else
       PpuDrawBackground_2bpp(ppu, y, sub, 2, 0xf200, 0x1200);
   } else {
@@ -840,70 +1367,36 @@ static void PpuDrawBackgrounds(Ppu *ppu, int y, bool sub) {
   }
 }
 
-static NOINLINE void PpuDrawWholeLine(Ppu *ppu, uint y) {
-  if (ppu->forcedBlank) {
-    uint8 *dst = &ppu->renderBuffer[(y - 1) * ppu->renderPitch];
-    size_t n = sizeof(uint32) * (256 + ppu->extraLeftRight * 2);
-    memset(dst, 0, n);
-    return;
-  }
-
-  if (ppu->mode == 7 && (ppu->renderFlags & kPpuRenderFlags_4x4Mode7)) {
-    PpuDrawMode7Upsampled(ppu, y);
-    return;
-  }
-
-  // Default background is backdrop
-  ClearBackdrop(&ppu->bgBuffers[0]);
-
-  // Render main screen
-  PpuDrawBackgrounds(ppu, y, false);
-
-  // The 6:th bit is automatically zero, math is never applied to the first half of the sprites.
-  uint32 math_enabled = ppu->mathEnabled;
-
-  // Render also the subscreen?
-  bool rendered_subscreen = false;
-  if (ppu->preventMathMode != 3 && ppu->addSubscreen && math_enabled) {
-    ClearBackdrop(&ppu->bgBuffers[1]);
-    if (ppu->screenEnabled[1] != 0) {
-      PpuDrawBackgrounds(ppu, y, true);
-      rendered_subscreen = true;
-    }
-  }
-
-  // Color window affects the drawing mode in each region
-  PpuWindows cwin;
-  PpuWindows_Calc(&cwin, ppu, 5);
-  static const uint8 kCwBitsMod[8] = {
-    0x00, 0xff, 0xff, 0x00,
-    0xff, 0x00, 0xff, 0x00,
-  };
-  uint32 cw_clip_math = ((cwin.bits & kCwBitsMod[ppu->clipMode]) ^ kCwBitsMod[ppu->clipMode + 4]) |
-                        ((cwin.bits & kCwBitsMod[ppu->preventMathMode]) ^ kCwBitsMod[ppu->preventMathMode + 4]) << 8;
+// Writes the main screen (with color math) to the render buffer, using |bpp| bytes per pixel.
+static FORCEINLINE void PpuWriteLinePixels(Ppu *ppu, uint y, const PpuWindows *cwin, uint32 cw_clip_math,
+                                           uint32 math_enabled, bool rendered_subscreen, size_t bpp) {
+  uint8 *dst = &ppu->renderBuffer[(y - 1) * ppu->renderPitch], *dst_org = dst;
 
-  uint32 *dst = (uint32*)&ppu->renderBuffer[(y - 1) * ppu->renderPitch], *dst_org = dst;
-  
-  dst += (ppu->extraLeftRight - ppu->extraLeftCur);
+  dst += (ppu->extraLeftRight - ppu->extraLeftCur) * bpp;
 
   uint32 windex = 0;
   do {
-    uint32 left = cwin.edges[windex] + kPpuExtraLeftRight, right = cwin.edges[windex + 1] + kPpuExtraLeftRight;
+    uint32 left = cwin->edges[windex] + kPpuExtraLeftRight, right = cwin->edges[windex + 1] + kPpuExtraLeftRight;
     // If clip is set, then zero out the rgb values from the main screen.
     uint32 clip_color_mask = (cw_clip_math & 1) ? 0x1f : 0;
     uint32 math_enabled_cur = (cw_clip_math & 0x100) ? math_enabled : 0;
     uint32 fixed_color = ppu->fixedColorR | ppu->fixedColorG << 5 | ppu->fixedColorB << 10;
     if (math_enabled_cur == 0 || fixed_color == 0 && !ppu->halfColor && !rendered_subscreen) {
       // Math is disabled (or has no effect), so can avoid the per-pixel maths check
+      const PpuBrightnessMap *color_map = &ppu->brightnessMap[0];
       uint32 i = left;
       do {
         uint32 color = ppu->cgram[ppu->bgBuffers[0].data[i] & 0xff];
-        dst[0] = ppu->brightnessMult[color & clip_color_mask] << 16 |
-                 ppu->brightnessMult[(color >> 5) & clip_color_mask] << 8 |
-                 ppu->brightnessMult[(color >> 10) & clip_color_mask];
-      } while (dst++, ++i < right);
+        uint32 v = color_map->r[color & clip_color_mask] |
+                   color_map->g[(color >> 5) & clip_color_mask] |
+                   color_map->b[(color >> 10) & clip_color_mask];
+        if (bpp == 2)
+          *(uint16 *)dst = v;
+        else
+          *(uint32 *)dst = v;
+      } while (dst += bpp, ++i < right);
     } else {
-      uint8 *half_color_map = ppu->halfColor ? ppu->brightnessMultHalf : ppu->brightnessMult;
+      const PpuBrightnessMap *half_color_map = &ppu->brightnessMap[ppu->halfColor];
       // Store this in locals
       math_enabled_cur |= ppu->addSubscreen << 8 | ppu->subtractColor << 9;
       // Need to check for each pixel whether to use math or not based on the main screen layer.
@@ -914,7 +1407,7 @@ static NOINLINE void PpuDrawWholeLine(Ppu *ppu, uint y) {
         uint32 r = color & clip_color_mask;
         uint32 g = (color >> 5) & clip_color_mask;
         uint32 b = (color >> 10) & clip_color_mask;
-        uint8 *color_map = ppu->brightnessMult;
+        const PpuBrightnessMap *color_map = &ppu->brightnessMap[0];
         if (math_enabled_cur & (1 << main_layer)) {
           if (math_enabled_cur & 0x100) {  // addSubscreen ?
             if ((ppu->bgBuffers[1].data[i] & 0xff) != 0)
@@ -935,17 +1428,68 @@ static NOINLINE void PpuDrawWholeLine(Ppu *ppu, uint y) {
             b += b2;
           }
         }
-        dst[0] = color_map[b] | color_map[g] << 8 | color_map[r] << 16;
-      } while (dst++, ++i < right);
+        uint32 v = color_map->b[b] | color_map->g[g] | color_map->r[r];
+        if (bpp == 2)
+          *(uint16 *)dst = v;
+        else
+          *(uint32 *)dst = v;
+      } while (dst += bpp, ++i < right);
     }
-  } while (cw_clip_math >>= 1, ++windex < cwin.nr);
+  } while (cw_clip_math >>= 1, ++windex < cwin->nr);
 
   // Clear out stuff on the sides.
   if (ppu->extraLeftRight - ppu->extraLeftCur != 0)
-    memset(dst_org, 0, sizeof(uint32) * (ppu->extraLeftRight - ppu->extraLeftCur));
+    memset(dst_org, 0, bpp * (ppu->extraLeftRight - ppu->extraLeftCur));
   if (ppu->extraLeftRight - ppu->extraRightCur != 0)
-    memset(dst_org + (256 + ppu->extraLeftRight * 2 - (ppu->extraLeftRight - ppu->extraRightCur)), 0,
-        sizeof(uint32) * (ppu->extraLeftRight - ppu->extraRightCur));
+    memset(dst_org + (256 + ppu->extraLeftRight * 2 - (ppu->extraLeftRight - ppu->extraRightCur)) * bpp, 0,
+        bpp * (ppu->extraLeftRight - ppu->extraRightCur));
+}
+
+static NOINLINE void PpuDrawWholeLine(Ppu *ppu, uint y) {
+  if (ppu->forcedBlank) {
+    uint8 *dst = &ppu->renderBuffer[(y - 1) * ppu->renderPitch];
+    size_t n = PpuBytesPerPixel(ppu) * (256 + ppu->extraLeftRight * 2);
+    memset(dst, 0, n);
+    return;
+  }
+
+  if (ppu->mode == 7 && (ppu->renderFlags & kPpuRenderFlags_4x4Mode7)) {
+    PpuDrawMode7Upsampled(ppu, y);
+    return;
+  }
+
+  // Default background is backdrop
+  ClearBackdrop(&ppu->bgBuffers[0]);
+
+  // Render main screen
+  PpuDrawBackgrounds(ppu, y, false);
+
+  // The 6:th bit is automatically zero, math is never applied to the first half of the sprites.
+  uint32 math_enabled = ppu->mathEnabled;
+
+  // Render also the subscreen?
+  bool rendered_subscreen = false;
+  if (ppu->preventMathMode != 3 && ppu->addSubscreen && math_enabled) {
+    ClearBackdrop(&ppu->bgBuffers[1]);
+    if (ppu->screenEnabled[1] != 0) {
+      PpuDrawBackgrounds(ppu, y, true);
+      rendered_subscreen = true;
+    }
+  }
+
+  // Color window affects the drawing mode in each region
+  PpuWindows cwin = *PpuWindows_Get(ppu, 5);
+  static const uint8 kCwBitsMod[8] = {
+    0x00, 0xff, 0xff, 0x00,
+    0xff, 0x00, 0xff, 0x00,
+  };
+  uint32 cw_clip_math = ((cwin.bits & kCwBitsMod[ppu->clipMode]) ^ kCwBitsMod[ppu->clipMode + 4]) |
+                        ((cwin.bits & kCwBitsMod[ppu->preventMathMode]) ^ kCwBitsMod[ppu->preventMathMode + 4]) << 8;
+
+  if (PpuBytesPerPixel(ppu) == 2)
+    PpuWriteLinePixels(ppu, y, &cwin, cw_clip_math, math_enabled, rendered_subscreen, 2);
+  else
+    PpuWriteLinePixels(ppu, y, &cwin, cw_clip_math, math_enabled, rendered_subscreen, 4);
 }
 
 static void ppu_handlePixel(Ppu* ppu, int x, int y) {
@@ -1001,11 +1545,16 @@ static void ppu_handlePixel(Ppu* ppu, int x, int y) {
     }
   }
   int row = y - 1;
-  uint8 *pixelBuffer = (uint8*) &ppu->renderBuffer[row * ppu->renderPitch + (x + ppu->extraLeftRight) * 4];
-  pixelBuffer[0] = ((b << 3) | (b >> 2)) * ppu->brightness / 15;
-  pixelBuffer[1] = ((g << 3) | (g >> 2)) * ppu->brightness / 15;
-  pixelBuffer[2] = ((r << 3) | (r >> 2)) * ppu->brightness / 15;
-  pixelBuffer[3] = 0;
+  size_t bpp = PpuBytesPerPixel(ppu);
+  uint8 *pixelBuffer = (uint8*) &ppu->renderBuffer[row * ppu->renderPitch + (x + ppu->extraLeftRight) * bpp];
+  uint32 color = PpuPackColor(ppu->renderFlags & kPpuRenderFlags_PixelFormatMask,
+                              ((r << 3) | (r >> 2)) * ppu->brightness / 15,
+                              ((g << 3) | (g >> 2)) * ppu->brightness / 15,
+                              ((b << 3) | (b >> 2)) * ppu->brightness / 15);
+  if (bpp == 2)
+    *(uint16 *)pixelBuffer = color;
+  else
+    *(uint32 *)pixelBuffer = color;
 }
 
 static const int bitDepthsPerMode[10][4] = {
@@ -1349,6 +1898,7 @@ void ppu_write(Ppu* ppu, uint8_t adr, uint8_t val) {
       } else {
         if (ppu->oamAdr < 0x110)
           ppu->oam[ppu->oamAdr++] = (val << 8) | ppu->oamBuffer;
+        ppu->lineCacheCheckMemory = true;
       }
       ppu->oamSecondWrite = !ppu->oamSecondWrite;
       break;
@@ -1433,12 +1983,14 @@ void ppu_write(Ppu* ppu, uint8_t adr, uint8_t val) {
     case 0x18: {  // VMDATAL
       uint16_t vramAdr = ppu->vramPointer;
       ppu->vram[vramAdr & 0x7fff] = (ppu->vram[vramAdr & 0x7fff] & 0xff00) | val;
+      ppu->lineCacheCheckMemory = true;
       if(!ppu->vramIncrementOnHigh) ppu->vramPointer += ppu->vramIncrement;
       break;
     }
     case 0x19: {  // VMDATAH
       uint16_t vramAdr = ppu->vramPointer;
       ppu->vram[vramAdr & 0x7fff] = (ppu->vram[vramAdr & 0x7fff] & 0x00ff) | (val << 8);
+      ppu->lineCacheCheckMemory = true;
       if(ppu->vramIncrementOnHigh) ppu->vramPointer += ppu->vramIncrement;
       break;
     }
@@ -1474,29 +2026,39 @@ void ppu_write(Ppu* ppu, uint8_t adr, uint8_t val) {
         ppu->cgramBuffer = val;
       } else {
         ppu->cgram[ppu->cgramPointer++] = (val << 8) | ppu->cgramBuffer;
+        ppu->lineCacheCheckMemory = true;
       }
       ppu->cgramSecondWrite = !ppu->cgramSecondWrite;
       break;
     }
     case 0x23:  // W12SEL
-      ppu->windowsel = (ppu->windowsel & ~0xff) | val;
-      break;
     case 0x24:  // W34SEL
-      ppu->windowsel = (ppu->windowsel & ~0xff00) | (val << 8);
-      break;
-    case 0x25:  // WOBJSEL
-      ppu->windowsel = (ppu->windowsel & ~0xff0000) | (val << 16);
+    case 0x25: {  // WOBJSEL
+      // Each register holds the settings of two layers
+      int shift = (adr - 0x23) * 8;
+      if (((ppu->windowsel >> shift) & 0xff) != val)
+        ppu->windowsValid &= ~(3 << (shift >> 2));
+      ppu->windowsel = (ppu->windowsel & ~(0xff << shift)) | (val << shift);
       break;
+    }
     case 0x26:
+      if (ppu->window1left != val)
+        ppu->windowsValid = 0;
       ppu->window1left = val;
       break;
     case 0x27:
+      if (ppu->window1right != val)
+        ppu->windowsValid = 0;
       ppu->window1right = val;
       break;
     case 0x28:
+      if (ppu->window2left != val)
+        ppu->windowsValid = 0;
       ppu->window2left = val;
       break;
     case 0x29:
+      if (ppu->window2right != val)
+        ppu->windowsValid = 0;
       ppu->window2right = val;
       break;
     case 0x2a:  // WBGLOG
@@ -9,6 +9,13 @@
 #include <stdbool.h>
 #include "snes/saveload.h"
 typedef struct Ppu Ppu;
+typedef struct PpuMode7Line PpuMode7Line;
+typedef struct PpuBgCache PpuBgCache;
+typedef struct PpuLineCache PpuLineCache;
+
+// Runs func(ctx, i) for all i in [0, n), possibly in parallel, and returns
+// once all of them are done.
+typedef void PpuParallelForFunc(void (*func)(void *ctx, int i), void *ctx, int n);
 
 #include "src/types.h"
 
@@ -42,12 +49,38 @@ enum {
   kPpuRenderFlags_Height240 = 4,
   // Disable sprite render limits
   kPpuRenderFlags_NoSpriteLimits = 8,
+  // Pixel format of the render buffer. The default is 32-bit 0x00RRGGBB words.
+  kPpuRenderFlags_Xrgb8888 = 0,
+  // 32-bit words with the bytes in R, G, B, A order
+  kPpuRenderFlags_Rgba8888 = 16,
+  // 16-bit 5:6:5 words
+  kPpuRenderFlags_Rgb565 = 32,
+  kPpuRenderFlags_PixelFormatMask = 48,
+  // Draw the backgrounds from a cache of the whole layer, which is updated
+  // with what changed in vram since the last frame
+  kPpuRenderFlags_BgLayerCache = 64,
+  // Copy the lines that are drawn exactly like in the last frame instead of drawing them
+  kPpuRenderFlags_LineCache = 128,
 };
 
+// Brightness adjusted color channels, already shifted into place in the output format.
+// Stores 31 extra entries to remove the need for clamping to 31.
+typedef struct PpuBrightnessMap {
+  uint32_t r[64], g[64], b[64];
+} PpuBrightnessMap;
+
+// The spans of a line that a window setting splits it into, and which of them are inside the window.
+typedef struct PpuWindows {
+  int16 edges[6];
+  uint8 nr;
+  uint8 bits;
+} PpuWindows;
+
 
 struct Ppu {
   bool lineHasSprites;
   uint8_t lastBrightnessMult;
+  uint8_t lastPixelFormat;
   uint8_t lastMosaicModulo;
   uint8_t renderFlags;
   uint32_t renderPitch;
@@ -55,6 +88,23 @@ struct Ppu {
   uint8_t extraLeftCur, extraRightCur, extraLeftRight, extraBottomCur;
   float mode7PerspectiveLow, mode7PerspectiveHigh;
 
+  // Upsampled mode7 lines waiting to be drawn by PpuEndDrawing
+  PpuParallelForFunc *parallelFor;
+  PpuMode7Line *mode7Lines;
+  int mode7LineCount;
+
+  // Cached pixels of bg1-3, allocated on first use
+  PpuBgCache *bgCache[3];
+  uint32_t bgCacheFrame;
+
+  // Lines of the new renderer from the last frame, allocated on first use
+  PpuLineCache *lineCache;
+  bool lineCacheCheckMemory;
+  // Lines copied and drawn in the last frame
+  uint32_t lineCacheHits, lineCacheMisses;
+  // Bitmask of the output rows that were copied in the last frame
+  uint32_t lineCopied[8];
+
   // TMW / TSW etc
   uint8 screenEnabled[2];
   uint8 screenWindowed[2];
@@ -70,6 +120,9 @@ struct Ppu {
   uint8_t window2left;
   uint8_t window2right;
   uint32_t windowsel;
+  // Spans of layers 0-5 (bg1-4, obj, color window), valid where the bit in windowsValid is set
+  uint8_t windowsValid;
+  PpuWindows windows[6];
 
   // color math
   uint8_t clipMode;
@@ -116,9 +169,8 @@ struct Ppu {
 
   uint16_t oam[0x110];
   
-  // store 31 extra entries to remove the need for clamp
-  uint8_t brightnessMult[32 + 31];
-  uint8_t brightnessMultHalf[32 * 2];
+  // [0] is the normal brightness, [1] is for half color math
+  PpuBrightnessMap brightnessMap[2];
   uint16_t cgram[0x100];
   uint8_t mosaicModulo[kPpuXPixels];
   uint32_t colorMapRgb[256];
@@ -135,12 +187,22 @@ void ppu_runLine(Ppu* ppu, int line);
 uint8_t ppu_read(Ppu* ppu, uint8_t adr);
 void ppu_write(Ppu* ppu, uint8_t adr, uint8_t val);
 void ppu_saveload(Ppu *ppu, SaveLoadFunc *func, void *ctx);
+// The pixel format of |buffer| is given by the kPpuRenderFlags_PixelFormatMask bits of |render_flags|.
 void PpuBeginDrawing(Ppu *ppu, uint8_t *buffer, size_t pitch, uint32_t render_flags);
+// Finishes any drawing that was deferred to run in parallel.
+void PpuEndDrawing(Ppu *ppu);
+void PpuSetParallelFor(Ppu *ppu, PpuParallelForFunc *func);
+// Copies the emulated state of |src| so that |dst| draws the same frame, keeping the caches of |dst|.
+void PpuCopyState(Ppu *dst, const Ppu *src);
+// Saves or loads the state that PpuCopyState copies. Depends on the layout of the Ppu struct.
+void PpuSaveLoadDrawState(Ppu *ppu, SaveLoadFunc *func, void *ctx);
 
 // Returns the current render scale, 1x = 256px, 2x=512px, 4x=1024px
 int PpuGetCurrentRenderScale(Ppu *ppu, uint32_t render_flags);
 
 void PpuSetMode7PerspectiveCorrection(Ppu *ppu, int low, int high);
 void PpuSetExtraSideSpace(Ppu *ppu, int left, int right, int bottom);
+// True if the line cache copied output row |row| of the last frame from the frame before.
+bool PpuIsRowCopied(Ppu *ppu, int row);
 
 #endif  // ZELDA3_SNES_PPU_H_
@@ -36,6 +36,9 @@ Snes* snes_init(uint8_t *ram) {
   snes->input2 = input_init(snes);
   snes->debug_cycles = false;
   snes->disableHpos = false;
+  snes->countCycles = false;
+  snes->cpuTrace = NULL;
+  snes_buildMemoryMap(snes);
   return snes;
 }
 
@@ -47,6 +50,7 @@ void snes_free(Snes* snes) {
   cart_free(snes->cart);
   input_free(snes->input1);
   input_free(snes->input2);
+  cpuTrace_free(snes->cpuTrace);
   free(snes);
 }
 
@@ -101,19 +105,9 @@ void snes_reset(Snes* snes, bool hard) {
   snes->openBus = 0;
 }
 
-void snes_printCpuLine(Snes *snes) {
-  if (snes->debug_cycles) {
-    static FILE *fout;
-
-    if (!fout)
-      fout = stdout;
-    char line[80];
-    getProcessorStateCpu(snes, line);
-    fputs(line, fout);
-    fprintf(fout, " 0x%x", snes->ppu->vram[0]);
-    fputs("\n", fout);
-    fflush(fout);
-  }
+void snes_traceCpu(Snes *snes) {
+  if (snes->cpuTrace)
+    cpuTrace_record(snes->cpuTrace, snes);
 }
 
 static void snes_catchupApu(Snes* snes) {
@@ -407,16 +401,58 @@ uint8_t snes_read(Snes* snes, uint32_t adr) {
 }
 
 uint8_t snes_cpuRead(Snes* snes, uint32_t adr) {
-  snes->cpuMemOps++;
-  snes->cpuCyclesLeft += snes_getAccessTime(snes, adr);
+  if (snes->countCycles) {
+    snes->cpuMemOps++;
+    snes->cpuCyclesLeft += snes_getAccessTime(snes, adr);
+  }
+  uint8_t *page = snes->readMap[(adr >> kSnesPageShift) & (kSnesPages - 1)];
+  if (page) {
+    uint8_t val = page[adr & kSnesPageMask];
+    snes->openBus = val;
+    return val;
+  }
   return snes_read(snes, adr);
 }
 
 void snes_cpuWrite(Snes* snes, uint32_t adr, uint8_t val) {
-  snes->cpuMemOps++;
-  snes->cpuCyclesLeft += snes_getAccessTime(snes, adr);
+  if (snes->countCycles) {
+    snes->cpuMemOps++;
+    snes->cpuCyclesLeft += snes_getAccessTime(snes, adr);
+  }
+  if (snes->cpuTrace)
+    cpuTrace_recordWrite(snes->cpuTrace, adr, val);
+  uint8_t *page = snes->writeMap[(adr >> kSnesPageShift) & (kSnesPages - 1)];
+  if (page && !g_bp_addr) {
+    snes->openBus = val;
+    page[adr & kSnesPageMask] = val;
+    return;
+  }
   snes_write(snes, adr, val);
 }
 
+// Sets up the page tables used by snes_cpuRead / snes_cpuWrite. Must be
+// called again whenever the rom changes. Only wram and lorom rom are mapped,
+// everything else goes through snes_read / snes_write.
+void snes_buildMemoryMap(Snes *snes) {
+  Cart *cart = snes->cart;
+  bool map_rom = cart->type == 1 && cart->rom != NULL && cart->romSize >= 0x8000 &&
+                 (cart->romSize & (cart->romSize - 1)) == 0;
+  for (uint32_t i = 0; i < kSnesPages; i++) {
+    uint32_t bank = i >> (16 - kSnesPageShift), adr = (i << kSnesPageShift) & 0xffff;
+    uint8_t *read = NULL, *write = NULL;
+    if ((bank & ~1) == 0x7e) {
+      read = write = &snes->ram[((bank & 1) << 16) | adr]; // ram
+    } else if ((bank & 0x7f) < 0x40 && adr < 0x2000) {
+      read = write = &snes->ram[adr]; // ram mirror
+    } else if (map_rom) {
+      bool is_sram = ((bank >= 0x70 && bank < 0x7e) || bank >= 0xf0) && cart->ramSize > 0;
+      if (adr >= 0x8000 || (bank & 0x40) && !is_sram)
+        read = &cart->rom[((bank << 15) | (adr & 0x7fff)) & (cart->romSize - 1)];
+    }
+    snes->readMap[i] = read;
+    snes->writeMap[i] = write;
+  }
+}
+
 // debugging
 
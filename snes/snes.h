@@ -9,6 +9,14 @@
 #include <stdbool.h>
 
 typedef struct Snes Snes;
+typedef struct CpuTrace CpuTrace;
+
+enum {
+  // The cpu address space is mapped in 8 KiB pages
+  kSnesPageShift = 13,
+  kSnesPageMask = (1 << kSnesPageShift) - 1,
+  kSnesPages = 0x1000000 >> kSnesPageShift,
+};
 
 #include "cpu.h"
 #include "apu.h"
@@ -65,6 +73,15 @@ struct Snes {
   // ram
   uint8_t *ram;
   uint32_t ramAdr;
+  // Count memory access cycles in cpuCyclesLeft. Nothing needs the timing
+  // when comparing against the C code, so it's off by default.
+  bool countCycles;
+  // Host pointers to each page for cpu accesses that can skip the address
+  // decoding, or NULL if the page needs the slow path (registers, cart ram).
+  uint8_t *readMap[kSnesPages];
+  uint8_t *writeMap[kSnesPages];
+  // Binary trace of recent instructions, or NULL when not tracing.
+  CpuTrace *cpuTrace;
 };
 
 Snes* snes_init(uint8_t *ram);
@@ -77,8 +94,9 @@ uint8_t snes_read(Snes* snes, uint32_t adr);
 void snes_write(Snes* snes, uint32_t adr, uint8_t val);
 uint8_t snes_cpuRead(Snes* snes, uint32_t adr);
 void snes_cpuWrite(Snes* snes, uint32_t adr, uint8_t val);
+void snes_buildMemoryMap(Snes *snes);
 // debugging
-void snes_printCpuLine(Snes *snes);
+void snes_traceCpu(Snes *snes);
 void snes_doAutoJoypad(Snes *snes);
 // snes_other.c functions:
 
@@ -206,3 +206,61 @@ void getDisassemblySpc(Apu *apu, char* line) {
     case 6: sprintf(line, opcodeNamesSpc[opcode], wordb, bit); break;
   }
 }
+
+CpuTrace *cpuTrace_init(uint32_t length) {
+  // round up to a power of two so the ring index is a mask
+  uint32_t size = 1;
+  while (size < length)
+    size <<= 1;
+  CpuTrace *trace = malloc(sizeof(CpuTrace));
+  trace->records = calloc(size, sizeof(CpuTraceRecord));
+  trace->cur = NULL;
+  trace->mask = size - 1;
+  trace->count = 0;
+  return trace;
+}
+
+void cpuTrace_free(CpuTrace *trace) {
+  if (trace) {
+    free(trace->records);
+    free(trace);
+  }
+}
+
+static uint8_t cpuTrace_peek(Snes *snes, uint32_t adr) {
+  uint8_t *page = snes->readMap[(adr >> kSnesPageShift) & (kSnesPages - 1)];
+  return page ? page[adr & kSnesPageMask] : snes_read(snes, adr);
+}
+
+// Call before each instruction, the writes it does are added by snes_cpuWrite.
+void cpuTrace_record(CpuTrace *trace, Snes *snes) {
+  Cpu *cpu = snes->cpu;
+  CpuTraceRecord *r = &trace->records[trace->count++ & trace->mask];
+  uint32_t adr = cpu->k << 16 | cpu->pc;
+  r->pc = adr;
+  for (int i = 0; i < 4; i++)
+    r->bytes[i] = cpuTrace_peek(snes, (adr & 0xff0000) | ((adr + i) & 0xffff));
+  r->a = cpu->a, r->x = cpu->x, r->y = cpu->y;
+  r->sp = cpu->sp, r->dp = cpu->dp, r->db = cpu->db;
+  r->flags = cpu_getFlags(cpu);
+  r->e = cpu->e;
+  r->writes = 0;
+  r->reserved = 0;
+  r->writeAdr = 0;
+  memset(r->writeVal, 0, sizeof(r->writeVal));
+  trace->cur = r;
+}
+
+// Writes the ring, oldest instruction first.
+bool cpuTrace_dump(CpuTrace *trace, const char *filename) {
+  FILE *f = fopen(filename, "wb");
+  if (!f)
+    return false;
+  uint32_t n = trace->count < trace->mask + 1 ? trace->count : trace->mask + 1;
+  uint32_t hdr[4] = { 'C' | 'P' << 8 | 'U' << 16 | 'T' << 24, kCpuTraceVersion, sizeof(CpuTraceRecord), n };
+  bool ok = fwrite(hdr, sizeof(hdr), 1, f) == 1;
+  for (uint32_t i = trace->count - n; ok && i != trace->count; i++)
+    ok = fwrite(&trace->records[i & trace->mask], sizeof(CpuTraceRecord), 1, f) == 1;
+  fclose(f);
+  return ok;
+}
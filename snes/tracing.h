@@ -14,4 +14,48 @@
 void getProcessorStateCpu(Snes* snes, char* line);
 void getProcessorStateSpc(Apu* apu, char* line);
 
+// Binary trace of the most recently executed cpu instructions, kept in a
+// ring so it's cheap enough to leave on while comparing against the C code.
+// Dumped with cpuTrace_dump and decoded by other/decode_cpu_trace.py.
+typedef struct CpuTraceRecord {
+  uint32_t pc;            // k << 16 | pc
+  uint8_t bytes[4];       // opcode and operand bytes
+  uint16_t a, x, y, sp, dp;
+  uint8_t db;
+  uint8_t flags;          // p register
+  uint8_t e;
+  uint8_t writes;         // number of bytes written by the instruction
+  uint16_t reserved;
+  uint32_t writeAdr;      // address of the first byte written
+  uint8_t writeVal[4];    // the first four bytes written
+} CpuTraceRecord;
+
+struct CpuTrace {
+  CpuTraceRecord *records;
+  CpuTraceRecord *cur;    // instruction being executed, or NULL
+  uint32_t mask;
+  uint32_t count;         // total number of instructions recorded
+};
+
+enum {
+  kCpuTraceVersion = 1,
+};
+
+CpuTrace *cpuTrace_init(uint32_t length);
+void cpuTrace_free(CpuTrace *trace);
+void cpuTrace_record(CpuTrace *trace, Snes *snes);
+bool cpuTrace_dump(CpuTrace *trace, const char *filename);
+
+static inline void cpuTrace_recordWrite(CpuTrace *trace, uint32_t adr, uint8_t val) {
+  CpuTraceRecord *r = trace->cur;
+  if (r == NULL)
+    return;
+  if (r->writes == 0)
+    r->writeAdr = adr;
+  if (r->writes < 4)
+    r->writeVal[r->writes] = val;
+  if (r->writes != 255)
+    r->writes++;
+}
+
 #endif
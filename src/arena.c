@@ -0,0 +1,89 @@
+#include "arena.h"
+#include <SDL2/SDL.h>
+#include <stdio.h>
+#include <string.h>
+
+enum {
+  kArenaChunkSize = 512 * 1024,
+  kArenaAlign = 16,
+  kArenaMaxEntries = 32,
+};
+
+typedef struct ArenaEntry {
+  const char *name;
+  bool in_arena;
+  size_t size;
+} ArenaEntry;
+
+typedef struct Arena {
+  uint8 *cur, *end;
+  size_t reserved, used;
+  int num_entries;
+  ArenaEntry entries[kArenaMaxEntries];
+  // Startup loads the game on a separate thread
+  SDL_SpinLock lock;
+} Arena;
+
+static Arena g_arena;
+
+static ArenaEntry *Arena_FindEntry(const char *name, bool in_arena) {
+  Arena *a = &g_arena;
+  for (int i = 0; i < a->num_entries; i++) {
+    ArenaEntry *e = &a->entries[i];
+    if (e->in_arena == in_arena && strcmp(e->name, name) == 0)
+      return e;
+  }
+  if (a->num_entries == kArenaMaxEntries)
+    Die("Too many arena entries");
+  ArenaEntry *e = &a->entries[a->num_entries++];
+  e->name = name;
+  e->in_arena = in_arena;
+  return e;
+}
+
+void *ArenaAlloc(const char *name, size_t size) {
+  Arena *a = &g_arena;
+  size = (size + kArenaAlign - 1) & ~(size_t)(kArenaAlign - 1);
+  SDL_AtomicLock(&a->lock);
+  if (size > (size_t)(a->end - a->cur)) {
+    // The rest of the current chunk is left unused
+    size_t chunk_size = size > kArenaChunkSize ? size : kArenaChunkSize;
+    uint8 *chunk = (uint8 *)calloc(chunk_size + kArenaAlign, 1);
+    if (!chunk)
+      Die("Out of memory");
+    a->cur = (uint8 *)(((uintptr_t)chunk + kArenaAlign - 1) & ~(uintptr_t)(kArenaAlign - 1));
+    a->end = a->cur + chunk_size;
+    a->reserved += chunk_size;
+  }
+  void *p = a->cur;
+  a->cur += size;
+  a->used += size;
+  Arena_FindEntry(name, true)->size += size;
+  SDL_AtomicUnlock(&a->lock);
+  return p;
+}
+
+void ArenaAccount(const char *name, ptrdiff_t size) {
+  SDL_AtomicLock(&g_arena.lock);
+  Arena_FindEntry(name, false)->size += size;
+  SDL_AtomicUnlock(&g_arena.lock);
+}
+
+void ArenaPrintReport(void) {
+  Arena *a = &g_arena;
+  size_t outside = 0;
+  fprintf(stderr, "Memory budget:\n");
+  for (int pass = 0; pass < 2; pass++) {
+    for (int i = 0; i < a->num_entries; i++) {
+      ArenaEntry *e = &a->entries[i];
+      if (e->in_arena != (pass == 0))
+        continue;
+      fprintf(stderr, "  %-20s %7d KB%s\n", e->name, (int)((e->size + 1023) >> 10),
+              e->in_arena ? "" : " (outside arena)");
+      if (!e->in_arena)
+        outside += e->size;
+    }
+  }
+  fprintf(stderr, "  Arena: %d KB used of %d KB reserved. Total: %d KB\n",
+          (int)(a->used >> 10), (int)(a->reserved >> 10), (int)((a->reserved + outside) >> 10));
+}
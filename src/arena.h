@@ -0,0 +1,18 @@
+#ifndef ZELDA3_ARENA_H_
+#define ZELDA3_ARENA_H_
+
+#include "types.h"
+#include <stddef.h>
+
+// Long lived runtime state is allocated from one arena, with a name per
+// subsystem, so the memory needed can be reported at startup. Arena memory
+// is zeroed and only released when the process exits.
+void *ArenaAlloc(const char *name, size_t size);
+
+// Records memory that lives outside of the arena, like static arrays and
+// buffers that grow at runtime. size is a delta.
+void ArenaAccount(const char *name, ptrdiff_t size);
+
+void ArenaPrintReport(void);
+
+#endif  // ZELDA3_ARENA_H_
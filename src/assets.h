@@ -7,326 +7,336 @@ enum {
 extern const uint8 *g_asset_ptrs[kNumberOfAssets];
 extern uint32 g_asset_sizes[kNumberOfAssets];
 extern MemBlk FindInAssetArray(int asset, int idx);
+extern const uint8 *LoadAsset(int asset);
+// Keeps the asset containing p loaded, for assets that are modified or
+// referenced through pointers that are kept across frames.
+extern void PinAsset(const void *p);
 
-#define kSoundBank_intro ((uint8*)g_asset_ptrs[0])
+// Assets in a compressed zelda3_assets.dat are decompressed on first use
+static inline const uint8 *GetAsset(int asset) {
+  const uint8 *p = g_asset_ptrs[asset];
+  return p ? p : LoadAsset(asset);
+}
+
+#define kSoundBank_intro ((uint8*)GetAsset(0))
 #define kSoundBank_intro_SIZE (g_asset_sizes[0])
-#define kSoundBank_indoor ((uint8*)g_asset_ptrs[1])
+#define kSoundBank_indoor ((uint8*)GetAsset(1))
 #define kSoundBank_indoor_SIZE (g_asset_sizes[1])
-#define kSoundBank_ending ((uint8*)g_asset_ptrs[2])
+#define kSoundBank_ending ((uint8*)GetAsset(2))
 #define kSoundBank_ending_SIZE (g_asset_sizes[2])
-#define kDungeonRoom ((uint8*)g_asset_ptrs[3])
+#define kDungeonRoom ((uint8*)GetAsset(3))
 #define kDungeonRoom_SIZE (g_asset_sizes[3])
-#define kDungeonRoomOffs ((uint16*)g_asset_ptrs[4])
+#define kDungeonRoomOffs ((uint16*)GetAsset(4))
 #define kDungeonRoomOffs_SIZE (g_asset_sizes[4])
-#define kDungeonRoomDoorOffs ((uint16*)g_asset_ptrs[5])
+#define kDungeonRoomDoorOffs ((uint16*)GetAsset(5))
 #define kDungeonRoomDoorOffs_SIZE (g_asset_sizes[5])
-#define kDungeonRoomHeaders ((uint8*)g_asset_ptrs[6])
+#define kDungeonRoomHeaders ((uint8*)GetAsset(6))
 #define kDungeonRoomHeaders_SIZE (g_asset_sizes[6])
-#define kDungeonRoomHeadersOffs ((uint16*)g_asset_ptrs[7])
+#define kDungeonRoomHeadersOffs ((uint16*)GetAsset(7))
 #define kDungeonRoomHeadersOffs_SIZE (g_asset_sizes[7])
-#define kDungeonRoomChests ((uint8*)g_asset_ptrs[8])
+#define kDungeonRoomChests ((uint8*)GetAsset(8))
 #define kDungeonRoomChests_SIZE (g_asset_sizes[8])
-#define kDungeonRoomTeleMsg ((uint16*)g_asset_ptrs[9])
+#define kDungeonRoomTeleMsg ((uint16*)GetAsset(9))
 #define kDungeonRoomTeleMsg_SIZE (g_asset_sizes[9])
-#define kDungeonPitsHurtPlayer ((uint16*)g_asset_ptrs[10])
+#define kDungeonPitsHurtPlayer ((uint16*)GetAsset(10))
 #define kDungeonPitsHurtPlayer_SIZE (g_asset_sizes[10])
-#define kEntranceData_rooms ((uint16*)g_asset_ptrs[11])
+#define kEntranceData_rooms ((uint16*)GetAsset(11))
 #define kEntranceData_rooms_SIZE (g_asset_sizes[11])
-#define kEntranceData_relativeCoords ((uint8*)g_asset_ptrs[12])
+#define kEntranceData_relativeCoords ((uint8*)GetAsset(12))
 #define kEntranceData_relativeCoords_SIZE (g_asset_sizes[12])
-#define kEntranceData_scrollX ((uint16*)g_asset_ptrs[13])
+#define kEntranceData_scrollX ((uint16*)GetAsset(13))
 #define kEntranceData_scrollX_SIZE (g_asset_sizes[13])
-#define kEntranceData_scrollY ((uint16*)g_asset_ptrs[14])
+#define kEntranceData_scrollY ((uint16*)GetAsset(14))
 #define kEntranceData_scrollY_SIZE (g_asset_sizes[14])
-#define kEntranceData_playerX ((uint16*)g_asset_ptrs[15])
+#define kEntranceData_playerX ((uint16*)GetAsset(15))
 #define kEntranceData_playerX_SIZE (g_asset_sizes[15])
-#define kEntranceData_playerY ((uint16*)g_asset_ptrs[16])
+#define kEntranceData_playerY ((uint16*)GetAsset(16))
 #define kEntranceData_playerY_SIZE (g_asset_sizes[16])
-#define kEntranceData_cameraX ((uint16*)g_asset_ptrs[17])
+#define kEntranceData_cameraX ((uint16*)GetAsset(17))
 #define kEntranceData_cameraX_SIZE (g_asset_sizes[17])
-#define kEntranceData_cameraY ((uint16*)g_asset_ptrs[18])
+#define kEntranceData_cameraY ((uint16*)GetAsset(18))
 #define kEntranceData_cameraY_SIZE (g_asset_sizes[18])
-#define kEntranceData_blockset ((uint8*)g_asset_ptrs[19])
+#define kEntranceData_blockset ((uint8*)GetAsset(19))
 #define kEntranceData_blockset_SIZE (g_asset_sizes[19])
-#define kEntranceData_floor ((int8*)g_asset_ptrs[20])
+#define kEntranceData_floor ((int8*)GetAsset(20))
 #define kEntranceData_floor_SIZE (g_asset_sizes[20])
-#define kEntranceData_palace ((int8*)g_asset_ptrs[21])
+#define kEntranceData_palace ((int8*)GetAsset(21))
 #define kEntranceData_palace_SIZE (g_asset_sizes[21])
-#define kEntranceData_doorwayOrientation ((uint8*)g_asset_ptrs[22])
+#define kEntranceData_doorwayOrientation ((uint8*)GetAsset(22))
 #define kEntranceData_doorwayOrientation_SIZE (g_asset_sizes[22])
-#define kEntranceData_startingBg ((uint8*)g_asset_ptrs[23])
+#define kEntranceData_startingBg ((uint8*)GetAsset(23))
 #define kEntranceData_startingBg_SIZE (g_asset_sizes[23])
-#define kEntranceData_quadrant1 ((uint8*)g_asset_ptrs[24])
+#define kEntranceData_quadrant1 ((uint8*)GetAsset(24))
 #define kEntranceData_quadrant1_SIZE (g_asset_sizes[24])
-#define kEntranceData_quadrant2 ((uint8*)g_asset_ptrs[25])
+#define kEntranceData_quadrant2 ((uint8*)GetAsset(25))
 #define kEntranceData_quadrant2_SIZE (g_asset_sizes[25])
-#define kEntranceData_doorSettings ((uint16*)g_asset_ptrs[26])
+#define kEntranceData_doorSettings ((uint16*)GetAsset(26))
 #define kEntranceData_doorSettings_SIZE (g_asset_sizes[26])
-#define kEntranceData_musicTrack ((uint8*)g_asset_ptrs[27])
+#define kEntranceData_musicTrack ((uint8*)GetAsset(27))
 #define kEntranceData_musicTrack_SIZE (g_asset_sizes[27])
-#define kStartingPoint_rooms ((uint16*)g_asset_ptrs[28])
+#define kStartingPoint_rooms ((uint16*)GetAsset(28))
 #define kStartingPoint_rooms_SIZE (g_asset_sizes[28])
-#define kStartingPoint_relativeCoords ((uint8*)g_asset_ptrs[29])
+#define kStartingPoint_relativeCoords ((uint8*)GetAsset(29))
 #define kStartingPoint_relativeCoords_SIZE (g_asset_sizes[29])
-#define kStartingPoint_scrollX ((uint16*)g_asset_ptrs[30])
+#define kStartingPoint_scrollX ((uint16*)GetAsset(30))
 #define kStartingPoint_scrollX_SIZE (g_asset_sizes[30])
-#define kStartingPoint_scrollY ((uint16*)g_asset_ptrs[31])
+#define kStartingPoint_scrollY ((uint16*)GetAsset(31))
 #define kStartingPoint_scrollY_SIZE (g_asset_sizes[31])
-#define kStartingPoint_playerX ((uint16*)g_asset_ptrs[32])
+#define kStartingPoint_playerX ((uint16*)GetAsset(32))
 #define kStartingPoint_playerX_SIZE (g_asset_sizes[32])
-#define kStartingPoint_playerY ((uint16*)g_asset_ptrs[33])
+#define kStartingPoint_playerY ((uint16*)GetAsset(33))
 #define kStartingPoint_playerY_SIZE (g_asset_sizes[33])
-#define kStartingPoint_cameraX ((uint16*)g_asset_ptrs[34])
+#define kStartingPoint_cameraX ((uint16*)GetAsset(34))
 #define kStartingPoint_cameraX_SIZE (g_asset_sizes[34])
-#define kStartingPoint_cameraY ((uint16*)g_asset_ptrs[35])
+#define kStartingPoint_cameraY ((uint16*)GetAsset(35))
 #define kStartingPoint_cameraY_SIZE (g_asset_sizes[35])
-#define kStartingPoint_blockset ((uint8*)g_asset_ptrs[36])
+#define kStartingPoint_blockset ((uint8*)GetAsset(36))
 #define kStartingPoint_blockset_SIZE (g_asset_sizes[36])
-#define kStartingPoint_floor ((int8*)g_asset_ptrs[37])
+#define kStartingPoint_floor ((int8*)GetAsset(37))
 #define kStartingPoint_floor_SIZE (g_asset_sizes[37])
-#define kStartingPoint_palace ((int8*)g_asset_ptrs[38])
+#define kStartingPoint_palace ((int8*)GetAsset(38))
 #define kStartingPoint_palace_SIZE (g_asset_sizes[38])
-#define kStartingPoint_doorwayOrientation ((uint8*)g_asset_ptrs[39])
+#define kStartingPoint_doorwayOrientation ((uint8*)GetAsset(39))
 #define kStartingPoint_doorwayOrientation_SIZE (g_asset_sizes[39])
-#define kStartingPoint_startingBg ((uint8*)g_asset_ptrs[40])
+#define kStartingPoint_startingBg ((uint8*)GetAsset(40))
 #define kStartingPoint_startingBg_SIZE (g_asset_sizes[40])
-#define kStartingPoint_quadrant1 ((uint8*)g_asset_ptrs[41])
+#define kStartingPoint_quadrant1 ((uint8*)GetAsset(41))
 #define kStartingPoint_quadrant1_SIZE (g_asset_sizes[41])
-#define kStartingPoint_quadrant2 ((uint8*)g_asset_ptrs[42])
+#define kStartingPoint_quadrant2 ((uint8*)GetAsset(42))
 #define kStartingPoint_quadrant2_SIZE (g_asset_sizes[42])
-#define kStartingPoint_doorSettings ((uint16*)g_asset_ptrs[43])
+#define kStartingPoint_doorSettings ((uint16*)GetAsset(43))
 #define kStartingPoint_doorSettings_SIZE (g_asset_sizes[43])
-#define kStartingPoint_entrance ((uint8*)g_asset_ptrs[44])
+#define kStartingPoint_entrance ((uint8*)GetAsset(44))
 #define kStartingPoint_entrance_SIZE (g_asset_sizes[44])
-#define kStartingPoint_musicTrack ((uint8*)g_asset_ptrs[45])
+#define kStartingPoint_musicTrack ((uint8*)GetAsset(45))
 #define kStartingPoint_musicTrack_SIZE (g_asset_sizes[45])
-#define kDungeonRoomDefault ((uint8*)g_asset_ptrs[46])
+#define kDungeonRoomDefault ((uint8*)GetAsset(46))
 #define kDungeonRoomDefault_SIZE (g_asset_sizes[46])
-#define kDungeonRoomDefaultOffs ((uint16*)g_asset_ptrs[47])
+#define kDungeonRoomDefaultOffs ((uint16*)GetAsset(47))
 #define kDungeonRoomDefaultOffs_SIZE (g_asset_sizes[47])
-#define kDungeonRoomOverlay ((uint8*)g_asset_ptrs[48])
+#define kDungeonRoomOverlay ((uint8*)GetAsset(48))
 #define kDungeonRoomOverlay_SIZE (g_asset_sizes[48])
-#define kDungeonRoomOverlayOffs ((uint16*)g_asset_ptrs[49])
+#define kDungeonRoomOverlayOffs ((uint16*)GetAsset(49))
 #define kDungeonRoomOverlayOffs_SIZE (g_asset_sizes[49])
-#define kDungeonSecrets ((uint8*)g_asset_ptrs[50])
+#define kDungeonSecrets ((uint8*)GetAsset(50))
 #define kDungeonSecrets_SIZE (g_asset_sizes[50])
-#define kDungAttrsForTile_Offs ((uint16*)g_asset_ptrs[51])
+#define kDungAttrsForTile_Offs ((uint16*)GetAsset(51))
 #define kDungAttrsForTile_Offs_SIZE (g_asset_sizes[51])
-#define kDungAttrsForTile ((uint8*)g_asset_ptrs[52])
+#define kDungAttrsForTile ((uint8*)GetAsset(52))
 #define kDungAttrsForTile_SIZE (g_asset_sizes[52])
-#define kMovableBlockDataInit ((uint16*)g_asset_ptrs[53])
+#define kMovableBlockDataInit ((uint16*)GetAsset(53))
 #define kMovableBlockDataInit_SIZE (g_asset_sizes[53])
-#define kTorchDataInit ((uint16*)g_asset_ptrs[54])
+#define kTorchDataInit ((uint16*)GetAsset(54))
 #define kTorchDataInit_SIZE (g_asset_sizes[54])
-#define kTorchDataJunk ((uint16*)g_asset_ptrs[55])
+#define kTorchDataJunk ((uint16*)GetAsset(55))
 #define kTorchDataJunk_SIZE (g_asset_sizes[55])
-#define kEnemyDamageData ((uint8*)g_asset_ptrs[56])
+#define kEnemyDamageData ((uint8*)GetAsset(56))
 #define kEnemyDamageData_SIZE (g_asset_sizes[56])
-#define kLinkGraphics ((uint8*)g_asset_ptrs[57])
+#define kLinkGraphics ((uint8*)GetAsset(57))
 #define kLinkGraphics_SIZE (g_asset_sizes[57])
-#define kDungeonSprites ((uint8*)g_asset_ptrs[58])
+#define kDungeonSprites ((uint8*)GetAsset(58))
 #define kDungeonSprites_SIZE (g_asset_sizes[58])
-#define kDungeonSpriteOffs ((uint16*)g_asset_ptrs[59])
+#define kDungeonSpriteOffs ((uint16*)GetAsset(59))
 #define kDungeonSpriteOffs_SIZE (g_asset_sizes[59])
-#define kMap32ToMap16_0 ((uint8*)g_asset_ptrs[60])
+#define kMap32ToMap16_0 ((uint8*)GetAsset(60))
 #define kMap32ToMap16_0_SIZE (g_asset_sizes[60])
-#define kMap32ToMap16_1 ((uint8*)g_asset_ptrs[61])
+#define kMap32ToMap16_1 ((uint8*)GetAsset(61))
 #define kMap32ToMap16_1_SIZE (g_asset_sizes[61])
-#define kMap32ToMap16_2 ((uint8*)g_asset_ptrs[62])
+#define kMap32ToMap16_2 ((uint8*)GetAsset(62))
 #define kMap32ToMap16_2_SIZE (g_asset_sizes[62])
-#define kMap32ToMap16_3 ((uint8*)g_asset_ptrs[63])
+#define kMap32ToMap16_3 ((uint8*)GetAsset(63))
 #define kMap32ToMap16_3_SIZE (g_asset_sizes[63])
 #define kSprGfx(idx) FindInAssetArray(64, idx)
 #define kBgGfx(idx) FindInAssetArray(65, idx)
-#define kOverworldMapGfx ((uint8*)g_asset_ptrs[66])
+#define kOverworldMapGfx ((uint8*)GetAsset(66))
 #define kOverworldMapGfx_SIZE (g_asset_sizes[66])
-#define kLightOverworldTilemap ((uint8*)g_asset_ptrs[67])
+#define kLightOverworldTilemap ((uint8*)GetAsset(67))
 #define kLightOverworldTilemap_SIZE (g_asset_sizes[67])
-#define kDarkOverworldTilemap ((uint8*)g_asset_ptrs[68])
+#define kDarkOverworldTilemap ((uint8*)GetAsset(68))
 #define kDarkOverworldTilemap_SIZE (g_asset_sizes[68])
-#define kPredefinedTileData ((uint16*)g_asset_ptrs[69])
+#define kPredefinedTileData ((uint16*)GetAsset(69))
 #define kPredefinedTileData_SIZE (g_asset_sizes[69])
-#define kMap16ToMap8 ((uint16*)g_asset_ptrs[70])
+#define kMap16ToMap8 ((uint16*)GetAsset(70))
 #define kMap16ToMap8_SIZE (g_asset_sizes[70])
-#define kGeneratedWishPondItem ((uint8*)g_asset_ptrs[71])
+#define kGeneratedWishPondItem ((uint8*)GetAsset(71))
 #define kGeneratedWishPondItem_SIZE (g_asset_sizes[71])
-#define kGeneratedBombosArr ((uint8*)g_asset_ptrs[72])
+#define kGeneratedBombosArr ((uint8*)GetAsset(72))
 #define kGeneratedBombosArr_SIZE (g_asset_sizes[72])
-#define kGeneratedEndSequence15 ((uint8*)g_asset_ptrs[73])
+#define kGeneratedEndSequence15 ((uint8*)GetAsset(73))
 #define kGeneratedEndSequence15_SIZE (g_asset_sizes[73])
-#define kEnding_Credits_Text ((uint8*)g_asset_ptrs[74])
+#define kEnding_Credits_Text ((uint8*)GetAsset(74))
 #define kEnding_Credits_Text_SIZE (g_asset_sizes[74])
-#define kEnding_Credits_Offs ((uint16*)g_asset_ptrs[75])
+#define kEnding_Credits_Offs ((uint16*)GetAsset(75))
 #define kEnding_Credits_Offs_SIZE (g_asset_sizes[75])
-#define kEnding_MapData ((uint16*)g_asset_ptrs[76])
+#define kEnding_MapData ((uint16*)GetAsset(76))
 #define kEnding_MapData_SIZE (g_asset_sizes[76])
-#define kEnding0_Offs ((uint16*)g_asset_ptrs[77])
+#define kEnding0_Offs ((uint16*)GetAsset(77))
 #define kEnding0_Offs_SIZE (g_asset_sizes[77])
-#define kEnding0_Data ((uint8*)g_asset_ptrs[78])
+#define kEnding0_Data ((uint8*)GetAsset(78))
 #define kEnding0_Data_SIZE (g_asset_sizes[78])
-#define kPalette_DungBgMain ((uint16*)g_asset_ptrs[79])
+#define kPalette_DungBgMain ((uint16*)GetAsset(79))
 #define kPalette_DungBgMain_SIZE (g_asset_sizes[79])
-#define kPalette_MainSpr ((uint16*)g_asset_ptrs[80])
+#define kPalette_MainSpr ((uint16*)GetAsset(80))
 #define kPalette_MainSpr_SIZE (g_asset_sizes[80])
-#define kPalette_ArmorAndGloves ((uint16*)g_asset_ptrs[81])
+#define kPalette_ArmorAndGloves ((uint16*)GetAsset(81))
 #define kPalette_ArmorAndGloves_SIZE (g_asset_sizes[81])
-#define kPalette_Sword ((uint16*)g_asset_ptrs[82])
+#define kPalette_Sword ((uint16*)GetAsset(82))
 #define kPalette_Sword_SIZE (g_asset_sizes[82])
-#define kPalette_Shield ((uint16*)g_asset_ptrs[83])
+#define kPalette_Shield ((uint16*)GetAsset(83))
 #define kPalette_Shield_SIZE (g_asset_sizes[83])
-#define kPalette_SpriteAux3 ((uint16*)g_asset_ptrs[84])
+#define kPalette_SpriteAux3 ((uint16*)GetAsset(84))
 #define kPalette_SpriteAux3_SIZE (g_asset_sizes[84])
-#define kPalette_MiscSprite_Indoors ((uint16*)g_asset_ptrs[85])
+#define kPalette_MiscSprite_Indoors ((uint16*)GetAsset(85))
 #define kPalette_MiscSprite_Indoors_SIZE (g_asset_sizes[85])
-#define kPalette_SpriteAux1 ((uint16*)g_asset_ptrs[86])
+#define kPalette_SpriteAux1 ((uint16*)GetAsset(86))
 #define kPalette_SpriteAux1_SIZE (g_asset_sizes[86])
-#define kPalette_OverworldBgMain ((uint16*)g_asset_ptrs[87])
+#define kPalette_OverworldBgMain ((uint16*)GetAsset(87))
 #define kPalette_OverworldBgMain_SIZE (g_asset_sizes[87])
-#define kPalette_OverworldBgAux12 ((uint16*)g_asset_ptrs[88])
+#define kPalette_OverworldBgAux12 ((uint16*)GetAsset(88))
 #define kPalette_OverworldBgAux12_SIZE (g_asset_sizes[88])
-#define kPalette_OverworldBgAux3 ((uint16*)g_asset_ptrs[89])
+#define kPalette_OverworldBgAux3 ((uint16*)GetAsset(89))
 #define kPalette_OverworldBgAux3_SIZE (g_asset_sizes[89])
-#define kPalette_PalaceMapBg ((uint16*)g_asset_ptrs[90])
+#define kPalette_PalaceMapBg ((uint16*)GetAsset(90))
 #define kPalette_PalaceMapBg_SIZE (g_asset_sizes[90])
-#define kPalette_PalaceMapSpr ((uint16*)g_asset_ptrs[91])
+#define kPalette_PalaceMapSpr ((uint16*)GetAsset(91))
 #define kPalette_PalaceMapSpr_SIZE (g_asset_sizes[91])
-#define kHudPalData ((uint16*)g_asset_ptrs[92])
+#define kHudPalData ((uint16*)GetAsset(92))
 #define kHudPalData_SIZE (g_asset_sizes[92])
-#define kOverworldMapPaletteData ((uint16*)g_asset_ptrs[93])
+#define kOverworldMapPaletteData ((uint16*)GetAsset(93))
 #define kOverworldMapPaletteData_SIZE (g_asset_sizes[93])
 #define kDialogue(idx) FindInAssetArray(94, idx)
 #define kDialogueFont(idx) FindInAssetArray(95, idx)
 #define kDialogueMap(idx) FindInAssetArray(96, idx)
 #define kDungMap_FloorLayout(idx) FindInAssetArray(97, idx)
 #define kDungMap_Tiles(idx) FindInAssetArray(98, idx)
-#define kBgTilemap_0 ((uint8*)g_asset_ptrs[99])
+#define kBgTilemap_0 ((uint8*)GetAsset(99))
 #define kBgTilemap_0_SIZE (g_asset_sizes[99])
-#define kBgTilemap_1 ((uint8*)g_asset_ptrs[100])
+#define kBgTilemap_1 ((uint8*)GetAsset(100))
 #define kBgTilemap_1_SIZE (g_asset_sizes[100])
-#define kBgTilemap_2 ((uint8*)g_asset_ptrs[101])
+#define kBgTilemap_2 ((uint8*)GetAsset(101))
 #define kBgTilemap_2_SIZE (g_asset_sizes[101])
-#define kBgTilemap_3 ((uint8*)g_asset_ptrs[102])
+#define kBgTilemap_3 ((uint8*)GetAsset(102))
 #define kBgTilemap_3_SIZE (g_asset_sizes[102])
-#define kBgTilemap_4 ((uint8*)g_asset_ptrs[103])
+#define kBgTilemap_4 ((uint8*)GetAsset(103))
 #define kBgTilemap_4_SIZE (g_asset_sizes[103])
-#define kBgTilemap_5 ((uint8*)g_asset_ptrs[104])
+#define kBgTilemap_5 ((uint8*)GetAsset(104))
 #define kBgTilemap_5_SIZE (g_asset_sizes[104])
 #define kOverworld_Hibytes_Comp(idx) FindInAssetArray(105, idx)
 #define kOverworld_Lobytes_Comp(idx) FindInAssetArray(106, idx)
-#define kOverworldMapIsSmall ((uint8*)g_asset_ptrs[107])
+#define kOverworldMapIsSmall ((uint8*)GetAsset(107))
 #define kOverworldMapIsSmall_SIZE (g_asset_sizes[107])
-#define kOverworldAuxTileThemeIndexes ((uint8*)g_asset_ptrs[108])
+#define kOverworldAuxTileThemeIndexes ((uint8*)GetAsset(108))
 #define kOverworldAuxTileThemeIndexes_SIZE (g_asset_sizes[108])
-#define kOverworldBgPalettes ((uint8*)g_asset_ptrs[109])
+#define kOverworldBgPalettes ((uint8*)GetAsset(109))
 #define kOverworldBgPalettes_SIZE (g_asset_sizes[109])
-#define kOverworld_SignText ((uint16*)g_asset_ptrs[110])
+#define kOverworld_SignText ((uint16*)GetAsset(110))
 #define kOverworld_SignText_SIZE (g_asset_sizes[110])
-#define kOwMusicSets ((uint8*)g_asset_ptrs[111])
+#define kOwMusicSets ((uint8*)GetAsset(111))
 #define kOwMusicSets_SIZE (g_asset_sizes[111])
-#define kOwMusicSets2 ((uint8*)g_asset_ptrs[112])
+#define kOwMusicSets2 ((uint8*)GetAsset(112))
 #define kOwMusicSets2_SIZE (g_asset_sizes[112])
-#define kBirdTravel_ScreenIndex ((uint16*)g_asset_ptrs[113])
+#define kBirdTravel_ScreenIndex ((uint16*)GetAsset(113))
 #define kBirdTravel_ScreenIndex_SIZE (g_asset_sizes[113])
-#define kBirdTravel_Map16LoadSrcOff ((uint16*)g_asset_ptrs[114])
+#define kBirdTravel_Map16LoadSrcOff ((uint16*)GetAsset(114))
 #define kBirdTravel_Map16LoadSrcOff_SIZE (g_asset_sizes[114])
-#define kBirdTravel_ScrollX ((uint16*)g_asset_ptrs[115])
+#define kBirdTravel_ScrollX ((uint16*)GetAsset(115))
 #define kBirdTravel_ScrollX_SIZE (g_asset_sizes[115])
-#define kBirdTravel_ScrollY ((uint16*)g_asset_ptrs[116])
+#define kBirdTravel_ScrollY ((uint16*)GetAsset(116))
 #define kBirdTravel_ScrollY_SIZE (g_asset_sizes[116])
-#define kBirdTravel_LinkXCoord ((uint16*)g_asset_ptrs[117])
+#define kBirdTravel_LinkXCoord ((uint16*)GetAsset(117))
 #define kBirdTravel_LinkXCoord_SIZE (g_asset_sizes[117])
-#define kBirdTravel_LinkYCoord ((uint16*)g_asset_ptrs[118])
+#define kBirdTravel_LinkYCoord ((uint16*)GetAsset(118))
 #define kBirdTravel_LinkYCoord_SIZE (g_asset_sizes[118])
-#define kBirdTravel_CameraXScroll ((uint16*)g_asset_ptrs[119])
+#define kBirdTravel_CameraXScroll ((uint16*)GetAsset(119))
 #define kBirdTravel_CameraXScroll_SIZE (g_asset_sizes[119])
-#define kBirdTravel_CameraYScroll ((uint16*)g_asset_ptrs[120])
+#define kBirdTravel_CameraYScroll ((uint16*)GetAsset(120))
 #define kBirdTravel_CameraYScroll_SIZE (g_asset_sizes[120])
-#define kBirdTravel_Unk1 ((int8*)g_asset_ptrs[121])
+#define kBirdTravel_Unk1 ((int8*)GetAsset(121))
 #define kBirdTravel_Unk1_SIZE (g_asset_sizes[121])
-#define kBirdTravel_Unk3 ((int8*)g_asset_ptrs[122])
+#define kBirdTravel_Unk3 ((int8*)GetAsset(122))
 #define kBirdTravel_Unk3_SIZE (g_asset_sizes[122])
-#define kWhirlpoolAreas ((uint16*)g_asset_ptrs[123])
+#define kWhirlpoolAreas ((uint16*)GetAsset(123))
 #define kWhirlpoolAreas_SIZE (g_asset_sizes[123])
-#define kOverworld_Entrance_Area ((uint16*)g_asset_ptrs[124])
+#define kOverworld_Entrance_Area ((uint16*)GetAsset(124))
 #define kOverworld_Entrance_Area_SIZE (g_asset_sizes[124])
-#define kOverworld_Entrance_Pos ((uint16*)g_asset_ptrs[125])
+#define kOverworld_Entrance_Pos ((uint16*)GetAsset(125))
 #define kOverworld_Entrance_Pos_SIZE (g_asset_sizes[125])
-#define kOverworld_Entrance_Id ((uint8*)g_asset_ptrs[126])
+#define kOverworld_Entrance_Id ((uint8*)GetAsset(126))
 #define kOverworld_Entrance_Id_SIZE (g_asset_sizes[126])
-#define kFallHole_Area ((uint16*)g_asset_ptrs[127])
+#define kFallHole_Area ((uint16*)GetAsset(127))
 #define kFallHole_Area_SIZE (g_asset_sizes[127])
-#define kFallHole_Pos ((uint16*)g_asset_ptrs[128])
+#define kFallHole_Pos ((uint16*)GetAsset(128))
 #define kFallHole_Pos_SIZE (g_asset_sizes[128])
-#define kFallHole_Entrances ((uint8*)g_asset_ptrs[129])
+#define kFallHole_Entrances ((uint8*)GetAsset(129))
 #define kFallHole_Entrances_SIZE (g_asset_sizes[129])
-#define kExitData_ScreenIndex ((uint8*)g_asset_ptrs[130])
+#define kExitData_ScreenIndex ((uint8*)GetAsset(130))
 #define kExitData_ScreenIndex_SIZE (g_asset_sizes[130])
-#define kExitDataRooms ((uint16*)g_asset_ptrs[131])
+#define kExitDataRooms ((uint16*)GetAsset(131))
 #define kExitDataRooms_SIZE (g_asset_sizes[131])
-#define kExitData_Map16LoadSrcOff ((uint16*)g_asset_ptrs[132])
+#define kExitData_Map16LoadSrcOff ((uint16*)GetAsset(132))
 #define kExitData_Map16LoadSrcOff_SIZE (g_asset_sizes[132])
-#define kExitData_ScrollX ((uint16*)g_asset_ptrs[133])
+#define kExitData_ScrollX ((uint16*)GetAsset(133))
 #define kExitData_ScrollX_SIZE (g_asset_sizes[133])
-#define kExitData_ScrollY ((uint16*)g_asset_ptrs[134])
+#define kExitData_ScrollY ((uint16*)GetAsset(134))
 #define kExitData_ScrollY_SIZE (g_asset_sizes[134])
-#define kExitData_XCoord ((uint16*)g_asset_ptrs[135])
+#define kExitData_XCoord ((uint16*)GetAsset(135))
 #define kExitData_XCoord_SIZE (g_asset_sizes[135])
-#define kExitData_YCoord ((uint16*)g_asset_ptrs[136])
+#define kExitData_YCoord ((uint16*)GetAsset(136))
 #define kExitData_YCoord_SIZE (g_asset_sizes[136])
-#define kExitData_CameraXScroll ((uint16*)g_asset_ptrs[137])
+#define kExitData_CameraXScroll ((uint16*)GetAsset(137))
 #define kExitData_CameraXScroll_SIZE (g_asset_sizes[137])
-#define kExitData_CameraYScroll ((uint16*)g_asset_ptrs[138])
+#define kExitData_CameraYScroll ((uint16*)GetAsset(138))
 #define kExitData_CameraYScroll_SIZE (g_asset_sizes[138])
-#define kExitData_NormalDoor ((uint16*)g_asset_ptrs[139])
+#define kExitData_NormalDoor ((uint16*)GetAsset(139))
 #define kExitData_NormalDoor_SIZE (g_asset_sizes[139])
-#define kExitData_FancyDoor ((uint16*)g_asset_ptrs[140])
+#define kExitData_FancyDoor ((uint16*)GetAsset(140))
 #define kExitData_FancyDoor_SIZE (g_asset_sizes[140])
-#define kExitData_Unk1 ((int8*)g_asset_ptrs[141])
+#define kExitData_Unk1 ((int8*)GetAsset(141))
 #define kExitData_Unk1_SIZE (g_asset_sizes[141])
-#define kExitData_Unk3 ((int8*)g_asset_ptrs[142])
+#define kExitData_Unk3 ((int8*)GetAsset(142))
 #define kExitData_Unk3_SIZE (g_asset_sizes[142])
-#define kSpExit_Top ((uint16*)g_asset_ptrs[143])
+#define kSpExit_Top ((uint16*)GetAsset(143))
 #define kSpExit_Top_SIZE (g_asset_sizes[143])
-#define kSpExit_Bottom ((uint16*)g_asset_ptrs[144])
+#define kSpExit_Bottom ((uint16*)GetAsset(144))
 #define kSpExit_Bottom_SIZE (g_asset_sizes[144])
-#define kSpExit_Left ((uint16*)g_asset_ptrs[145])
+#define kSpExit_Left ((uint16*)GetAsset(145))
 #define kSpExit_Left_SIZE (g_asset_sizes[145])
-#define kSpExit_Right ((uint16*)g_asset_ptrs[146])
+#define kSpExit_Right ((uint16*)GetAsset(146))
 #define kSpExit_Right_SIZE (g_asset_sizes[146])
-#define kSpExit_Tab4 ((int16*)g_asset_ptrs[147])
+#define kSpExit_Tab4 ((int16*)GetAsset(147))
 #define kSpExit_Tab4_SIZE (g_asset_sizes[147])
-#define kSpExit_Tab5 ((int16*)g_asset_ptrs[148])
+#define kSpExit_Tab5 ((int16*)GetAsset(148))
 #define kSpExit_Tab5_SIZE (g_asset_sizes[148])
-#define kSpExit_Tab6 ((int16*)g_asset_ptrs[149])
+#define kSpExit_Tab6 ((int16*)GetAsset(149))
 #define kSpExit_Tab6_SIZE (g_asset_sizes[149])
-#define kSpExit_Tab7 ((int16*)g_asset_ptrs[150])
+#define kSpExit_Tab7 ((int16*)GetAsset(150))
 #define kSpExit_Tab7_SIZE (g_asset_sizes[150])
-#define kSpExit_LeftEdgeOfMap ((uint16*)g_asset_ptrs[151])
+#define kSpExit_LeftEdgeOfMap ((uint16*)GetAsset(151))
 #define kSpExit_LeftEdgeOfMap_SIZE (g_asset_sizes[151])
-#define kSpExit_Dir ((uint8*)g_asset_ptrs[152])
+#define kSpExit_Dir ((uint8*)GetAsset(152))
 #define kSpExit_Dir_SIZE (g_asset_sizes[152])
-#define kSpExit_SprGfx ((uint8*)g_asset_ptrs[153])
+#define kSpExit_SprGfx ((uint8*)GetAsset(153))
 #define kSpExit_SprGfx_SIZE (g_asset_sizes[153])
-#define kSpExit_AuxGfx ((uint8*)g_asset_ptrs[154])
+#define kSpExit_AuxGfx ((uint8*)GetAsset(154))
 #define kSpExit_AuxGfx_SIZE (g_asset_sizes[154])
-#define kSpExit_PalBg ((uint8*)g_asset_ptrs[155])
+#define kSpExit_PalBg ((uint8*)GetAsset(155))
 #define kSpExit_PalBg_SIZE (g_asset_sizes[155])
-#define kSpExit_PalSpr ((uint8*)g_asset_ptrs[156])
+#define kSpExit_PalSpr ((uint8*)GetAsset(156))
 #define kSpExit_PalSpr_SIZE (g_asset_sizes[156])
-#define kOverworldSecrets_Offs ((uint16*)g_asset_ptrs[157])
+#define kOverworldSecrets_Offs ((uint16*)GetAsset(157))
 #define kOverworldSecrets_Offs_SIZE (g_asset_sizes[157])
-#define kOverworldSecrets ((uint8*)g_asset_ptrs[158])
+#define kOverworldSecrets ((uint8*)GetAsset(158))
 #define kOverworldSecrets_SIZE (g_asset_sizes[158])
-#define kOverworldSpriteOffs ((uint16*)g_asset_ptrs[159])
+#define kOverworldSpriteOffs ((uint16*)GetAsset(159))
 #define kOverworldSpriteOffs_SIZE (g_asset_sizes[159])
-#define kOverworldSprites ((uint8*)g_asset_ptrs[160])
+#define kOverworldSprites ((uint8*)GetAsset(160))
 #define kOverworldSprites_SIZE (g_asset_sizes[160])
-#define kOverworldSpriteGfx ((uint8*)g_asset_ptrs[161])
+#define kOverworldSpriteGfx ((uint8*)GetAsset(161))
 #define kOverworldSpriteGfx_SIZE (g_asset_sizes[161])
-#define kOverworldSpritePalettes ((uint8*)g_asset_ptrs[162])
+#define kOverworldSpritePalettes ((uint8*)GetAsset(162))
 #define kOverworldSpritePalettes_SIZE (g_asset_sizes[162])
-#define kMap8DataToTileAttr ((uint8*)g_asset_ptrs[163])
+#define kMap8DataToTileAttr ((uint8*)GetAsset(163))
 #define kMap8DataToTileAttr_SIZE (g_asset_sizes[163])
-#define kSomeTileAttr ((uint8*)g_asset_ptrs[164])
+#define kSomeTileAttr ((uint8*)GetAsset(164))
 #define kSomeTileAttr_SIZE (g_asset_sizes[164])
 #define kAssets_Sig 90, 101, 108, 100, 97, 51, 95, 118, 48, 32, 32, 32, 32, 32, 10, 0, 27, 174, 233, 45, 74, 174, 252, 50, 49, 27, 153, 197, 27, 43, 216, 197, 132, 101, 173, 169, 36, 108, 15, 155, 176, 169, 57, 131, 174, 101, 51, 207
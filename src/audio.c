@@ -7,6 +7,10 @@
 #include "third_party/opus-1.3.1-stripped/opus.h"
 #include "config.h"
 #include "assets.h"
+#include <SDL2/SDL.h>
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#endif
 
 // This needs to hold a lot more things than with just PCM
 typedef struct MsuPlayerResumeInfo {
@@ -26,19 +30,77 @@ enum {
   kMsuState_Playing = 3,
 };
 
-typedef struct MsuPlayer {
+enum {
+  // Decoded packets kept ready by the decoder thread, 20ms each.
+  kMsuRingSize = 16,
+  // Packets decoded and thrown away before a seek target, so the opus
+  // decoder state has converged by the time audible output starts.
+  kMsuPrerollPackets = 4,
+  kMsuSeekIndexCacheSize = 4,
+};
+
+// File offset of each opus packet in an OPUZ file. Every packet holds 960
+// samples, so packet i starts at sample i * 960. Either loaded from the .idx
+// sidecar written by encode_opus.py, or recorded while a track plays.
+typedef struct MsuSeekIndex {
+  uint8 actual_track;
+  uint32 file_size;
+  uint32 last_used;
+  uint32 count, capacity;
+  uint32 *offsets;
+} MsuSeekIndex;
+
+enum {
+  kMsuEvent_None = 0,
+  kMsuEvent_Finished = 1,
+  kMsuEvent_Error = 2,
+};
+
+// One decoded packet, passed from the decoder thread to the audio callback.
+typedef struct MsuChunk {
+  uint32 generation;
+  uint16 size;
+  uint8 event;
+  MsuPlayerResumeInfo resume_info;
+  int16 samples[960 * 2];
+} MsuChunk;
+
+// The file and decoder state. Owned by the decoder thread once submitted.
+typedef struct MsuDecoder {
   FILE *f;
-  uint32 buffer_size, buffer_pos;
+  OpusDecoder *opus;
+  uint32 generation;
   uint32 preskip, samples_until_repeat;
   uint32 total_samples_in_file, repeat_position;
   uint32 cur_file_offs;
+  uint16 range_cur, range_repeat;
+  bool verify_resume;
   MsuPlayerResumeInfo resume_info;
+  MsuSeekIndex *index;
+  // Number of the next packet to read, or -1 if unknown
+  int packet;
+} MsuDecoder;
+
+typedef struct MsuPlayer {
   uint8 enabled;
   uint8 state;
   float volume, volume_step, volume_target;
-  uint16 range_cur, range_repeat;
-  OpusDecoder *opus;
-  int16 buffer[960 * 2];
+  // Resume info of the chunk that's currently being mixed
+  MsuPlayerResumeInfo resume_info;
+  // Bumped on each open, so chunks from the previous track are skipped
+  uint32 generation;
+  uint32 chunk_pos;
+  uint32 underruns;
+  // Single producer / single consumer ring, the counters are free running
+  SDL_atomic_t ring_read, ring_write;
+  MsuChunk ring[kMsuRingSize];
+  SDL_Thread *thread;
+  SDL_sem *wakeup;
+  SDL_mutex *request_mutex;
+  bool quit;
+  bool has_request;
+  MsuDecoder request;
+  MsuDecoder dec;
 } MsuPlayer;
 
 static MsuPlayer g_msu_player;
@@ -157,19 +219,290 @@ void ZeldaPlayMsuAudioTrack(uint8 music_ctrl) {
   ZeldaApuUnlock();
 }
 
-static void MsuPlayer_CloseFile(MsuPlayer *mp) {
-  if (mp->f)
-    fclose(mp->f);
-  opus_decoder_destroy(mp->opus);
-  mp->opus = NULL;
-  mp->f = NULL;
-  if (mp->state != kMsuState_FinishedPlaying)
-    mp->state = kMsuState_Idle;
-  memset(&mp->resume_info, 0, sizeof(mp->resume_info));
+static void MsuPlayer_GetFilename(char *buf, size_t size, int track, const char *ext) {
+  snprintf(buf, size, "%s%d.%s", g_config.msu_path ? g_config.msu_path : "", track, ext);
+}
+
+// Only accessed from the decoder thread.
+static MsuSeekIndex g_msu_seek_index[kMsuSeekIndexCacheSize];
+static uint32 g_msu_seek_index_clock;
+static int16 g_msu_preroll_buffer[960 * 2];
+
+static void MsuSeekIndex_Append(MsuSeekIndex *idx, uint32 offset) {
+  if (idx->count == idx->capacity) {
+    idx->capacity = idx->capacity ? idx->capacity * 2 : 1024;
+    idx->offsets = realloc(idx->offsets, idx->capacity * sizeof(uint32));
+    if (!idx->offsets)
+      Die("realloc failed");
+  }
+  idx->offsets[idx->count++] = offset;
+}
+
+static bool MsuSeekIndex_LoadSidecar(MsuSeekIndex *idx, int track) {
+  char fname[256];
+  uint32 hdr[4];
+  MsuPlayer_GetFilename(fname, sizeof(fname), track, "opuz.idx");
+  FILE *f = fopen(fname, "rb");
+  if (f == NULL)
+    return false;
+  bool ok = false;
+  if (fread(hdr, 4, 4, f) == 4 &&
+      hdr[0] == (('I' << 24) | ('Z' << 16) | ('P' << 8) | 'O') && hdr[1] == 0 && hdr[2] == idx->file_size) {
+    idx->count = 0;
+    for (uint32 i = 0; i < hdr[3]; i++) {
+      uint32 offs;
+      if (fread(&offs, 4, 1, f) != 1)
+        break;
+      MsuSeekIndex_Append(idx, offs);
+    }
+    ok = (idx->count == hdr[3]);
+  }
+  fclose(f);
+  if (!ok)
+    fprintf(stderr, "Ignoring stale or broken MSU index %s\n", fname);
+  return ok;
+}
+
+// Finds the cached index for an opened OPUZ track, or starts a new one.
+static MsuSeekIndex *MsuSeekIndex_Get(int track, FILE *f) {
+  long pos = ftell(f);
+  uint32 first_packet;
+  fseek(f, 0, SEEK_END);
+  uint32 file_size = ftell(f);
+  fseek(f, 8, SEEK_SET);
+  bool has_first_packet = fread(&first_packet, 4, 1, f) == 1;
+  fseek(f, pos, SEEK_SET);
+
+  MsuSeekIndex *idx = &g_msu_seek_index[0];
+  for (int i = 0; i < kMsuSeekIndexCacheSize; i++) {
+    MsuSeekIndex *cur = &g_msu_seek_index[i];
+    if (cur->actual_track == track && cur->file_size == file_size) {
+      idx = cur;
+      goto DONE;
+    }
+    if (cur->last_used < idx->last_used)
+      idx = cur;
+  }
+  // Replace the least recently used entry
+  idx->actual_track = track;
+  idx->file_size = file_size;
+  idx->count = 0;
+  if (!MsuSeekIndex_LoadSidecar(idx, track) && has_first_packet) {
+    // The first play range always starts at the first packet.
+    MsuSeekIndex_Append(idx, first_packet);
+  }
+DONE:
+  idx->last_used = ++g_msu_seek_index_clock;
+  return idx;
+}
+
+// Returns the packet number that starts at |offset|, or -1.
+static int MsuSeekIndex_Find(MsuSeekIndex *idx, uint32 offset) {
+  int lo = 0, hi = idx->count;
+  while (lo < hi) {
+    int mid = (lo + hi) >> 1;
+    if (idx->offsets[mid] < offset)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return (lo < idx->count && idx->offsets[lo] == offset) ? lo : -1;
+}
+
+// Called before reading each packet, to grow the index while playing.
+static void MsuDecoder_TrackPacket(MsuDecoder *dec) {
+  MsuSeekIndex *idx = dec->index;
+  if (idx == NULL || dec->packet < 0)
+    return;
+  if (dec->packet == idx->count)
+    MsuSeekIndex_Append(idx, dec->cur_file_offs);
+  else if (idx->offsets[dec->packet] != dec->cur_file_offs)
+    dec->packet = -1;  // Not where the index says, stop trusting it
+  if (dec->packet >= 0)
+    dec->packet++;
+}
+
+// Positions the file at the packet starting at |offset|. If the index knows
+// the preceding packets, those are decoded first to prime the decoder.
+static void MsuDecoder_SeekToPacket(MsuDecoder *dec, uint32 offset, int16 *scratch) {
+  int k = dec->index ? MsuSeekIndex_Find(dec->index, offset) : -1;
+  dec->packet = k;
+  if (k > 0) {
+    uint32 *offsets = dec->index->offsets;
+    uint8 *file_data = (uint8 *)scratch;
+    fseek(dec->f, offsets[IntMax(k - kMsuPrerollPackets, 0)], SEEK_SET);
+    for (int i = IntMax(k - kMsuPrerollPackets, 0); i < k; i++) {
+      int size = offsets[i + 1] - offsets[i] - 2;
+      if (size < 0 || size > 1275 || fread(file_data, 1, size + 2, dec->f) != size + 2)
+        break;
+      int n = (*(uint16 *)file_data >> 15);
+      file_data[1] = 0xfc;
+      if (opus_decode(dec->opus, &file_data[2 - n], size + n, scratch, 960, 0) <= 0) {
+        // Start from a clean decoder, like without the index
+        opus_decoder_ctl(dec->opus, OPUS_RESET_STATE);
+        break;
+      }
+    }
+  }
+  fseek(dec->f, offset, SEEK_SET);
+}
+
+static void MsuDecoder_Close(MsuDecoder *dec) {
+  if (dec->f)
+    fclose(dec->f);
+  opus_decoder_destroy(dec->opus);
+  dec->opus = NULL;
+  dec->f = NULL;
+}
+
+// Decodes the next packet of the track into |c|. Runs on the decoder thread.
+static void MsuDecoder_DecodeChunk(MsuDecoder *dec, MsuChunk *c) {
+  int r;
+
+  c->generation = dec->generation;
+  c->event = kMsuEvent_None;
+  c->size = 0;
+  if (dec->opus != NULL) {
+    if (dec->samples_until_repeat == 0) {
+      if (dec->range_cur == 0) FINISHED_PLAYING: {
+        c->event = kMsuEvent_Finished;
+        MsuDecoder_Close(dec);
+        return;
+      }
+      opus_decoder_ctl(dec->opus, OPUS_RESET_STATE);
+      fseek(dec->f, dec->range_cur, SEEK_SET);
+      uint8 *file_data = (uint8 *)c->samples;
+      if (fread(file_data, 1, 10, dec->f) != 10) READ_ERROR: {
+        fprintf(stderr, "MSU read/decode error!\n");
+        c->event = kMsuEvent_Error;
+        MsuDecoder_Close(dec);
+        return;
+      }
+      uint32 file_offs = *(uint32 *)&file_data[0];
+      assert((file_offs & 0xF0000000) == 0);
+      uint32 samples_until_repeat = *(uint32 *)&file_data[4];
+      uint16 preskip = *(uint32 *)&file_data[8];
+      dec->samples_until_repeat = samples_until_repeat;
+      dec->preskip = preskip & 0x3fff;
+      if (preskip & 0x4000)
+        dec->range_repeat = dec->range_cur;
+      dec->range_cur = (preskip & 0x8000) ? dec->range_repeat : dec->range_cur + 10;
+      dec->cur_file_offs = file_offs;
+      dec->resume_info.range_repeat = dec->range_repeat;
+      dec->resume_info.range_cur = dec->range_cur;
+      MsuDecoder_SeekToPacket(dec, file_offs, c->samples);
+    }
+    assert(dec->samples_until_repeat != 0);
+    for (;;) {
+      uint8 *file_data = (uint8 *)c->samples;
+      MsuDecoder_TrackPacket(dec);
+      *(uint64 *)file_data = 0;
+      if (fread(file_data, 1, 2, dec->f) != 2)
+        goto READ_ERROR;
+      int size = *(uint16 *)file_data & 0x7fff;
+      if (size > 1275)
+        goto READ_ERROR;
+      int n = (*(uint16 *)file_data >> 15);
+      if (fread(&file_data[2], 1, size, dec->f) != size)
+        goto READ_ERROR;
+      // Verify if the snapshot matches the file on disk.
+      uint64 initial_file_data = *(uint64 *)file_data;
+      if (dec->verify_resume) {
+        dec->verify_resume = false;
+        if (dec->resume_info.initial_packet_bytes != initial_file_data)
+          goto READ_ERROR;
+      }
+      dec->resume_info.initial_packet_bytes = initial_file_data;
+      dec->resume_info.samples_until_repeat = dec->samples_until_repeat + dec->preskip;
+      dec->resume_info.offset = dec->cur_file_offs;
+      dec->cur_file_offs += 2 + size;
+      file_data[1] = 0xfc;
+      r = opus_decode(dec->opus, &file_data[2 - n], size + n, c->samples, 960, 0);
+      if (r <= 0)
+        goto READ_ERROR;
+      if (r > dec->preskip)
+        break;
+      dec->preskip -= r;
+    }
+  } else {
+    if (dec->samples_until_repeat == 0) {
+      if (dec->resume_info.actual_track < sizeof(kMsuTracksWithRepeat) && !kMsuTracksWithRepeat[dec->resume_info.actual_track])
+        goto FINISHED_PLAYING;
+      dec->samples_until_repeat = dec->total_samples_in_file - dec->repeat_position;
+      if (dec->samples_until_repeat == 0)
+        goto READ_ERROR; // impossible to make progress
+      dec->cur_file_offs = dec->repeat_position;
+      fseek(dec->f, dec->cur_file_offs * 4 + 8, SEEK_SET);
+    }
+    r = UintMin(960, dec->samples_until_repeat);
+    if (fread(c->samples, 4, r, dec->f) != r)
+      goto READ_ERROR;
+    dec->resume_info.offset = dec->cur_file_offs;
+    dec->cur_file_offs += r;
+  }
+  uint32 n = UintMin(r - dec->preskip, dec->samples_until_repeat);
+  dec->samples_until_repeat -= n;
+  if (dec->preskip != 0)
+    memmove(c->samples, c->samples + dec->preskip * 2, n * 4);
+  dec->preskip = 0;
+  c->size = n;
+  c->resume_info = dec->resume_info;
+}
+
+// Keeps the ring filled with decoded packets so that file reads and opus
+// decoding never happen on the audio callback.
+static int SDLCALL MsuPlayer_DecoderThread(void *data) {
+  MsuPlayer *mp = data;
+  MsuDecoder *dec = &mp->dec;
+  while (!mp->quit) {
+    SDL_LockMutex(mp->request_mutex);
+    bool started = mp->has_request;
+    if (started) {
+      MsuDecoder_Close(dec);
+      *dec = mp->request;
+      mp->has_request = false;
+    }
+    SDL_UnlockMutex(mp->request_mutex);
+    if (started && dec->opus != NULL) {
+      dec->index = MsuSeekIndex_Get(dec->resume_info.actual_track, dec->f);
+      if (dec->verify_resume)
+        MsuDecoder_SeekToPacket(dec, dec->cur_file_offs, g_msu_preroll_buffer);
+    }
+    uint32 wr = SDL_AtomicGet(&mp->ring_write);
+    if (dec->f == NULL || wr - SDL_AtomicGet(&mp->ring_read) >= kMsuRingSize) {
+      SDL_SemWaitTimeout(mp->wakeup, 100);
+      continue;
+    }
+    MsuDecoder_DecodeChunk(dec, &mp->ring[wr % kMsuRingSize]);
+    SDL_AtomicSet(&mp->ring_write, wr + 1);
+  }
+  return 0;
+}
+
+// Hands the newly opened file (or none) over to the decoder thread.
+static void MsuPlayer_SubmitDecoder(MsuPlayer *mp, MsuDecoder *dec) {
+  if (!mp->thread) {
+    mp->wakeup = SDL_CreateSemaphore(0);
+    mp->request_mutex = SDL_CreateMutex();
+    if (!mp->wakeup || !mp->request_mutex)
+      Die("Unable to create MSU decoder sync objects");
+    mp->thread = SDL_CreateThread(&MsuPlayer_DecoderThread, "msu_decoder", mp);
+    if (!mp->thread)
+      Die("Unable to create MSU decoder thread");
+  }
+  SDL_LockMutex(mp->request_mutex);
+  // A request the thread didn't pick up yet is simply replaced.
+  if (mp->has_request)
+    MsuDecoder_Close(&mp->request);
+  mp->request = *dec;
+  mp->has_request = true;
+  SDL_UnlockMutex(mp->request_mutex);
+  SDL_SemPost(mp->wakeup);
 }
 
 static void MsuPlayer_Open(MsuPlayer *mp, int orig_track, bool resume_from_snapshot) {
   MsuPlayerResumeInfo resume;
+  MsuDecoder dec = { 0 };
   int actual_track = RemapMsuDeluxeTrack(mp, orig_track);
 
   if (!resume_from_snapshot) {
@@ -188,24 +521,31 @@ static void MsuPlayer_Open(MsuPlayer *mp, int orig_track, bool resume_from_snaps
   mp->volume_target = kVolumeTransitionTargetFloat[3];
   mp->volume_step = kVolumeTransitionStepFloat[3];
 
+  // Anything still in the ring belongs to the previous track.
+  mp->generation++;
+  mp->chunk_pos = 0;
   mp->state = kMsuState_Idle;
-  MsuPlayer_CloseFile(mp);
+  memset(&mp->resume_info, 0, sizeof(mp->resume_info));
+  dec.generation = mp->generation;
   if (actual_track == 0)
-    return;
+    goto SUBMIT;
   char fname[256], buf[8];
-  snprintf(fname, sizeof(fname), "%s%d.%s", g_config.msu_path ? g_config.msu_path : "", actual_track, mp->enabled & kMsuEnabled_Opuz ? "opuz" : "pcm");
+  MsuPlayer_GetFilename(fname, sizeof(fname), actual_track, mp->enabled & kMsuEnabled_Opuz ? "opuz" : "pcm");
   printf("Loading MSU %s\n", fname);
-  mp->f = fopen(fname, "rb");
-  if (mp->f == NULL)
+  dec.f = fopen(fname, "rb");
+  if (dec.f == NULL)
     goto READ_ERROR;
-  setvbuf(mp->f, NULL, _IOFBF, 16384);
-  if (fread(buf, 1, 8, mp->f) != 8) READ_ERROR: {
+  // Read ahead in big blocks, the decoder thread absorbs the latency.
+  setvbuf(dec.f, NULL, _IOFBF, 65536);
+  if (fread(buf, 1, 8, dec.f) != 8) READ_ERROR: {
     fprintf(stderr, "Unable to read MSU file %s\n", fname);
-    MsuPlayer_CloseFile(mp);
-    return;
+    MsuDecoder_Close(&dec);
+    mp->state = kMsuState_Idle;
+    memset(&mp->resume_info, 0, sizeof(mp->resume_info));
+    goto SUBMIT;
   }
   uint32 file_tag = *(uint32 *)(buf + 0);
-  mp->repeat_position = *(uint32 *)(buf + 4);
+  dec.repeat_position = *(uint32 *)(buf + 4);
   mp->state = (resume.actual_track == actual_track && resume.tag == file_tag) ? kMsuState_Resuming : kMsuState_Playing;
   if (mp->state == kMsuState_Resuming) {
     memcpy(&mp->resume_info, &resume, sizeof(mp->resume_info));
@@ -215,55 +555,95 @@ static void MsuPlayer_Open(MsuPlayer *mp, int orig_track, bool resume_from_snaps
     mp->resume_info.tag = file_tag;
     mp->resume_info.range_cur = 8;
   }
-  mp->cur_file_offs = mp->resume_info.offset;
-  mp->samples_until_repeat = mp->resume_info.samples_until_repeat;
-  mp->range_cur = mp->resume_info.range_cur;
-  mp->range_repeat = mp->resume_info.range_repeat;
-  mp->buffer_size = mp->buffer_pos = 0;
-  mp->preskip = 0;
+  dec.resume_info = mp->resume_info;
+  dec.verify_resume = (mp->state == kMsuState_Resuming);
+  dec.cur_file_offs = mp->resume_info.offset;
+  dec.samples_until_repeat = mp->resume_info.samples_until_repeat;
+  dec.range_cur = mp->resume_info.range_cur;
+  dec.range_repeat = mp->resume_info.range_repeat;
+  dec.preskip = 0;
+  dec.packet = -1;
   if (file_tag == (('Z' << 24) | ('U' << 16) | ('P' << 8) | 'O')) {
-    mp->opus = opus_decoder_create(48000, 2, NULL);
-    if (!mp->opus)
+    dec.opus = opus_decoder_create(48000, 2, NULL);
+    if (!dec.opus)
       goto READ_ERROR;
-    if (mp->state == kMsuState_Resuming)
-      fseek(mp->f, mp->cur_file_offs, SEEK_SET);
+    // The decoder thread seeks to the resume position.
   } else if (file_tag == (('1' << 24) | ('U' << 16) | ('S' << 8) | 'M')) {
-    fseek(mp->f, 0, SEEK_END);
-    mp->total_samples_in_file = (ftell(mp->f) - 8) / 4;
-    mp->samples_until_repeat = mp->total_samples_in_file - mp->cur_file_offs;
-    fseek(mp->f, mp->cur_file_offs * 4 + 8, SEEK_SET);
+    fseek(dec.f, 0, SEEK_END);
+    dec.total_samples_in_file = (ftell(dec.f) - 8) / 4;
+    dec.samples_until_repeat = dec.total_samples_in_file - dec.cur_file_offs;
+    fseek(dec.f, dec.cur_file_offs * 4 + 8, SEEK_SET);
   } else {
     goto READ_ERROR;
   }
+SUBMIT:
+  MsuPlayer_SubmitDecoder(mp, &dec);
 }
 
-static void MixToBufferWithVolume(int16 *dst, const int16 *src, size_t n, float volume) {
-  if (volume == 1.0f) {
-    for (size_t i = 0; i < n; i++) {
-      dst[i * 2 + 0] += src[i * 2 + 0];
-      dst[i * 2 + 1] += src[i * 2 + 1];
-    }
-  } else {
-    uint32 vol = (int32)(65536 * volume);
-    for (size_t i = 0; i < n; i++) {
-      dst[i * 2 + 0] += src[i * 2 + 0] * vol >> 16;
-      dst[i * 2 + 1] += src[i * 2 + 1] * vol >> 16;
-    }
-  }
+// The master volume is 2.14 fixed point, the MSU volume ramps are 2.30
+enum {
+  kAudioVolumeOne = 1 << 14,
+};
+static int g_audio_master_volume = kAudioVolumeOne;
+
+static FORCEINLINE int16 SaturateInt16(int v) {
+  return v < -32768 ? -32768 : v > 32767 ? 32767 : v;
 }
 
-static void MixToBufferWithVolumeRamp(int16 *dst, const int16 *src, size_t n, float volume, float volume_step, float ideal_target) {
-  int64 vol = volume * 281474976710656.0f;
-  int64 step = volume_step * 281474976710656.0f;
-  for (size_t i = 0; i < n; i++) {
-    uint32 v = (vol >> 32);
-    dst[i * 2 + 0] += src[i * 2 + 0] * v >> 16;
-    dst[i * 2 + 1] += src[i * 2 + 1] * v >> 16;
-    vol += step;
+#if defined(__SSE2__) || defined(_M_X64)
+// (a * b) >> 14 on 8 samples, saturated
+static FORCEINLINE __m128i MulQ14(__m128i a, __m128i b) {
+  __m128i lo = _mm_mullo_epi16(a, b), hi = _mm_mulhi_epi16(a, b);
+  return _mm_packs_epi32(_mm_srai_epi32(_mm_unpacklo_epi16(lo, hi), 14),
+                         _mm_srai_epi32(_mm_unpackhi_epi16(lo, hi), 14));
+}
+#endif
+
+// Scales n samples by the master volume
+static void ApplyMasterVolume(int16 *dst, size_t n, int master) {
+  if (master == kAudioVolumeOne)
+    return;
+  size_t i = 0;
+#if defined(__SSE2__) || defined(_M_X64)
+  __m128i vmaster = _mm_set1_epi16(master);
+  for (; i + 8 <= n; i += 8)
+    _mm_storeu_si128((__m128i *)(dst + i), MulQ14(_mm_loadu_si128((const __m128i *)(dst + i)), vmaster));
+#endif
+  for (; i < n; i++)
+    dst[i] = dst[i] * master >> 14;
+}
+
+// Adds n frames of stereo |src| into |dst| in one pass. |src| is scaled by a volume
+// that starts at |vol| and changes by |step| each frame, the sum is saturated and then
+// scaled by the master volume. The result is the same with and without SSE2.
+static void MixStereoSaturated(int16 *dst, const int16 *src, size_t n, int32 vol, int32 step, int master) {
+  size_t i = 0;
+#if defined(__SSE2__) || defined(_M_X64)
+  __m128i vols = _mm_add_epi32(_mm_set1_epi32(vol), _mm_setr_epi32(0, step, step * 2, step * 3));
+  __m128i vstep = _mm_set1_epi32(step * 4), vmaster = _mm_set1_epi16(master);
+  for (; i + 4 <= n; i += 4) {
+    __m128i v = _mm_srai_epi32(vols, 16);
+    v = _mm_packs_epi32(v, v);
+    v = _mm_unpacklo_epi16(v, v);  // Same volume for left and right
+    __m128i d = _mm_loadu_si128((const __m128i *)(dst + i * 2));
+    d = _mm_adds_epi16(d, MulQ14(_mm_loadu_si128((const __m128i *)(src + i * 2)), v));
+    if (master != kAudioVolumeOne)
+      d = MulQ14(d, vmaster);
+    _mm_storeu_si128((__m128i *)(dst + i * 2), d);
+    vols = _mm_add_epi32(vols, vstep);
+  }
+  vol += step * (int32)i;
+#endif
+  for (; i < n; i++, vol += step) {
+    int v = vol >> 16;
+    int l = SaturateInt16(dst[i * 2 + 0] + (src[i * 2 + 0] * v >> 14));
+    int r = SaturateInt16(dst[i * 2 + 1] + (src[i * 2 + 1] * v >> 14));
+    dst[i * 2 + 0] = l * master >> 14;
+    dst[i * 2 + 1] = r * master >> 14;
   }
 }
 
-static void MixToBuffer(MsuPlayer *mp, int16 *dst, const int16 *src, uint32 n) {
+static void MixToBuffer(MsuPlayer *mp, int16 *dst, const int16 *src, uint32 n, int master) {
   if (mp->volume != mp->volume_target) {
     float step = mp->volume < mp->volume_target ? mp->volume_step : -mp->volume_step;
     float new_vol = mp->volume + step * n;
@@ -275,125 +655,51 @@ static void MixToBuffer(MsuPlayer *mp, int16 *dst, const int16 *src, uint32 n) {
     }
     float vol = mp->volume;
     mp->volume = new_vol;
-    MixToBufferWithVolumeRamp(dst, src, curn, vol, step, new_vol);
+    MixStereoSaturated(dst, src, curn, (int32)(vol * 1073741824.0f), (int32)(step * 1073741824.0f), master);
     dst += curn * 2, src += curn * 2, n -= curn;
   }
-  MixToBufferWithVolume(dst, src, n, mp->volume);
+  MixStereoSaturated(dst, src, n, (int32)(mp->volume * 1073741824.0f), 0, master);
 }
 
-void MsuPlayer_Mix(MsuPlayer *mp, int16 *audio_buffer, int audio_samples) {
-  int r;
-
-  do {
-    if (mp->buffer_size - mp->buffer_pos == 0) {
-      if (mp->opus != NULL) {
-        if (mp->samples_until_repeat == 0) {
-          if (mp->range_cur == 0) FINISHED_PLAYING: {
-            mp->state = kMsuState_FinishedPlaying;
-            MsuPlayer_CloseFile(mp);
-            return;
-          }
-          opus_decoder_ctl(mp->opus, OPUS_RESET_STATE);
-          fseek(mp->f, mp->range_cur, SEEK_SET);
-          uint8 *file_data = (uint8 *)mp->buffer;
-          if (fread(file_data, 1, 10, mp->f) != 10) READ_ERROR: {
-            fprintf(stderr, "MSU read/decode error!\n");
-            zelda_apu_write(APUI00, mp->resume_info.orig_track);
-            MsuPlayer_CloseFile(mp);
-            return;
-          }
-          uint32 file_offs = *(uint32 *)&file_data[0];
-          assert((file_offs & 0xF0000000) == 0);
-          uint32 samples_until_repeat = *(uint32 *)&file_data[4];
-          uint16 preskip = *(uint32 *)&file_data[8];
-          mp->samples_until_repeat = samples_until_repeat;
-          mp->preskip = preskip & 0x3fff;
-          if (preskip & 0x4000)
-            mp->range_repeat = mp->range_cur;
-          mp->range_cur = (preskip & 0x8000) ? mp->range_repeat : mp->range_cur + 10;
-          mp->cur_file_offs = file_offs;
-          mp->resume_info.range_repeat = mp->range_repeat;
-          mp->resume_info.range_cur = mp->range_cur;
-          fseek(mp->f, file_offs, SEEK_SET);
-        }
-        assert(mp->samples_until_repeat != 0);
-        for (;;) {
-          uint8 *file_data = (uint8 *)mp->buffer;
-          *(uint64 *)file_data = 0;
-          if (fread(file_data, 1, 2, mp->f) != 2)
-            goto READ_ERROR;
-          int size = *(uint16 *)file_data & 0x7fff;
-          if (size > 1275)
-            goto READ_ERROR;
-          int n = (*(uint16 *)file_data >> 15);
-          if (fread(&file_data[2], 1, size, mp->f) != size)
-            goto READ_ERROR;
-          // Verify if the snapshot matches the file on disk.
-          uint64 initial_file_data = *(uint64 *)file_data;
-          if (mp->state == kMsuState_Resuming) {
-            mp->state = kMsuState_Playing;
-            if (mp->resume_info.initial_packet_bytes != initial_file_data)
-              goto READ_ERROR;
-          }
-          mp->resume_info.initial_packet_bytes = initial_file_data;
-          mp->resume_info.samples_until_repeat = mp->samples_until_repeat + mp->preskip;
-          mp->resume_info.offset = mp->cur_file_offs;
-          mp->cur_file_offs += 2 + size;
-          file_data[1] = 0xfc;
-          r = opus_decode(mp->opus, &file_data[2 - n], size + n, mp->buffer, 960, 0);
-          if (r <= 0)
-            goto READ_ERROR;
-          if (r > mp->preskip)
-            break;
-          mp->preskip -= r;
-        }
-      } else {
-        if (mp->samples_until_repeat == 0) {
-          if (mp->resume_info.actual_track < sizeof(kMsuTracksWithRepeat) && !kMsuTracksWithRepeat[mp->resume_info.actual_track])
-            goto FINISHED_PLAYING;
-          mp->samples_until_repeat = mp->total_samples_in_file - mp->repeat_position;
-          if (mp->samples_until_repeat == 0)
-            goto READ_ERROR; // impossible to make progress
-          mp->cur_file_offs = mp->repeat_position;
-          fseek(mp->f, mp->cur_file_offs * 4 + 8, SEEK_SET);
-        }
-        r = UintMin(960, mp->samples_until_repeat);
-        if (fread(mp->buffer, 4, r, mp->f) != r)
-          goto READ_ERROR;
-        mp->resume_info.offset = mp->cur_file_offs;
-        mp->cur_file_offs += r;
-      }
-      uint32 n = UintMin(r - mp->preskip, mp->samples_until_repeat);
-      mp->samples_until_repeat -= n;
-      mp->buffer_pos = mp->preskip;
-      mp->buffer_size = mp->buffer_pos + n;
-      mp->preskip = 0;
-    }
-#if 0
-    if (mp->samples_to_play > 44100 * 5) {
-      mp->buffer_pos = mp->buffer_size;
+// Called from the audio callback. Only mixes what the decoder thread prepared.
+// Returns how many frames from the start of the buffer were mixed.
+int MsuPlayer_Mix(MsuPlayer *mp, int16 *audio_buffer, int audio_samples, int master) {
+  int mixed = 0;
+  while (audio_samples != 0) {
+    uint32 rd = SDL_AtomicGet(&mp->ring_read);
+    if (rd == SDL_AtomicGet(&mp->ring_write)) {
+      // The decoder fell behind, the rest of this block is left silent.
+      mp->underruns++;
+      return mixed;
     }
-#endif
-    int nr = IntMin(audio_samples, mp->buffer_size - mp->buffer_pos);
-    int16 *buf = mp->buffer + mp->buffer_pos * 2;
-    mp->buffer_pos += nr;
-
-#if 0
-    static int t;
-    for (int i = 0; i < nr; i++) {
-      buf[i * 2 + 0] = buf[i * 2 + 1] = 5000 * sinf(2 * 3.1415 * t++ / 440);
+    MsuChunk *c = &mp->ring[rd % kMsuRingSize];
+    if (c->generation == mp->generation) {
+      if (c->event != kMsuEvent_None) {
+        if (c->event == kMsuEvent_Error)
+          zelda_apu_write(APUI00, mp->resume_info.orig_track);
+        mp->state = (c->event == kMsuEvent_Finished) ? kMsuState_FinishedPlaying : kMsuState_Idle;
+        memset(&mp->resume_info, 0, sizeof(mp->resume_info));
+        SDL_AtomicSet(&mp->ring_read, rd + 1);
+        return mixed;
+      }
+      if (mp->chunk_pos == 0) {
+        memcpy(&mp->resume_info, &c->resume_info, sizeof(mp->resume_info));
+        if (mp->state == kMsuState_Resuming)
+          mp->state = kMsuState_Playing;
+      }
+      int nr = IntMin(audio_samples, c->size - mp->chunk_pos);
+      MixToBuffer(mp, audio_buffer, c->samples + mp->chunk_pos * 2, nr, master);
+      mp->chunk_pos += nr;
+      mixed += nr;
+      audio_samples -= nr, audio_buffer += nr * 2;
+      if (mp->chunk_pos != c->size)
+        return mixed;
     }
-#endif
-    MixToBuffer(mp, audio_buffer, buf, nr);
-
-#if 0
-    static FILE *f;
-    if (!f)f = fopen("out.pcm", "wb");
-    fwrite(audio_buffer, 4, nr, f);
-    fflush(f);
-#endif
-    audio_samples -= nr, audio_buffer += nr * 2;
-  } while (audio_samples != 0);
+    mp->chunk_pos = 0;
+    SDL_AtomicSet(&mp->ring_read, rd + 1);
+    SDL_SemPost(mp->wakeup);
+  }
+  return mixed;
 }
 
 // Maintain a queue cause the snes and audio callback are not in sync.
@@ -452,11 +758,19 @@ void ZeldaRenderAudio(int16 *audio_buffer, int samples, int channels) {
   ZeldaPopApuState();
   SpcPlayer_GenerateSamples(g_zenv.player);
   dsp_getSamples(g_zenv.player->dsp, audio_buffer, samples, channels);
-  if (g_msu_player.f && channels == 2)
-    MsuPlayer_Mix(&g_msu_player, audio_buffer, samples);
+  // The master volume is applied while mixing in the msu, and separately only
+  // for the frames that had no msu audio.
+  int master = g_audio_master_volume, mixed = 0;
+  if (g_msu_player.state >= kMsuState_Resuming && channels == 2)
+    mixed = MsuPlayer_Mix(&g_msu_player, audio_buffer, samples, master);
+  ApplyMasterVolume(audio_buffer + mixed * channels, (samples - mixed) * channels, master);
   ZeldaApuUnlock();
 }
 
+void ZeldaSetAudioVolume(int volume) {
+  g_audio_master_volume = IntMin(IntMax(volume, 0), 128) << 7;
+}
+
 bool ZeldaIsMusicPlaying() {
   if (g_msu_player.state != kMsuState_Idle) {
     return g_msu_player.state != kMsuState_FinishedPlaying;
@@ -535,6 +849,22 @@ void ZeldaEnableMsu(uint8 enable) {
   }
 }
 
+void ZeldaShutdownMsu() {
+  MsuPlayer *mp = &g_msu_player;
+  if (!mp->thread)
+    return;
+  mp->quit = true;
+  SDL_SemPost(mp->wakeup);
+  SDL_WaitThread(mp->thread, NULL);
+  mp->thread = NULL;
+  MsuDecoder_Close(&mp->dec);
+  if (mp->has_request)
+    MsuDecoder_Close(&mp->request);
+  mp->has_request = false;
+  SDL_DestroySemaphore(mp->wakeup);
+  SDL_DestroyMutex(mp->request_mutex);
+}
+
 void LoadSongBank(const uint8 *p) {  // 808888
   ZeldaApuLock();
   SpcPlayer_Upload(g_zenv.player, p);
@@ -10,8 +10,12 @@ void ZeldaPlayMsuAudioTrack(uint8 track);
 bool ZeldaIsMusicPlaying();
 
 void ZeldaEnableMsu(uint8 enable);
+// Stops the MSU decoder thread and closes the track. Call after the audio device is closed.
+void ZeldaShutdownMsu();
 
 void ZeldaRenderAudio(int16 *audio_buffer, int samples, int channels);
+// Volume between 0 and 128, applied to the rendered audio
+void ZeldaSetAudioVolume(int volume);
 void ZeldaDiscardUnusedAudioFrames();
 void ZeldaRestoreMusicAfterLoad_Locked(bool is_reset);
 void ZeldaSaveMusicStateToRam_Locked();
@@ -0,0 +1,243 @@
+#include "capture.h"
+#include "arena.h"
+#include "util.h"
+#include "snes/ppu.h"
+#include <SDL2/SDL.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+enum {
+  kCaptureVideoSlots = 8,
+  kCaptureAudioSlots = 32,
+  kCaptureAudioSlotFrames = 2048,
+};
+
+typedef struct CaptureAudioSlot {
+  int num_frames;
+  int16 *samples;
+} CaptureAudioSlot;
+
+typedef struct Capture {
+  bool active;
+  bool quit;
+  FILE *video_file, *audio_file;
+  // Set by the first frame, before it's published to the writer
+  int width, height;
+  size_t slot_size;
+  uint8 *video_slots;
+  uint32 slot_pixel_format[kCaptureVideoSlots];
+  uint8 *yuv;
+  int audio_freq, audio_channels;
+  uint32 audio_bytes;
+  CaptureAudioSlot audio_slots[kCaptureAudioSlots];
+  // Single producer / single consumer rings, the counters are free running
+  SDL_atomic_t video_read, video_write;
+  SDL_atomic_t audio_read, audio_write;
+  uint32 frames_written, frames_dropped, audio_dropped;
+  SDL_Thread *thread;
+  SDL_sem *wakeup;
+} Capture;
+
+static Capture g_capture;
+
+static void Capture_WriteWavHeader(Capture *c) {
+  uint32 fields[11] = {
+    0, 36 + c->audio_bytes, 0, 0, 16,
+    1 | c->audio_channels << 16, c->audio_freq, c->audio_freq * c->audio_channels * 2,
+    c->audio_channels * 2 | 16 << 16, 0, c->audio_bytes,
+  };
+  uint8 hdr[44];
+  for (int i = 0; i < 11; i++)
+    DWORD(hdr[i * 4]) = fields[i];
+  memcpy(hdr, "RIFF", 4);
+  memcpy(hdr + 8, "WAVEfmt ", 8);
+  memcpy(hdr + 36, "data", 4);
+  fseek(c->audio_file, 0, SEEK_SET);
+  fwrite(hdr, 1, sizeof(hdr), c->audio_file);
+  fseek(c->audio_file, 0, SEEK_END);
+}
+
+// BT.601 limited range. The frames are stored as 4:4:4 so no chroma
+// subsampling is needed.
+static void Capture_WriteFrame(Capture *c, const uint8 *src, uint32 pixel_format) {
+  int n = c->width * c->height;
+  uint8 *y = c->yuv, *u = y + n, *v = u + n;
+  for (int i = 0; i < n; i++) {
+    int r, g, b;
+    if (pixel_format == kPpuRenderFlags_Rgb565) {
+      uint16 p = ((const uint16 *)src)[i];
+      r = (p >> 11) * 255 / 31, g = (p >> 5 & 63) * 255 / 63, b = (p & 31) * 255 / 31;
+    } else {
+      uint32 p = ((const uint32 *)src)[i];
+      if (pixel_format == kPpuRenderFlags_Rgba8888)
+        r = p & 0xff, g = p >> 8 & 0xff, b = p >> 16 & 0xff;
+      else
+        r = p >> 16 & 0xff, g = p >> 8 & 0xff, b = p & 0xff;
+    }
+    y[i] = (uint8)(((66 * r + 129 * g + 25 * b + 128) >> 8) + 16);
+    u[i] = (uint8)(((-38 * r - 74 * g + 112 * b + 128) >> 8) + 128);
+    v[i] = (uint8)(((112 * r - 94 * g - 18 * b + 128) >> 8) + 128);
+  }
+  // The snes outputs 32000/534 frames per second
+  if (c->frames_written++ == 0)
+    fprintf(c->video_file, "YUV4MPEG2 W%d H%d F32000:534 Ip A1:1 C444\n", c->width, c->height);
+  fputs("FRAME\n", c->video_file);
+  fwrite(c->yuv, 1, n * 3, c->video_file);
+}
+
+static int SDLCALL Capture_WriterThread(void *data) {
+  Capture *c = (Capture *)data;
+  for (;;) {
+    bool did_work = false;
+    uint32 rd = SDL_AtomicGet(&c->video_read);
+    if (rd != (uint32)SDL_AtomicGet(&c->video_write)) {
+      Capture_WriteFrame(c, c->video_slots + (rd % kCaptureVideoSlots) * c->slot_size,
+                         c->slot_pixel_format[rd % kCaptureVideoSlots]);
+      SDL_AtomicSet(&c->video_read, rd + 1);
+      did_work = true;
+    }
+    rd = SDL_AtomicGet(&c->audio_read);
+    if (rd != (uint32)SDL_AtomicGet(&c->audio_write)) {
+      CaptureAudioSlot *s = &c->audio_slots[rd % kCaptureAudioSlots];
+      size_t n = s->num_frames * c->audio_channels * sizeof(int16);
+      fwrite(s->samples, 1, n, c->audio_file);
+      c->audio_bytes += (uint32)n;
+      SDL_AtomicSet(&c->audio_read, rd + 1);
+      did_work = true;
+    }
+    if (!did_work) {
+      if (c->quit)
+        return 0;
+      SDL_SemWaitTimeout(c->wakeup, 100);
+    }
+  }
+}
+
+void Capture_Start(const char *path, int audio_freq, int audio_channels) {
+  Capture *c = &g_capture;
+  char *name = StrFmt("%s.y4m", path);
+  c->video_file = fopen(name, "wb");
+  free(name);
+  if (audio_freq) {
+    name = StrFmt("%s.wav", path);
+    c->audio_file = fopen(name, "wb");
+    free(name);
+  }
+  if (!c->video_file || (audio_freq && !c->audio_file)) {
+    fprintf(stderr, "Unable to create the capture files %s\n", path);
+    goto fail;
+  }
+  if (c->audio_file) {
+    c->audio_freq = audio_freq;
+    c->audio_channels = audio_channels;
+    for (int i = 0; i < kCaptureAudioSlots; i++)
+      c->audio_slots[i].samples = (int16 *)ArenaAlloc("capture", kCaptureAudioSlotFrames * audio_channels * sizeof(int16));
+    Capture_WriteWavHeader(c);
+  }
+  c->wakeup = SDL_CreateSemaphore(0);
+  c->thread = c->wakeup ? SDL_CreateThread(&Capture_WriterThread, "capture", c) : NULL;
+  if (!c->thread) {
+    fprintf(stderr, "Unable to create the capture thread\n");
+    goto fail;
+  }
+  c->active = true;
+  return;
+fail:
+  if (c->wakeup)
+    SDL_DestroySemaphore(c->wakeup), c->wakeup = NULL;
+  if (c->video_file)
+    fclose(c->video_file), c->video_file = NULL;
+  if (c->audio_file)
+    fclose(c->audio_file), c->audio_file = NULL;
+}
+
+void Capture_PushVideo(const uint8 *pixels, int pitch, int width, int height, uint32 pixel_format) {
+  Capture *c = &g_capture;
+  if (!c->active)
+    return;
+  if (c->slot_size == 0) {
+    // The video size is fixed by the first frame
+    c->width = width, c->height = height;
+    c->slot_size = (size_t)width * height * 4;
+    c->video_slots = (uint8 *)ArenaAlloc("capture", c->slot_size * kCaptureVideoSlots);
+    c->yuv = (uint8 *)ArenaAlloc("capture", (size_t)width * height * 3);
+  }
+  uint32 wr = SDL_AtomicGet(&c->video_write);
+  if (wr - (uint32)SDL_AtomicGet(&c->video_read) >= kCaptureVideoSlots) {
+    c->frames_dropped++;
+    return;
+  }
+  size_t bpp = (pixel_format == kPpuRenderFlags_Rgb565 ? 2 : 4);
+  size_t row = (size_t)c->width * bpp;
+  uint8 *dst = c->video_slots + (wr % kCaptureVideoSlots) * c->slot_size;
+  c->slot_pixel_format[wr % kCaptureVideoSlots] = pixel_format;
+  if (width == c->width && height == c->height) {
+    if ((size_t)pitch == row) {
+      memcpy(dst, pixels, row * height);
+    } else {
+      for (int y = 0; y < height; y++)
+        memcpy(dst + row * y, pixels + (size_t)pitch * y, row);
+    }
+  } else {
+    // Frames of another size, like mode7 drawn at 4x or a widescreen toggle,
+    // are scaled to the video size so that the video stays in sync with the audio.
+    for (int y = 0; y < c->height; y++) {
+      const uint8 *src = pixels + (size_t)pitch * (y * height / c->height);
+      uint8 *d = dst + row * y;
+      for (int x = 0; x < c->width; x++) {
+        int sx = x * width / c->width;
+        if (bpp == 2)
+          ((uint16 *)d)[x] = ((const uint16 *)src)[sx];
+        else
+          ((uint32 *)d)[x] = ((const uint32 *)src)[sx];
+      }
+    }
+  }
+  SDL_AtomicSet(&c->video_write, wr + 1);
+  SDL_SemPost(c->wakeup);
+}
+
+void Capture_PushAudio(const int16 *samples, int num_frames) {
+  Capture *c = &g_capture;
+  if (!c->active || !c->audio_file)
+    return;
+  while (num_frames > 0) {
+    int n = IntMin(num_frames, kCaptureAudioSlotFrames);
+    uint32 wr = SDL_AtomicGet(&c->audio_write);
+    if (wr - (uint32)SDL_AtomicGet(&c->audio_read) >= kCaptureAudioSlots) {
+      c->audio_dropped++;
+      break;
+    }
+    CaptureAudioSlot *s = &c->audio_slots[wr % kCaptureAudioSlots];
+    memcpy(s->samples, samples, n * c->audio_channels * sizeof(int16));
+    s->num_frames = n;
+    SDL_AtomicSet(&c->audio_write, wr + 1);
+    samples += n * c->audio_channels;
+    num_frames -= n;
+  }
+  SDL_SemPost(c->wakeup);
+}
+
+void Capture_Stop() {
+  Capture *c = &g_capture;
+  if (!c->active)
+    return;
+  c->active = false;
+  // The writer drains both rings before it exits
+  c->quit = true;
+  SDL_SemPost(c->wakeup);
+  SDL_WaitThread(c->thread, NULL);
+  SDL_DestroySemaphore(c->wakeup);
+  c->thread = NULL;
+  c->wakeup = NULL;
+  if (c->audio_file) {
+    Capture_WriteWavHeader(c);
+    fclose(c->audio_file);
+    c->audio_file = NULL;
+  }
+  fclose(c->video_file);
+  c->video_file = NULL;
+  fprintf(stderr, "Capture: %d frames written, %d frames and %d audio blocks dropped\n",
+          c->frames_written, c->frames_dropped, c->audio_dropped);
+}
@@ -0,0 +1,17 @@
+#ifndef ZELDA3_CAPTURE_H_
+#define ZELDA3_CAPTURE_H_
+
+#include "types.h"
+
+// Records the presented frames to <path>.y4m and the audio to <path>.wav.
+// The game and audio threads only copy into preallocated slots, a writer
+// thread converts and writes them. Whatever doesn't fit while the writer
+// is behind is dropped and counted. The video size is set by the first
+// frame, and later frames of another size are scaled to it.
+void Capture_Start(const char *path, int audio_freq, int audio_channels);
+void Capture_Stop();
+void Capture_PushVideo(const uint8 *pixels, int pitch, int width, int height, uint32 pixel_format);
+// Called from the audio thread
+void Capture_PushAudio(const int16 *samples, int num_frames);
+
+#endif  // ZELDA3_CAPTURE_H_
@@ -59,6 +59,7 @@ static const KeyNameId kKeyNameId[] = {
   S(CheatLife), S(CheatKeys), S(CheatEquipment), S(CheatWalkThroughWalls),
   S(ClearKeyLog), S(StopReplay), S(Fullscreen), S(Reset),
   S(Pause), S(PauseDimmed), S(Turbo), S(ReplayTurbo), S(WindowBigger), S(WindowSmaller), S(VolumeUp), S(VolumeDown), S(DisplayPerf), S(ToggleRenderer),
+  S(CapturePpuFrame),
 };
 #undef S
 #undef M
@@ -366,6 +367,12 @@ static bool HandleIniConfig(int section, const char *key, char *value) {
       return ParseBool(value, &g_config.linear_filtering);
     } else if (StringEqualsNoCase(key, "NoSpriteLimits")) {
       return ParseBool(value, &g_config.no_sprite_limits);
+    } else if (StringEqualsNoCase(key, "BgLayerCache")) {
+      return ParseBool(value, &g_config.bg_layer_cache);
+    } else if (StringEqualsNoCase(key, "LineCache")) {
+      return ParseBool(value, &g_config.line_cache);
+    } else if (StringEqualsNoCase(key, "PipelinedRendering")) {
+      return ParseBool(value, &g_config.pipelined_rendering);
     } else if (StringEqualsNoCase(key, "LinkGraphics")) {
       g_config.link_graphics = value;
       return true;
@@ -374,6 +381,11 @@ static bool HandleIniConfig(int section, const char *key, char *value) {
       return true;
     } else if (StringEqualsNoCase(key, "DimFlashes")) {
       return ParseBoolBit(value, &g_config.features0, kFeatures0_DimFlashes);
+    } else if (StringEqualsNoCase(key, "VSync")) {
+      return ParseBool(value, &g_config.vsync);
+    } else if (StringEqualsNoCase(key, "RenderThreads")) {
+      g_config.render_threads = StringEqualsNoCase(value, "Auto") ? 0 : (uint8)strtol(value, (char**)NULL, 10);
+      return true;
     }
   } else if (section == 2) {
     if (StringEqualsNoCase(key, "EnableAudio")) {
@@ -405,6 +417,8 @@ static bool HandleIniConfig(int section, const char *key, char *value) {
       return true;
     } else if (StringEqualsNoCase(key, "ResumeMSU")) {
       return ParseBool(value, &g_config.resume_msu);
+    } else if (StringEqualsNoCase(key, "AudioPacing")) {
+      return ParseBool(value, &g_config.audio_pacing);
     }
   } else if (section == 3) {
     if (StringEqualsNoCase(key, "Autosave")) {
@@ -442,6 +456,26 @@ static bool HandleIniConfig(int section, const char *key, char *value) {
       return ParseBool(value, &g_config.display_perf_title);
     } else if (StringEqualsNoCase(key, "DisableFrameDelay")) {
       return ParseBool(value, &g_config.disable_frame_delay);
+    } else if (StringEqualsNoCase(key, "DungeonRoomCache")) {
+      g_config.dungeon_room_cache = (uint16)strtol(value, (char**)NULL, 10);
+      return true;
+    } else if (StringEqualsNoCase(key, "DungeonRoomCacheVerify")) {
+      return ParseBool(value, &g_config.dungeon_room_cache_verify);
+    } else if (StringEqualsNoCase(key, "OverworldScreenCache")) {
+      g_config.overworld_screen_cache = (uint16)strtol(value, (char**)NULL, 10);
+      return true;
+    } else if (StringEqualsNoCase(key, "AssetMemoryBudget")) {
+      g_config.asset_memory_budget = (uint32)strtoul(value, (char**)NULL, 10);
+      return true;
+    } else if (StringEqualsNoCase(key, "ReplayJournal")) {
+      g_config.replay_journal = (uint16)strtol(value, (char**)NULL, 10);
+      return true;
+    } else if (StringEqualsNoCase(key, "CpuTraceLength")) {
+      g_config.cpu_trace_length = (uint32)strtoul(value, (char**)NULL, 10);
+      return true;
+    } else if (StringEqualsNoCase(key, "CapturePath")) {
+      g_config.capture_path = *value ? value : NULL;
+      return true;
     } else if (StringEqualsNoCase(key, "Language")) {
       g_config.language = value;
       return true;
@@ -33,6 +33,7 @@ enum {
   kKeys_ToggleRenderer,
   kKeys_VolumeUp,
   kKeys_VolumeDown,
+  kKeys_CapturePpuFrame,
   kKeys_Total,
 };
 
@@ -61,11 +62,23 @@ typedef struct Config {
   uint8 extended_aspect_ratio;
   bool extend_y;
   bool no_sprite_limits;
+  bool bg_layer_cache;
+  bool line_cache;
+  bool pipelined_rendering;
   bool display_perf_title;
   uint8 enable_msu;
   bool resume_msu;
   bool disable_frame_delay;
+  bool vsync;
+  bool audio_pacing;
+  uint8 render_threads;
   uint8 msuvolume;
+  uint32 cpu_trace_length;
+  uint16 dungeon_room_cache;
+  bool dungeon_room_cache_verify;
+  uint16 overworld_screen_cache;
+  uint32 asset_memory_budget;
+  uint16 replay_journal;
   uint32 features0;
 
   const char *link_graphics;
@@ -73,6 +86,7 @@ typedef struct Config {
   const char *shader;
   const char *msu_path;
   const char *language;
+  const char *capture_path;
 } Config;
 
 enum {
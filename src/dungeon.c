@@ -2541,6 +2541,174 @@ void SavePalaceDeaths() {  // 80f9dd
     death_save_counter = 0;
 }
 
+// Drawing a room only reads and writes the ram in kRoomCacheSpans, the room's
+// save flags and the BG1/BG2 tilemaps, which RoomDraw_DrawFloors overwrites
+// completely. When the spans match a previous draw the result is copied back
+// instead of interpreting the object stream again.
+typedef struct RoomCacheSpan {
+  uint16 offs, size;
+} RoomCacheSpan;
+
+static const RoomCacheSpan kRoomCacheSpans[] = {
+  {0x10, 1},     // main_module_index
+  {0x2f, 1},     // link_direction_facing
+  {0x99, 2},     // CGWSEL_copy, CGADSUB_copy
+  {0xa0, 2},     // dungeon_room_index
+  {0xa7, 1},     // quadrant_fullsize_y
+  {0xad, 3},     // dung_hdr_collision_2, dung_hdr_tag
+  {0xb2, 10},    // dung_draw_width_indicator .. dung_load_ptr_offs
+  {0xbf, 33},    // dung_line_ptrs_row0
+  {0xfc, 2},     // dung_unk2
+  {0x3f4, 1},    // dung_unk6
+  {0x400, 4},    // dung_door_opened, dung_savegame_state_bits
+  {0x40e, 2},    // dung_layout_and_starting_quadrant
+  {0x414, 1},    // dung_hdr_bg2_properties
+  {0x41a, 6},    // dung_floor_move_flags .. moving_wall_var2
+  {0x428, 1},    // dung_hdr_collision_2_mirror
+  {0x42a, 32},   // moving_wall_var1 .. dung_some_stairs_unk4
+  {0x44e, 4},    // dung_num_toggle_floor, dung_num_toggle_palace
+  {0x453, 1},    // dung_blastwall_flag_y
+  {0x45a, 1},    // dung_num_lit_torches
+  {0x460, 2},    // dung_cur_door_idx
+  {0x468, 5},    // dung_flag_trapdoors_down .. dung_hdr_collision
+  {0x470, 4},    // watergate_var1, watergate_pos
+  {0x478, 2},    // dung_index_of_torches_start
+  {0x47c, 10},   // word_7E047C .. dung_num_wall_downnorth_spiral_stairs_2
+  {0x490, 2},    // dung_floor_1_filler_tiles
+  {0x496, 10},   // dung_num_chests_x2 .. dung_num_stairs_wet
+  {0x4a2, 8},    // dung_num_inter_room_*_straight_stairs
+  {0x4ae, 2},    // dung_num_inroom_upsouth_stairs_water
+  {0x500, 0xe0}, // dung_replacement_tile_state .. replacement_tilemap_LR
+  {0x62c, 4},    // dung_loade_bgoffs_h_copy, dung_loade_bgoffs_v_copy
+  {0x680, 14},   // water_hdma_var0 .. dung_door_opened_incl_adjacent
+  {0x6a0, 0x60}, // star_shaped_switches_tile .. dung_stairs_table_2
+  {0x1980, 0x80},// door_type_and_slot .. dung_exit_door_addresses
+  {0xc880, 0x80},// moving_wall_arr1
+  {0xf0ca, 2},   // save_dung_info[101]
+  {0xf3ca, 1},   // savegame_is_darkworld
+  {0xf940, 0x18c}, // movable_block_datas
+  {0xfb40, 0x120}, // dung_torch_data
+};
+
+typedef struct RoomCacheEntry {
+  uint32 last_used;
+  uint8 *state_before;  // save_dung_info[dungeon_room_index] followed by the spans
+  uint8 *state_after;   // the spans followed by the tilemaps
+} RoomCacheEntry;
+
+static RoomCacheEntry *g_room_cache;
+static uint8 *g_room_cache_key;
+static int g_room_cache_entries;
+static uint32 g_room_cache_state_size, g_room_cache_counter;
+// When verifying, a cache hit still draws the room, and the resulting ram must
+// match g_room_cache_expected, the ram from before with the cached room applied.
+static uint8 *g_room_cache_expected;
+static bool g_room_cache_verify_pending;
+
+void Dungeon_SetRoomCacheSize(int entries, bool verify) {
+  for (int i = 0; i < g_room_cache_entries; i++)
+    free(g_room_cache[i].state_before);
+  free(g_room_cache);
+  free(g_room_cache_key);
+  free(g_room_cache_expected);
+  g_room_cache = NULL;
+  g_room_cache_key = NULL;
+  g_room_cache_expected = NULL;
+  g_room_cache_entries = 0;
+  g_room_cache_verify_pending = false;
+  if (entries <= 0)
+    return;
+  uint32 size = 0;
+  for (int i = 0; i < countof(kRoomCacheSpans); i++)
+    size += kRoomCacheSpans[i].size;
+  g_room_cache_state_size = size;
+  g_room_cache = (RoomCacheEntry *)calloc(entries, sizeof(RoomCacheEntry));
+  g_room_cache_key = (uint8 *)malloc(size + 2);
+  g_room_cache_expected = verify ? (uint8 *)malloc(sizeof(g_ram)) : NULL;
+  if (!g_room_cache || !g_room_cache_key || (verify && !g_room_cache_expected)) {
+    fprintf(stderr, "Unable to allocate the dungeon room cache\n");
+    Dungeon_SetRoomCacheSize(0, false);
+    return;
+  }
+  g_room_cache_entries = entries;
+}
+
+static void RoomCache_GatherSpans(uint8 *dst) {
+  for (int i = 0; i < countof(kRoomCacheSpans); i++) {
+    memcpy(dst, g_ram + kRoomCacheSpans[i].offs, kRoomCacheSpans[i].size);
+    dst += kRoomCacheSpans[i].size;
+  }
+}
+
+static void RoomCache_ScatterSpans(uint8 *ram, const uint8 *src) {
+  for (int i = 0; i < countof(kRoomCacheSpans); i++) {
+    memcpy(ram + kRoomCacheSpans[i].offs, src, kRoomCacheSpans[i].size);
+    src += kRoomCacheSpans[i].size;
+  }
+  memcpy(ram + 0x2000, src, 0x4000);  // dung_bg2 and dung_bg1
+}
+
+// Captures the state the room drawing depends on and restores the drawn room
+// if it's in the cache.
+static bool RoomCache_Load() {
+  uint8 *key = g_room_cache_key;
+  memcpy(key, (uint8 *)save_dung_info + dungeon_room_index * 2, 2);
+  RoomCache_GatherSpans(key + 2);
+  for (int i = 0; i < g_room_cache_entries; i++) {
+    RoomCacheEntry *e = &g_room_cache[i];
+    if (e->state_before && memcmp(e->state_before, key, g_room_cache_state_size + 2) == 0) {
+      e->last_used = ++g_room_cache_counter;
+      if (g_room_cache_expected) {
+        memcpy(g_room_cache_expected, g_ram, sizeof(g_ram));
+        RoomCache_ScatterSpans(g_room_cache_expected, e->state_after);
+        g_room_cache_verify_pending = true;
+        return false;
+      }
+      RoomCache_ScatterSpans(g_ram, e->state_after);
+      return true;
+    }
+  }
+  return false;
+}
+
+// Called after drawing a cache hit for real, reports where the ram differs from
+// what the cache restored, which means kRoomCacheSpans is missing something.
+static void RoomCache_Verify() {
+  g_room_cache_verify_pending = false;
+  if (memcmp(g_room_cache_expected, g_ram, sizeof(g_ram)) == 0)
+    return;
+  fprintf(stderr, "Room cache compare failed for room 0x%x (drawn != cached):\n", dungeon_room_index);
+  int j = 0;
+  for (size_t i = 0; i < sizeof(g_ram); i++) {
+    if (g_ram[i] != g_room_cache_expected[i] && ++j < 128)
+      fprintf(stderr, "0x%.6X: %.2X != %.2X\n", (int)i, g_ram[i], g_room_cache_expected[i]);
+  }
+  fprintf(stderr, "  total of %d failed bytes\n", j);
+}
+
+// Called after drawing a room that wasn't cached, replaces the least recently used entry.
+static void RoomCache_Store() {
+  if (g_room_cache_verify_pending) {
+    RoomCache_Verify();
+    return;
+  }
+  RoomCacheEntry *e = &g_room_cache[0];
+  for (int i = 1; i < g_room_cache_entries && e->state_before; i++) {
+    if (!g_room_cache[i].state_before || g_room_cache[i].last_used < e->last_used)
+      e = &g_room_cache[i];
+  }
+  if (!e->state_before) {
+    e->state_before = (uint8 *)malloc(g_room_cache_state_size * 2 + 2 + 0x4000);
+    if (!e->state_before)
+      return;
+    e->state_after = e->state_before + g_room_cache_state_size + 2;
+  }
+  e->last_used = ++g_room_cache_counter;
+  memcpy(e->state_before, g_room_cache_key, g_room_cache_state_size + 2);
+  RoomCache_GatherSpans(e->state_after);
+  memcpy(e->state_after + g_room_cache_state_size, dung_bg2, 0x4000);
+}
+
 void Dungeon_LoadRoom() {  // 81873a
   Dungeon_LoadHeader();
   dung_unk6 = 0;
@@ -2606,6 +2774,9 @@ void Dungeon_LoadRoom() {  // 81873a
     dung_object_tilemap_pos[i] = 0;
   }
 
+  if (g_room_cache_entries && RoomCache_Load())
+    return;
+
   const uint8 *cur_p0 = GetDungeonRoomLayout(dungeon_room_index);
   dung_load_ptr_offs = 0;
   RoomDraw_DrawFloors(cur_p0);
@@ -2659,6 +2830,9 @@ void Dungeon_LoadRoom() {  // 81873a
   } while (i != 0x120);
 
   dung_load_ptr_offs = 0x120;
+
+  if (g_room_cache_entries)
+    RoomCache_Store();
 }
 
 void RoomDraw_DrawAllObjects(const uint8 *level_data) {  // 8188e4
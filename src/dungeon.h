@@ -90,6 +90,7 @@ void OrientLampLightCone();
 void PrepareDungeonExitFromBossFight();
 void SavePalaceDeaths();
 void Dungeon_LoadRoom();
+void Dungeon_SetRoomCacheSize(int entries, bool verify);
 void RoomDraw_DrawAllObjects(const uint8 *level_data);
 void RoomData_DrawObject_Door(uint16 a);
 void RoomData_DrawObject(uint16 r0, const uint8 *level_data);
@@ -0,0 +1,143 @@
+#include "golden_frames.h"
+#include "zelda_rtl.h"
+#include "snes/ppu.h"
+#include "util.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+enum {
+  // Number of frames that share one line in the golden file
+  kGoldenSegmentFrames = 256,
+  kGoldenMaxWidth = kPpuXPixels * 4,
+  kGoldenMaxHeight = 240 * 4,
+};
+
+typedef struct GoldenConfig {
+  const char *name;
+  uint32 render_flags;
+  bool widescreen;
+} GoldenConfig;
+
+static const GoldenConfig kGoldenConfigs[] = {
+  { "old", 0, false },
+  { "new", kPpuRenderFlags_NewRenderer, false },
+  { "new-mode7x4", kPpuRenderFlags_NewRenderer | kPpuRenderFlags_4x4Mode7, false },
+  { "new-height240", kPpuRenderFlags_NewRenderer | kPpuRenderFlags_Height240, false },
+  { "new-widescreen", kPpuRenderFlags_NewRenderer, true },
+  { "new-nospritelimits", kPpuRenderFlags_NewRenderer | kPpuRenderFlags_NoSpriteLimits, false },
+  { "new-bglayercache", kPpuRenderFlags_NewRenderer | kPpuRenderFlags_BgLayerCache, false },
+  { "new-linecache", kPpuRenderFlags_NewRenderer | kPpuRenderFlags_LineCache, false },
+};
+
+// Writes an Xrgb8888 image as a 24-bit BMP
+static void GoldenFrames_WriteBmp(const char *filename, const uint8 *pixels, size_t pitch, int width, int height) {
+  FILE *f = fopen(filename, "wb");
+  if (!f) {
+    fprintf(stderr, "Unable to write %s\n", filename);
+    return;
+  }
+  int row_size = (width * 3 + 3) & ~3;
+  uint8 hdr[54] = { 'B', 'M' };
+  DWORD(hdr[2]) = 54 + row_size * height;
+  DWORD(hdr[10]) = 54;
+  DWORD(hdr[14]) = 40;
+  DWORD(hdr[18]) = width;
+  DWORD(hdr[22]) = height;
+  WORD(hdr[26]) = 1;
+  WORD(hdr[28]) = 24;
+  fwrite(hdr, 1, sizeof(hdr), f);
+  uint8 *row = (uint8 *)calloc(row_size, 1);
+  for (int y = height - 1; y >= 0; y--) {
+    const uint32 *src = (const uint32 *)(pixels + pitch * y);
+    for (int x = 0; x < width; x++)
+      row[x * 3 + 0] = src[x], row[x * 3 + 1] = src[x] >> 8, row[x * 3 + 2] = src[x] >> 16;
+    fwrite(row, 1, row_size, f);
+  }
+  free(row);
+  fclose(f);
+}
+
+int GoldenFrames_Run(const char *golden_path) {
+  FILE *golden = fopen(golden_path, "r");
+  bool recording = (golden == NULL);
+  FILE *out = recording ? fopen(golden_path, "w") : NULL;
+  if (recording && !out) {
+    fprintf(stderr, "Unable to create %s\n", golden_path);
+    return 1;
+  }
+  size_t pitch = kGoldenMaxWidth * 4;
+  uint8 *pixels = (uint8 *)malloc(pitch * kGoldenMaxHeight);
+  Ppu *ppu = g_zenv.ppu;
+  uint8 saved_extra = ppu->extraLeftRight;
+  int mismatches = 0, missing = 0;
+  char line[128], expected[128];
+
+  for (int chapter = 0; ZeldaGetReferenceSaveName(chapter) != NULL; chapter++) {
+    for (int ci = 0; ci < countof(kGoldenConfigs); ci++) {
+      const GoldenConfig *gc = &kGoldenConfigs[ci];
+      ppu->extraLeftRight = gc->widescreen ? kPpuExtraLeftRight : 0;
+      SaveLoadSlot(kSaveLoad_Replay, 256 + chapter);
+      bool dumped = false;
+      uint64 hash = 0;
+      int frame = 0, segment_start = 0;
+      for (;;) {
+        bool is_replay = ZeldaRunFrame(0);
+        if (is_replay) {
+          int scale = PpuGetCurrentRenderScale(ppu, gc->render_flags);
+          int width = (256 + ppu->extraLeftRight * 2) * scale;
+          int height = (gc->render_flags & kPpuRenderFlags_Height240 ? 240 : 224) * scale;
+          ZeldaDrawPpuFrame(pixels, pitch, gc->render_flags | kPpuRenderFlags_Xrgb8888);
+          uint32 crc = scale;
+          for (int y = 0; y < height; y++)
+            crc = crc * 0x01000193 ^ Crc32(pixels + pitch * y, width * 4);
+          hash = (hash ^ crc) * 0x100000001b3ull;
+          frame++;
+          if (frame - segment_start < kGoldenSegmentFrames)
+            continue;
+        }
+        if (frame != segment_start) {
+          snprintf(line, sizeof(line), "%d %s %d %d %016llx\n", chapter + 1, gc->name,
+                   segment_start, frame - segment_start, (unsigned long long)hash);
+          if (recording) {
+            fputs(line, out);
+          } else if (!fgets(expected, sizeof(expected), golden) || strcmp(line, expected) != 0) {
+            if (mismatches++ < 20)
+              fprintf(stderr, "Chapter %d, %s: frames %d-%d differ\n", chapter + 1, gc->name, segment_start, frame - 1);
+            // The buffer still holds the last frame of the segment
+            if (!dumped) {
+              int scale = PpuGetCurrentRenderScale(ppu, gc->render_flags);
+              char *name = StrFmt("%s.%d.%s.%d.bmp", golden_path, chapter + 1, gc->name, frame - 1);
+              GoldenFrames_WriteBmp(name, pixels, pitch, (256 + ppu->extraLeftRight * 2) * scale,
+                                    (gc->render_flags & kPpuRenderFlags_Height240 ? 240 : 224) * scale);
+              free(name);
+              dumped = true;
+            }
+          }
+          segment_start = frame;
+          hash = 0;
+        }
+        if (!is_replay)
+          break;
+      }
+      if (frame == 0) {
+        fprintf(stderr, "Unable to replay saves/ref/%s\n", ZeldaGetReferenceSaveName(chapter));
+        missing++;
+        break;
+      }
+      printf("Chapter %d, %s: %d frames\n", chapter + 1, gc->name, frame);
+    }
+  }
+  ppu->extraLeftRight = saved_extra;
+  free(pixels);
+  if (recording) {
+    fclose(out);
+    printf("Wrote golden frame hashes to %s\n", golden_path);
+    return missing != 0;
+  }
+  if (!mismatches && fgets(expected, sizeof(expected), golden))
+    fprintf(stderr, "%s has more frames than were replayed\n", golden_path), mismatches++;
+  fclose(golden);
+  printf("%d mismatching segments, %d missing reference saves\n", mismatches, missing);
+  return mismatches != 0 || missing != 0;
+}
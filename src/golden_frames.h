@@ -0,0 +1,10 @@
+#ifndef ZELDA3_GOLDEN_FRAMES_H_
+#define ZELDA3_GOLDEN_FRAMES_H_
+
+// Replays every reference save in saves/ref without a window, once per
+// renderer configuration, and hashes each drawn frame. The hashes are
+// compared against |golden_path|, or written to it if it doesn't exist yet.
+// Returns the process exit code.
+int GoldenFrames_Run(const char *golden_path);
+
+#endif  // ZELDA3_GOLDEN_FRAMES_H_
@@ -24,8 +24,14 @@
 #include "config.h"
 #include "assets.h"
 #include "load_gfx.h"
+#include "dungeon.h"
+#include "overworld.h"
 #include "util.h"
+#include "arena.h"
 #include "audio.h"
+#include "capture.h"
+#include "golden_frames.h"
+#include "ppu_bench.h"
 
 #include <pspkernel.h>
 #include <psppower.h>
@@ -33,7 +39,7 @@
 
 // --- PSP Module Info ---
 PSP_MODULE_INFO("Zelda_3_PSP", 0, 1, 0); // Changed name slightly, version 1.0
-PSP_HEAP_SIZE_KB(-1024); // Example: Request memory leaving 1MB for kernel/drivers. Adjust as needed.
+PSP_HEAP_SIZE_KB(-1024); // Request memory leaving 1MB for kernel/drivers. The memory budget printed at startup shows what is used.
 PSP_MAIN_THREAD_ATTR(THREAD_ATTR_USER | THREAD_ATTR_VFPU); // Enable VFPU for the main thread if needed
 PSP_MAIN_THREAD_STACK_SIZE_KB(512); // Increase stack size if needed (default is 64KB)
 
@@ -69,10 +75,23 @@ void pspFpuSetEnableStandalone(uint32_t enable)
 
 static bool g_run_without_emu = 1;
 
+// Wall time of the startup phases, printed at the first frame with --startup-profile
+typedef struct StartupPhase {
+  const char *name;
+  uint64 start, end;
+} StartupPhase;
+static struct {
+  bool enabled;
+  int num_phases;
+  uint64 t0;
+  StartupPhase phases[16];
+  SDL_SpinLock lock;
+} g_startup;
+
 // Forwards
 static bool LoadRom(const char *filename);
 static void LoadLinkGraphics();
-static void RenderNumber(uint8 *dst, size_t pitch, int n, bool big);
+static void RenderNumber(uint8 *dst, size_t pitch, int n, bool big, uint32 pixel_format);
 static void HandleInput(int keyCode, int modCode, bool pressed);
 static void HandleCommand(uint32 j, bool pressed);
 static int RemapSdlButton(int button);
@@ -81,6 +100,7 @@ static void HandleGamepadAxisInput(int gamepad_id, int axis, int value);
 static void OpenOneGamepad(int i);
 static void HandleVolumeAdjustment(int volume_adjustment);
 static void LoadAssets();
+static void EvictUnusedAssets();
 static void SwitchDirectory();
 
 enum {
@@ -100,6 +120,8 @@ static uint8 g_current_window_scale;
 static uint8 g_gamepad_buttons;
 static int g_input1_state;
 static bool g_display_perf;
+// Write the next drawn frame to a file for --ppu-bench
+static bool g_capture_ppu_frame;
 static int g_curr_fps;
 static int g_ppu_render_flags = 0;
 static int g_snes_width, g_snes_height;
@@ -184,31 +206,140 @@ static SDL_HitTestResult HitTestCallback(SDL_Window *win, const SDL_Point *pt, v
   return SDL_HITTEST_NORMAL;
 }
 
+// The audio callback renders one emulated frame worth of samples per block, so
+// the audio device is used as the clock that paces the main loop. The main loop
+// sleeps until the callback has consumed enough frames. When vsync also paces
+// the main loop, the resampling ratio is adjusted by at most kMaxRateAdjust to
+// keep the number of queued frames at the target.
+#define kMaxRateAdjust 0.005f
+
+typedef struct FramePacing {
+  bool enabled;
+  bool rate_control;
+  // Frames emulated but not yet rendered by the audio callback
+  int queued;
+  int target;
+  int underruns;
+  float fill_avg;
+  float rate;
+  float sample_frac;
+  SDL_sem *sem;
+  // Frame time statistics, in seconds
+  uint64 last_frame;
+  float frame_time[64], frame_time_sum, frame_time_max;
+  int frame_time_pos;
+} FramePacing;
+static FramePacing g_pacing;
+
+static void RecordDrawTime(uint64 ticks) {
+  static float history[64], average;
+  static int history_pos;
+  float v = (double)SDL_GetPerformanceFrequency() / ticks;
+  average += v - history[history_pos];
+  history[history_pos] = v;
+  history_pos = (history_pos + 1) & 63;
+  g_curr_fps = average * (1.0f / 64);
+}
+
+// Captures, draws the perf numbers and presents a frame that |ppu| drew into |pixel_buffer|.
+// With |redrawn|, the rows copied by the line cache are not the same as in the last frame.
+static void FinishPpuFrame(Ppu *ppu, uint8 *pixel_buffer, int pitch, uint32 render_flags, int render_scale, bool redrawn) {
+  uint32 pixel_format = render_flags & kPpuRenderFlags_PixelFormatMask;
+  if (g_config.capture_path)
+    Capture_PushVideo(pixel_buffer, pitch, g_snes_width * render_scale, g_snes_height * render_scale, pixel_format);
+  if (g_display_perf) {
+    bool big = (render_scale == 4);
+    RenderNumber(pixel_buffer + pitch * render_scale, pitch, g_curr_fps, big, pixel_format);
+    // Frame time in 1/10 ms and queued audio frames in 1/10 frames
+    RenderNumber(pixel_buffer + pitch * (render_scale + (12 << big)), pitch,
+                 (int)(g_pacing.frame_time_sum * (10000.0f / 64)), big, pixel_format);
+    if (g_pacing.enabled)
+      RenderNumber(pixel_buffer + pitch * (render_scale + (24 << big)), pitch,
+                   (int)(g_pacing.fill_avg * 10), big, pixel_format);
+    // Lines copied from the last frame, and lines drawn
+    if (render_flags & kPpuRenderFlags_LineCache) {
+      RenderNumber(pixel_buffer + pitch * (render_scale + (36 << big)), pitch, ppu->lineCacheHits, big, pixel_format);
+      RenderNumber(pixel_buffer + pitch * (render_scale + (48 << big)), pitch, ppu->lineCacheMisses, big, pixel_format);
+    }
+  }
+
+  // Lines copied by the line cache are the same as in the last frame that |ppu|
+  // drew, which is only what was uploaded last if the same ppu drew that frame
+  // with the same flags and size. The perf numbers also change the lines they
+  // were drawn over in this frame or the last one.
+  static bool last_display_perf;
+  static Ppu *last_ppu;
+  static uint32 last_render_flags;
+  static int last_height, last_render_scale;
+  RendererRowSpan spans[120];
+  int num_spans = -1;
+  if (render_scale == 1 && (render_flags & kPpuRenderFlags_LineCache) && !g_display_perf && !last_display_perf && !redrawn &&
+      ppu == last_ppu && render_flags == last_render_flags && g_snes_height == last_height &&
+      render_scale == last_render_scale) {
+    num_spans = 0;
+    for (int y = 0; y < g_snes_height; y++) {
+      if (PpuIsRowCopied(ppu, y))
+        continue;
+      if (num_spans && spans[num_spans - 1].first + spans[num_spans - 1].count == y)
+        spans[num_spans - 1].count++;
+      else
+        spans[num_spans].first = y, spans[num_spans].count = 1, num_spans++;
+    }
+  }
+  last_display_perf = g_display_perf;
+  last_ppu = ppu;
+  last_render_flags = render_flags;
+  last_height = g_snes_height;
+  last_render_scale = render_scale;
+  g_renderer_funcs.EndDraw(spans, num_spans);
+}
+
+static void SavePpuPacket(const ZeldaPpuPacket *packet) {
+  char name[64];
+  for (int i = 1; ; i++) {
+    snprintf(name, sizeof(name), "saves/ppuframe%d.bin", i);
+    FILE *f = fopen(name, "rb");
+    if (!f)
+      break;
+    fclose(f);
+  }
+  if (ZeldaPpuPacket_Save(packet, name))
+    printf("Saved the ppu frame to %s\n", name);
+  else
+    fprintf(stderr, "Unable to write %s\n", name);
+}
+
 static void DrawPpuFrameWithPerf() {
   int render_scale = PpuGetCurrentRenderScale(g_zenv.ppu, g_ppu_render_flags);
   uint8 *pixel_buffer = 0;
   int pitch = 0;
+  uint32 pixel_format = kPpuRenderFlags_Xrgb8888;
 
   g_renderer_funcs.BeginDraw(g_snes_width * render_scale,
                              g_snes_height * render_scale,
-                             &pixel_buffer, &pitch);
-  if (g_display_perf || g_config.display_perf_title) {
-    static float history[64], average;
-    static int history_pos;
+                             &pixel_buffer, &pitch, &pixel_format);
+  uint32 render_flags = g_ppu_render_flags | pixel_format;
+  if (g_capture_ppu_frame) {
+    // Drawing the packet leaves the ppu the same as ZeldaDrawPpuFrame
+    static ZeldaPpuPacket *packet;
+    if (!packet)
+      packet = ZeldaPpuPacket_Create();
+    g_capture_ppu_frame = false;
+    if (ZeldaCapturePpuFrame(packet, render_flags)) {
+      ZeldaDrawPpuPacket(g_zenv.ppu, packet, pixel_buffer, pitch, render_flags);
+      SavePpuPacket(packet);
+    } else {
+      fprintf(stderr, "Too many ppu writes to capture the frame\n");
+      ZeldaDrawPpuFrame(pixel_buffer, pitch, render_flags);
+    }
+  } else if (g_display_perf || g_config.display_perf_title) {
     uint64 before = SDL_GetPerformanceCounter();
-    ZeldaDrawPpuFrame(pixel_buffer, pitch, g_ppu_render_flags);
-    uint64 after = SDL_GetPerformanceCounter();
-    float v = (double)SDL_GetPerformanceFrequency() / (after - before);
-    average += v - history[history_pos];
-    history[history_pos] = v;
-    history_pos = (history_pos + 1) & 63;
-    g_curr_fps = average * (1.0f / 64);
+    ZeldaDrawPpuFrame(pixel_buffer, pitch, render_flags);
+    RecordDrawTime(SDL_GetPerformanceCounter() - before);
   } else {
-    ZeldaDrawPpuFrame(pixel_buffer, pitch, g_ppu_render_flags);
+    ZeldaDrawPpuFrame(pixel_buffer, pitch, render_flags);
   }
-  if (g_display_perf)
-    RenderNumber(pixel_buffer + pitch * render_scale, pitch, g_curr_fps, render_scale == 4);
-  g_renderer_funcs.EndDraw();
+  FinishPpuFrame(g_zenv.ppu, pixel_buffer, pitch, render_flags, render_scale, false);
 }
 
 static SDL_mutex *g_audio_mutex;
@@ -216,21 +347,76 @@ static uint8 *g_audiobuffer, *g_audiobuffer_cur, *g_audiobuffer_end;
 static int g_frames_per_block;
 static uint8 g_audio_channels;
 
+// Called with the audio mutex held once per audio block.
+static int FramePacing_NextBlockSize() {
+  FramePacing *p = &g_pacing;
+  if (!p->enabled)
+    return g_frames_per_block;
+  if (p->queued > 0)
+    p->queued--;
+  else
+    p->underruns++;
+  p->fill_avg += (p->queued - p->fill_avg) * (1.0f / 16);
+  if (p->rate_control) {
+    float err = (p->fill_avg - p->target) / p->target;
+    err = err < -1.0f ? -1.0f : err > 1.0f ? 1.0f : err;
+    // More queued frames than wanted means fewer samples per block
+    p->rate = 1.0f - kMaxRateAdjust * err;
+  }
+  p->sample_frac += g_frames_per_block * p->rate;
+  int n = (int)p->sample_frac;
+  p->sample_frac -= n;
+  SDL_SemPost(p->sem);
+  return n;
+}
+
+// Called with the audio mutex held after a frame was emulated.
+static void FramePacing_FrameQueued() {
+  if (g_pacing.queued < 16)
+    g_pacing.queued++;
+}
+
+// Sleep until the audio device has room for another frame.
+static void FramePacing_WaitForAudio() {
+  FramePacing *p = &g_pacing;
+  int max_queued = p->rate_control ? p->target * 2 : p->target;
+  for (;;) {
+    SDL_LockMutex(g_audio_mutex);
+    bool full = p->queued >= max_queued;
+    SDL_UnlockMutex(g_audio_mutex);
+    // Don't hang if the audio device stopped pulling samples.
+    if (!full || SDL_SemWaitTimeout(p->sem, 100) == SDL_MUTEX_TIMEDOUT)
+      break;
+  }
+}
+
+static void FramePacing_RecordFrameTime() {
+  FramePacing *p = &g_pacing;
+  uint64 now = SDL_GetPerformanceCounter();
+  if (p->last_frame != 0) {
+    float v = (float)((double)(now - p->last_frame) / SDL_GetPerformanceFrequency());
+    p->frame_time_sum += v - p->frame_time[p->frame_time_pos];
+    p->frame_time[p->frame_time_pos] = v;
+    p->frame_time_pos = (p->frame_time_pos + 1) & 63;
+    // Decay the max slowly so a single hitch stays visible for a while
+    p->frame_time_max = (v > p->frame_time_max) ? v : p->frame_time_max * 0.99f;
+  }
+  p->last_frame = now;
+}
+
 static void SDLCALL AudioCallback(void *userdata, Uint8 *stream, int len) {
   if (SDL_LockMutex(g_audio_mutex)) Die("Mutex lock failed!");
   while (len != 0) {
     if (g_audiobuffer_end - g_audiobuffer_cur == 0) {
-      ZeldaRenderAudio((int16*)g_audiobuffer, g_frames_per_block, g_audio_channels);
+      int samples = FramePacing_NextBlockSize();
+      ZeldaRenderAudio((int16*)g_audiobuffer, samples, g_audio_channels);
+      if (g_config.capture_path)
+        Capture_PushAudio((int16*)g_audiobuffer, samples);
       g_audiobuffer_cur = g_audiobuffer;
-      g_audiobuffer_end = g_audiobuffer + g_frames_per_block * g_audio_channels * sizeof(int16);
+      g_audiobuffer_end = g_audiobuffer + samples * g_audio_channels * sizeof(int16);
     }
     int n = IntMin(len, g_audiobuffer_end - g_audiobuffer_cur);
-    if (g_sdl_audio_mixer_volume == SDL_MIX_MAXVOLUME) {
-      memcpy(stream, g_audiobuffer_cur, n);
-    } else {
-      SDL_memset(stream, 0, n);
-      SDL_MixAudioFormat(stream, g_audiobuffer_cur, AUDIO_S16, n, g_sdl_audio_mixer_volume);
-    }
+    memcpy(stream, g_audiobuffer_cur, n);
     g_audiobuffer_cur += n;
     stream += n;
     len -= n;
@@ -240,6 +426,185 @@ static void SDLCALL AudioCallback(void *userdata, Uint8 *stream, int len) {
   SDL_UnlockMutex(g_audio_mutex);
 }
 
+// Helper threads that split up the enhanced mode7 drawing of a frame
+enum { kMaxRenderThreads = 16 };
+typedef struct RenderWorkers {
+  int num_threads;
+  bool quit;
+  SDL_Thread *threads[kMaxRenderThreads];
+  SDL_sem *start, *done;
+  SDL_atomic_t next;
+  void (*func)(void *ctx, int i);
+  void *ctx;
+  int count;
+} RenderWorkers;
+static RenderWorkers g_render_workers;
+
+static void RenderWorkers_RunJobs(RenderWorkers *rw) {
+  int i;
+  while ((i = SDL_AtomicAdd(&rw->next, 1)) < rw->count)
+    rw->func(rw->ctx, i);
+}
+
+static int SDLCALL RenderWorkers_Thread(void *data) {
+  RenderWorkers *rw = (RenderWorkers *)data;
+  for (;;) {
+    SDL_SemWait(rw->start);
+    if (rw->quit)
+      return 0;
+    RenderWorkers_RunJobs(rw);
+    SDL_SemPost(rw->done);
+  }
+}
+
+static void RenderWorkers_ParallelFor(void (*func)(void *ctx, int i), void *ctx, int n) {
+  RenderWorkers *rw = &g_render_workers;
+  rw->func = func;
+  rw->ctx = ctx;
+  rw->count = n;
+  SDL_AtomicSet(&rw->next, 0);
+  for (int i = 0; i < rw->num_threads; i++)
+    SDL_SemPost(rw->start);
+  RenderWorkers_RunJobs(rw);
+  for (int i = 0; i < rw->num_threads; i++)
+    SDL_SemWait(rw->done);
+}
+
+static void RenderWorkers_Init(int num_threads) {
+  RenderWorkers *rw = &g_render_workers;
+  rw->start = SDL_CreateSemaphore(0);
+  rw->done = SDL_CreateSemaphore(0);
+  if (!rw->start || !rw->done) Die("No semaphore");
+  for (int i = 0; i < IntMin(num_threads, kMaxRenderThreads); i++) {
+    rw->threads[i] = SDL_CreateThread(&RenderWorkers_Thread, "render", rw);
+    if (!rw->threads[i])
+      break;
+    rw->num_threads++;
+  }
+}
+
+static void RenderWorkers_Destroy() {
+  RenderWorkers *rw = &g_render_workers;
+  rw->quit = true;
+  for (int i = 0; i < rw->num_threads; i++)
+    SDL_SemPost(rw->start);
+  for (int i = 0; i < rw->num_threads; i++)
+    SDL_WaitThread(rw->threads[i], NULL);
+  if (rw->start) SDL_DestroySemaphore(rw->start);
+  if (rw->done) SDL_DestroySemaphore(rw->done);
+}
+
+// Draws frame N on a thread while the game runs frame N+1. The frame is captured
+// where it would have been drawn, so the game sees the same state as without it.
+typedef struct RenderPipeline {
+  SDL_Thread *thread;
+  SDL_sem *start, *done;
+  bool quit, busy;
+  Ppu *ppu;
+  ZeldaPpuPacket *packet;
+  uint8 *pixels;
+  size_t pixels_size;
+  int pitch, render_scale;
+  uint32 render_flags;
+  uint64 draw_time;
+} RenderPipeline;
+static RenderPipeline g_render_pipeline;
+
+static int SDLCALL RenderPipeline_Thread(void *data) {
+  RenderPipeline *rp = (RenderPipeline *)data;
+  for (;;) {
+    SDL_SemWait(rp->start);
+    if (rp->quit)
+      return 0;
+    uint64 before = SDL_GetPerformanceCounter();
+    ZeldaDrawPpuPacket(rp->ppu, rp->packet, rp->pixels, rp->pitch, rp->render_flags);
+    rp->draw_time = SDL_GetPerformanceCounter() - before;
+    SDL_SemPost(rp->done);
+  }
+}
+
+static void RenderPipeline_Init() {
+  RenderPipeline *rp = &g_render_pipeline;
+  rp->ppu = ppu_init(NULL);
+  ppu_reset(rp->ppu);
+  if (g_render_workers.num_threads)
+    PpuSetParallelFor(rp->ppu, &RenderWorkers_ParallelFor);
+  rp->packet = ZeldaPpuPacket_Create();
+  rp->render_flags = kPpuRenderFlags_Xrgb8888;
+  rp->start = SDL_CreateSemaphore(0);
+  rp->done = SDL_CreateSemaphore(0);
+  if (!rp->start || !rp->done) Die("No semaphore");
+  rp->thread = SDL_CreateThread(&RenderPipeline_Thread, "render pipeline", rp);
+}
+
+// Presents the frame that the thread is drawing
+static void RenderPipeline_Present() {
+  RenderPipeline *rp = &g_render_pipeline;
+  if (!rp->busy)
+    return;
+  SDL_SemWait(rp->done);
+  rp->busy = false;
+  if (g_display_perf || g_config.display_perf_title)
+    RecordDrawTime(rp->draw_time);
+
+  int width = g_snes_width * rp->render_scale, height = g_snes_height * rp->render_scale;
+  uint8 *pixel_buffer = 0;
+  int pitch = 0;
+  uint32 pixel_format = kPpuRenderFlags_Xrgb8888;
+  g_renderer_funcs.BeginDraw(width, height, &pixel_buffer, &pitch, &pixel_format);
+  bool redrawn = pixel_format != (rp->render_flags & kPpuRenderFlags_PixelFormatMask);
+  if (redrawn) {
+    // The renderer's format is only known after the first BeginDraw, so draw that frame again.
+    rp->render_flags = (rp->render_flags & ~kPpuRenderFlags_PixelFormatMask) | pixel_format;
+    ZeldaDrawPpuPacket(rp->ppu, rp->packet, pixel_buffer, pitch, rp->render_flags);
+  } else {
+    size_t row = (size_t)width * (pixel_format == kPpuRenderFlags_Rgb565 ? 2 : 4);
+    for (int y = 0; y < height; y++)
+      memcpy(pixel_buffer + y * pitch, rp->pixels + y * rp->pitch, row);
+  }
+  FinishPpuFrame(rp->ppu, pixel_buffer, pitch, rp->render_flags, rp->render_scale, redrawn);
+}
+
+static void RenderPipeline_DrawFrame() {
+  RenderPipeline *rp = &g_render_pipeline;
+  RenderPipeline_Present();
+
+  rp->render_scale = PpuGetCurrentRenderScale(g_zenv.ppu, g_ppu_render_flags);
+  rp->render_flags = g_ppu_render_flags | (rp->render_flags & kPpuRenderFlags_PixelFormatMask);
+  if (!ZeldaCapturePpuFrame(rp->packet, rp->render_flags)) {
+    DrawPpuFrameWithPerf();
+    return;
+  }
+  if (g_capture_ppu_frame) {
+    g_capture_ppu_frame = false;
+    SavePpuPacket(rp->packet);
+  }
+
+  rp->pitch = g_snes_width * rp->render_scale * 4;
+  size_t size = (size_t)rp->pitch * g_snes_height * rp->render_scale;
+  if (size > rp->pixels_size) {
+    free(rp->pixels);
+    rp->pixels = (uint8 *)malloc(size);
+    if (!rp->pixels) Die("Out of memory");
+    rp->pixels_size = size;
+  }
+  rp->busy = true;
+  SDL_SemPost(rp->start);
+}
+
+static void RenderPipeline_Destroy() {
+  RenderPipeline *rp = &g_render_pipeline;
+  if (rp->busy)
+    SDL_SemWait(rp->done);
+  rp->quit = true;
+  SDL_SemPost(rp->start);
+  SDL_WaitThread(rp->thread, NULL);
+  SDL_DestroySemaphore(rp->start);
+  SDL_DestroySemaphore(rp->done);
+  free(rp->pixels);
+  PpuSetParallelFor(rp->ppu, NULL);
+}
+
 // State for sdl renderer
 static SDL_Renderer *g_renderer;
 static SDL_Texture *g_texture;
@@ -252,7 +617,8 @@ static bool SdlRenderer_Init(SDL_Window *window) {
 
   SDL_Renderer *renderer = SDL_CreateRenderer(g_window, -1,
                                               g_config.output_method == kOutputMethod_SDLSoftware ? SDL_RENDERER_SOFTWARE :
-                                              SDL_RENDERER_ACCELERATED );
+                                              SDL_RENDERER_ACCELERATED |
+                                              (g_config.vsync ? SDL_RENDERER_PRESENTVSYNC : 0));
   if (renderer == NULL) {
     printf("Failed to create renderer: %s\n", SDL_GetError());
     return false;
@@ -286,7 +652,9 @@ static void SdlRenderer_Destroy() {
   SDL_DestroyRenderer(g_renderer);
 }
 
-static void SdlRenderer_BeginDraw(int width, int height, uint8 **pixels, int *pitch) {
+static void SdlRenderer_BeginDraw(int width, int height, uint8 **pixels, int *pitch, uint32 *pixel_format) {
+  // The texture is SDL_PIXELFORMAT_ARGB8888
+  *pixel_format = kPpuRenderFlags_Xrgb8888;
   g_sdl_renderer_rect.w = width;
   g_sdl_renderer_rect.h = height;
   if (SDL_LockTexture(g_texture, &g_sdl_renderer_rect, (void **)pixels, pitch) != 0) {
@@ -295,7 +663,7 @@ static void SdlRenderer_BeginDraw(int width, int height, uint8 **pixels, int *pi
   }
 }
 
-static void SdlRenderer_EndDraw() {
+static void SdlRenderer_EndDraw(const RendererRowSpan *spans, int num_spans) {
 
 //  uint64 before = SDL_GetPerformanceCounter();
   SDL_UnlockTexture(g_texture);
@@ -316,6 +684,44 @@ static const struct RendererFuncs kSdlRendererFuncs  = {
 
 void OpenGLRenderer_Create(struct RendererFuncs *funcs, bool use_opengl_es);
 
+static void StartupProfile_Record(const char *name, uint64 start) {
+  uint64 end = SDL_GetPerformanceCounter();
+  SDL_AtomicLock(&g_startup.lock);
+  if (g_startup.num_phases < countof(g_startup.phases))
+    g_startup.phases[g_startup.num_phases++] = (StartupPhase){ name, start, end };
+  SDL_AtomicUnlock(&g_startup.lock);
+}
+
+static void StartupProfile_Print() {
+  double scale = 1000.0 / SDL_GetPerformanceFrequency();
+  fprintf(stderr, "Startup profile (ms):\n");
+  for (int i = 0; i < g_startup.num_phases; i++) {
+    StartupPhase *p = &g_startup.phases[i];
+    fprintf(stderr, "  %-20s %7.1f  (at %7.1f)\n", p->name,
+            (p->end - p->start) * scale, (p->start - g_startup.t0) * scale);
+  }
+  fprintf(stderr, "  First frame at %.1f\n", (SDL_GetPerformanceCounter() - g_startup.t0) * scale);
+}
+
+// Everything that needs the assets. Runs concurrently with the SDL setup in main.
+static int SDLCALL StartupLoader_Thread(void *data) {
+  uint64 phase_start = SDL_GetPerformanceCounter();
+  LoadAssets();
+  StartupProfile_Record("assets", phase_start);
+  phase_start = SDL_GetPerformanceCounter();
+  LoadLinkGraphics();
+  StartupProfile_Record("link graphics", phase_start);
+  phase_start = SDL_GetPerformanceCounter();
+  ZeldaInitialize();
+  g_zenv.ppu->extraLeftRight = UintMin(g_config.extended_aspect_ratio, kPpuExtraLeftRight);
+  ZeldaEnableMsu(g_config.enable_msu);
+  ZeldaSetLanguage(g_config.language);
+  Dungeon_SetRoomCacheSize(g_config.dungeon_room_cache, g_config.dungeon_room_cache_verify);
+  Overworld_SetScreenCacheSize(g_config.overworld_screen_cache);
+  StartupProfile_Record("game init", phase_start);
+  return 0;
+}
+
 
 #undef main
 int main(int argc, char** argv) {
@@ -324,41 +730,45 @@ int main(int argc, char** argv) {
 
   pspFpuSetEnableStandalone(0);
   
+  g_startup.t0 = SDL_GetPerformanceCounter();
   argc--, argv++;
-  const char *config_file = NULL;
-  if (argc >= 2 && strcmp(argv[0], "--config") == 0) {
-    config_file = argv[1];
-    argc -= 2, argv += 2;
-  } else {
-    SwitchDirectory();
+  const char *config_file = NULL, *golden_frames = NULL;
+  int ppu_bench = 0;
+  for (;;) {
+    if (argc >= 2 && strcmp(argv[0], "--config") == 0) {
+      config_file = argv[1];
+      argc -= 2, argv += 2;
+    } else if (argc >= 2 && strcmp(argv[0], "--golden-frames") == 0) {
+      golden_frames = argv[1];
+      argc -= 2, argv += 2;
+    } else if (argc >= 2 && strcmp(argv[0], "--ppu-bench") == 0) {
+      ppu_bench = IntMax(atoi(argv[1]), 1);
+      argc -= 2, argv += 2;
+    } else if (argc >= 1 && strcmp(argv[0], "--startup-profile") == 0) {
+      g_startup.enabled = true;
+      argc--, argv++;
+    } else {
+      break;
+    }
   }
+  if (!config_file)
+    SwitchDirectory();
+  uint64 phase_start = SDL_GetPerformanceCounter();
   ParseConfigFile(config_file);
-  LoadAssets();
-  LoadLinkGraphics();
+  StartupProfile_Record("config", phase_start);
 
-  ZeldaInitialize();
-  g_zenv.ppu->extraLeftRight = UintMin(g_config.extended_aspect_ratio, kPpuExtraLeftRight);
   g_snes_width = (g_config.extended_aspect_ratio * 2 + 256);
   g_snes_height = (g_config.extend_y ? 240 : 224);
 
-
   // Delay actually setting those features in ram until any snapshots finish playing.
   g_wanted_zelda_features = g_config.features0;
 
   g_ppu_render_flags = g_config.new_renderer * kPpuRenderFlags_NewRenderer |
                        g_config.enhanced_mode7 * kPpuRenderFlags_4x4Mode7 |
                        g_config.extend_y * kPpuRenderFlags_Height240 |
-                       g_config.no_sprite_limits * kPpuRenderFlags_NoSpriteLimits;
-  ZeldaEnableMsu(g_config.enable_msu);
-  ZeldaSetLanguage(g_config.language);
-
-  if (g_config.fullscreen == 1)
-    g_win_flags ^= SDL_WINDOW_FULLSCREEN_DESKTOP;
-  else if (g_config.fullscreen == 2)
-    g_win_flags ^= SDL_WINDOW_FULLSCREEN;
-
-  // Window scale (1=100%, 2=200%, 3=300%, etc.)
-  g_current_window_scale = (g_config.window_scale == 0) ? 2 : IntMin(g_config.window_scale, kMaxWindowScale);
+                       g_config.no_sprite_limits * kPpuRenderFlags_NoSpriteLimits |
+                       g_config.bg_layer_cache * kPpuRenderFlags_BgLayerCache |
+                       g_config.line_cache * kPpuRenderFlags_LineCache;
 
   // audio_freq: Use common sampling rates (see user config file. values higher than 48000 are not supported.)
   if (g_config.audio_freq < 11025 || g_config.audio_freq > 48000)
@@ -372,11 +782,39 @@ int main(int argc, char** argv) {
   if (g_config.audio_samples <= 0 || ((g_config.audio_samples & (g_config.audio_samples - 1)) != 0))
     g_config.audio_samples = kDefaultSamples;
 
+  // Time the renderers on the captured frames given after the iteration count
+  if (ppu_bench)
+    return PpuBench_Run(ppu_bench, argv, argc);
+
+  // Loading the game doesn't touch SDL, so it runs while the window, renderer
+  // and audio device are created below.
+  SDL_Thread *loader = SDL_CreateThread(&StartupLoader_Thread, "loader", NULL);
+  if (!loader)
+    StartupLoader_Thread(NULL);
+
+  // Check the renderers against the reference saves, without opening a window
+  if (golden_frames) {
+    if (loader)
+      SDL_WaitThread(loader, NULL);
+    return GoldenFrames_Run(golden_frames);
+  }
+
+  if (g_config.fullscreen == 1)
+    g_win_flags ^= SDL_WINDOW_FULLSCREEN_DESKTOP;
+  else if (g_config.fullscreen == 2)
+    g_win_flags ^= SDL_WINDOW_FULLSCREEN;
+
+  // Window scale (1=100%, 2=200%, 3=300%, etc.)
+  g_current_window_scale = (g_config.window_scale == 0) ? 2 : IntMin(g_config.window_scale, kMaxWindowScale);
+
   // set up SDL
+  phase_start = SDL_GetPerformanceCounter();
   if(SDL_Init(SDL_INIT_VIDEO | SDL_INIT_AUDIO | SDL_INIT_GAMECONTROLLER) != 0) {
     printf("Failed to init SDL: %s\n", SDL_GetError());
     return 1;
   }
+  StartupProfile_Record("sdl init", phase_start);
+  phase_start = SDL_GetPerformanceCounter();
 
   bool custom_size  = g_config.window_width != 0 && g_config.window_height != 0;
   int window_width  = custom_size ? g_config.window_width  : g_current_window_scale * g_snes_width;
@@ -400,8 +838,11 @@ int main(int argc, char** argv) {
 
   if (!g_renderer_funcs.Initialize(window))
     return 1;
+  StartupProfile_Record("window and renderer", phase_start);
+  phase_start = SDL_GetPerformanceCounter();
 
-    SDL_GL_SetSwapInterval(0); // prevent GL swap from doing its own blocking; we pace on vblank
+  // Without vsync, frames are paced by the audio clock or the frame delay below.
+  SDL_GL_SetSwapInterval(g_config.vsync ? 1 : 0);
 
 
   SDL_AudioDeviceID device = 0;
@@ -422,8 +863,39 @@ int main(int argc, char** argv) {
     }
     g_audio_channels = have.channels;
     g_frames_per_block = (534 * have.freq) / 32000;
-    g_audiobuffer = malloc(g_frames_per_block * have.channels * sizeof(int16));
+    // Leave room for the blocks to grow when the rate is adjusted
+    g_audiobuffer = ArenaAlloc("audio buffer", (g_frames_per_block + g_frames_per_block / 128 + 1) * have.channels * sizeof(int16));
+
+    g_pacing.enabled = g_config.audio_pacing;
+    g_pacing.rate_control = g_config.vsync;
+    g_pacing.rate = 1.0f;
+    // Keep about one device buffer of frames queued
+    g_pacing.target = IntMax((have.samples + g_frames_per_block - 1) / g_frames_per_block, 1);
+    g_pacing.fill_avg = (float)g_pacing.target;
+    g_pacing.sem = SDL_CreateSemaphore(0);
+    if (!g_pacing.sem) Die("No semaphore");
   }
+  StartupProfile_Record("audio device", phase_start);
+
+  if (loader) {
+    phase_start = SDL_GetPerformanceCounter();
+    SDL_WaitThread(loader, NULL);
+    StartupProfile_Record("wait for loader", phase_start);
+  }
+
+  // Draw the 4x4 mode7 lines on all cores. RenderThreads counts the main thread too.
+  if (g_config.enhanced_mode7) {
+    int render_threads = g_config.render_threads ? g_config.render_threads : SDL_GetCPUCount();
+    if (render_threads > 1) {
+      RenderWorkers_Init(render_threads - 1);
+      if (g_render_workers.num_threads)
+        PpuSetParallelFor(g_zenv.ppu, &RenderWorkers_ParallelFor);
+    }
+  }
+
+  // Draw each frame on another thread while the next frame runs
+  if (g_config.pipelined_rendering && SDL_GetCPUCount() > 1)
+    RenderPipeline_Init();
 
   if (argc >= 1 && !g_run_without_emu)
     LoadRom(argv[0]);
@@ -435,6 +907,10 @@ int main(int argc, char** argv) {
 #endif
 
   ZeldaReadSram();
+  ZeldaEnableReplayJournal(g_config.replay_journal);
+
+  if (g_config.capture_path)
+    Capture_Start(g_config.capture_path, device ? have.freq : 0, device ? have.channels : 0);
 
   for (int i = 0; i < SDL_NumJoysticks(); i++)
     OpenOneGamepad(i);
@@ -445,6 +921,8 @@ int main(int argc, char** argv) {
   uint32 curTick = 0;
   uint32 frameCtr = 0;
   bool audiopaused = true;
+  bool is_replay = false;
+  bool memory_reported = false;
 
   if (g_config.autosave)
     HandleCommand(kKeys_Load + 0, true);
@@ -506,8 +984,15 @@ int main(int argc, char** argv) {
       g_gamepad_buttons = 0;
     inputs |= g_gamepad_buttons;
 
+    bool turbo = g_turbo ^ (is_replay & g_replay_turbo);
+    if (g_pacing.enabled && !turbo)
+      FramePacing_WaitForAudio();
+    FramePacing_RecordFrameTime();
+    EvictUnusedAssets();
+
     SDL_LockMutex(g_audio_mutex);
-    bool is_replay = ZeldaRunFrame(inputs);
+    is_replay = ZeldaRunFrame(inputs);
+    FramePacing_FrameQueued();
     SDL_UnlockMutex(g_audio_mutex);
 
     frameCtr++;
@@ -516,27 +1001,72 @@ int main(int argc, char** argv) {
       continue;
     }
 
-    DrawPpuFrameWithPerf();
+    if (g_render_pipeline.thread)
+      RenderPipeline_DrawFrame();
+    else
+      DrawPpuFrameWithPerf();
+
+    // Printed after the first frame so that the buffers sized by drawing are included.
+    if (!memory_reported) {
+      memory_reported = true;
+      ArenaPrintReport();
+      if (g_startup.enabled)
+        StartupProfile_Print();
+    }
 
     if (g_config.display_perf_title) {
-      char title[60];
-      printf(title, sizeof(title), "%s | FPS: %d", kWindowTitle, g_curr_fps);
+      char title[160];
+      int n = snprintf(title, sizeof(title), "%s | FPS: %d | %.2f ms (max %.2f) | Audio queue: %.1f",
+                       kWindowTitle, g_curr_fps, g_pacing.frame_time_sum * (1000.0f / 64),
+                       g_pacing.frame_time_max * 1000.0f, g_pacing.fill_avg);
+      Ppu *ppu = g_render_pipeline.thread ? g_render_pipeline.ppu : g_zenv.ppu;
+      if (g_ppu_render_flags & kPpuRenderFlags_LineCache && n > 0 && n < (int)sizeof(title))
+        snprintf(title + n, sizeof(title) - n, " | Lines cached: %d/%d", ppu->lineCacheHits,
+                 ppu->lineCacheHits + ppu->lineCacheMisses);
       SDL_SetWindowTitle(g_window, title);
     }
 
- 
+    // Fall back to a timer when neither the audio device nor vsync paces the frames.
+    if (!g_pacing.enabled && !g_config.vsync && !g_config.disable_frame_delay && !turbo) {
+      static const uint8 delays[3] = { 17, 17, 16 }; // 60 fps
+      curTick = SDL_GetTicks();
+      lastTick += delays[frameCtr % 3];
+      if (lastTick > curTick) {
+        uint32 delta = lastTick - curTick;
+        if (delta > 500) {
+          lastTick = curTick - 500;
+          delta = 500;
+        }
+        SDL_Delay(delta);
+      } else if (curTick - lastTick > 500) {
+        lastTick = curTick;
+      }
+    }
   }
   if (g_config.autosave)
     HandleCommand(kKeys_Save + 0, true);
+  ZeldaCloseReplayJournal();
 
   // clean sdl
   if (g_config.enable_audio) {
     SDL_PauseAudioDevice(device, 1);
     SDL_CloseAudioDevice(device);
   }
+  ZeldaShutdownMsu();
+  if (g_config.capture_path)
+    Capture_Stop();
+
+  if (g_render_pipeline.thread)
+    RenderPipeline_Destroy();
+
+  if (g_render_workers.num_threads) {
+    PpuSetParallelFor(g_zenv.ppu, NULL);
+    RenderWorkers_Destroy();
+  }
 
   SDL_DestroyMutex(g_audio_mutex);
-  free(g_audiobuffer);
+  if (g_pacing.sem)
+    SDL_DestroySemaphore(g_pacing.sem);
 
   g_renderer_funcs.Destroy();
 
@@ -546,7 +1076,14 @@ int main(int argc, char** argv) {
   return 0;
 }
 
-static void RenderDigit(uint8 *dst, size_t pitch, int digit, uint32 color, bool big) {
+static FORCEINLINE void PutPixel(uint8 *dst, int x, uint32 color, int bpp) {
+  if (bpp == 2)
+    ((uint16 *)dst)[x] = color;
+  else
+    ((uint32 *)dst)[x] = color;
+}
+
+static void RenderDigit(uint8 *dst, size_t pitch, int digit, uint32 color, bool big, int bpp) {
   static const uint8 kFont[] = {
     0x1c, 0x36, 0x63, 0x63, 0x63, 0x63, 0x63, 0x63, 0x36, 0x1c,
     0x18, 0x1c, 0x1e, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x7e,
@@ -565,7 +1102,7 @@ static void RenderDigit(uint8 *dst, size_t pitch, int digit, uint32 color, bool
       int v = *p++;
       for (int x = 0; v; x++, v >>= 1) {
         if (v & 1)
-          ((uint32 *)dst)[x] = color;
+          PutPixel(dst, x, color, bpp);
       }
     }
   } else {
@@ -573,22 +1110,27 @@ static void RenderDigit(uint8 *dst, size_t pitch, int digit, uint32 color, bool
       int v = *p++;
       for (int x = 0; v; x++, v >>= 1) {
         if (v & 1) {
-          ((uint32 *)dst)[x * 2 + 1] = ((uint32 *)dst)[x * 2] = color;
-          ((uint32 *)(dst+pitch))[x * 2 + 1] = ((uint32 *)(dst + pitch))[x * 2] = color;
+          PutPixel(dst, x * 2, color, bpp);
+          PutPixel(dst, x * 2 + 1, color, bpp);
+          PutPixel(dst + pitch, x * 2, color, bpp);
+          PutPixel(dst + pitch, x * 2 + 1, color, bpp);
         }
       }
     }
   }
 }
 
-static void RenderNumber(uint8 *dst, size_t pitch, int n, bool big) {
+static void RenderNumber(uint8 *dst, size_t pitch, int n, bool big, uint32 pixel_format) {
   char buf[32], *s;
   int i;
+  // The gray and white colors are the same in both 32-bit formats
+  bool rgb565 = (pixel_format == kPpuRenderFlags_Rgb565);
+  int bpp = rgb565 ? 2 : 4;
   sprintf(buf, "%d", n);
-  for (s = buf, i = 2 * 4; *s; s++, i += 8 * 4)
-    RenderDigit(dst + ((pitch + i + 4) << big), pitch, *s - '0', 0x404040, big);
-  for (s = buf, i = 2 * 4; *s; s++, i += 8 * 4)
-    RenderDigit(dst + (i << big), pitch, *s - '0', 0xffffff, big);
+  for (s = buf, i = 2 * bpp; *s; s++, i += 8 * bpp)
+    RenderDigit(dst + ((pitch + i + bpp) << big), pitch, *s - '0', rgb565 ? 0x4208 : 0x404040, big, bpp);
+  for (s = buf, i = 2 * bpp; *s; s++, i += 8 * bpp)
+    RenderDigit(dst + (i << big), pitch, *s - '0', rgb565 ? 0xffff : 0xffffff, big, bpp);
 }
 
 static void HandleCommand_Locked(uint32 j, bool pressed);
@@ -673,6 +1215,7 @@ static void HandleCommand_Locked(uint32 j, bool pressed) {
     case kKeys_WindowSmaller: ChangeWindowScale(-1); break;
     case kKeys_DisplayPerf: g_display_perf ^= 1; break;
     case kKeys_ToggleRenderer: g_ppu_render_flags ^= kPpuRenderFlags_NewRenderer; break;
+    case kKeys_CapturePpuFrame: g_capture_ppu_frame = true; break;
     case kKeys_VolumeUp:
     case kKeys_VolumeDown: HandleVolumeAdjustment(j == kKeys_VolumeUp ? 1 : -1); break;
     default: assert(0);
@@ -735,6 +1278,7 @@ static void HandleVolumeAdjustment(int volume_adjustment) {
   printf("[System Volume]=%i\n", new_volume);
 #else
   g_sdl_audio_mixer_volume = IntMin(IntMax(0, g_sdl_audio_mixer_volume + volume_adjustment * (SDL_MIX_MAXVOLUME >> 4)), SDL_MIX_MAXVOLUME);
+  ZeldaSetAudioVolume(g_sdl_audio_mixer_volume);
   printf("[SDL mixer volume]=%i\n", g_sdl_audio_mixer_volume);
 #endif
 }
@@ -819,8 +1363,11 @@ static bool ParseLinkGraphics(uint8 *file, size_t length) {
   if (kPalette_ArmorAndGloves_SIZE != 150 || kLinkGraphics_SIZE != 0x7000)
     Die("ParseLinkGraphics: Invalid asset sizes");
   memcpy(kLinkGraphics, file + pixel_offs, 0x7000);
-  if (palette_length >= 120)
+  PinAsset(kLinkGraphics);
+  if (palette_length >= 120) {
     memcpy(kPalette_ArmorAndGloves, file + palette_offs, 120);
+    PinAsset(kPalette_ArmorAndGloves);
+  }
   if (palette_length >= 124)
     memcpy(kGlovesColor, file + palette_offs + 120, 4);
   return true;
@@ -841,39 +1388,158 @@ static void LoadLinkGraphics() {
 const uint8 *g_asset_ptrs[kNumberOfAssets];
 uint32 g_asset_sizes[kNumberOfAssets];
 
-static void LoadAssets() {
-  size_t length = 0;
-  uint8 *data = ReadWholeFile("zelda3_assets.dat", &length);
-  if (!data) {
-    size_t bps_length, bps_src_length;
-    uint8 *bps, *bps_src;
-    bps = ReadWholeFile("zelda3_assets.bps", &bps_length);
-    if (!bps)
-      Die("Failed to read zelda3_assets.dat. Please see the README for information about how you get this file.");
-    bps_src = ReadWholeFile("zelda3.sfc", &bps_src_length);
-    if (!bps_src)
-      Die("Missing file: zelda3.sfc");
-    data = ApplyBps(bps_src, bps_src_length, bps, bps_length, &length);
+// With a compressed assets file, g_asset_ptrs starts out empty and each asset
+// is decompressed by LoadAsset on first use.
+typedef struct CompressedAsset {
+  const uint8 *data;
+  uint32 size;
+  uint32 last_used;
+  uint8 *loaded;
+  bool pinned;
+} CompressedAsset;
+
+static CompressedAsset *g_compressed_assets;
+static uint32 g_asset_frame;
+static uint32 g_asset_resident_bytes;
+
+const uint8 *LoadAsset(int asset) {
+  if (!g_compressed_assets)
+    Die("Asset not loaded");
+  CompressedAsset *ca = &g_compressed_assets[asset];
+  if (!ca->loaded) {
+    uint32 size = g_asset_sizes[asset];
+    uint8 *p = malloc(size ? size : 1);
+    if (!p || !Lz4DecompressBlock(ca->data, ca->size, p, size))
+      Die("Assets file corruption");
+    ca->loaded = p;
+    g_asset_resident_bytes += size;
+    ArenaAccount("assets", size);
+  }
+  ca->last_used = g_asset_frame;
+  return g_asset_ptrs[asset] = ca->loaded;
+}
+
+void PinAsset(const void *p) {
+  if (!g_compressed_assets)
+    return;
+  for (int i = 0; i < kNumberOfAssets; i++) {
+    CompressedAsset *ca = &g_compressed_assets[i];
+    if (ca->loaded && (const uint8 *)p >= ca->loaded && (const uint8 *)p <= ca->loaded + g_asset_sizes[i]) {
+      ca->pinned = true;
+      return;
+    }
+  }
+  Die("PinAsset: Not an asset");
+}
+
+// Keeps the decompressed assets within AssetMemoryBudget. Called once per frame,
+// it unmaps every asset so the next access marks it as used again, and then frees
+// the least recently used assets that were not touched in the previous frame.
+// Game code only keeps pointers into an asset within a frame, except for the
+// assets passed to PinAsset.
+static void EvictUnusedAssets() {
+  uint32 budget = g_config.asset_memory_budget * 1024;
+  if (!g_compressed_assets || budget == 0)
+    return;
+  g_asset_frame++;
+  for (int i = 0; i < kNumberOfAssets; i++) {
+    if (!g_compressed_assets[i].pinned)
+      g_asset_ptrs[i] = NULL;
+  }
+  while (g_asset_resident_bytes > budget) {
+    CompressedAsset *oldest = NULL;
+    for (int i = 0; i < kNumberOfAssets; i++) {
+      CompressedAsset *ca = &g_compressed_assets[i];
+      if (ca->loaded && !ca->pinned && ca->last_used + 1 < g_asset_frame &&
+          (!oldest || ca->last_used < oldest->last_used))
+        oldest = ca;
+    }
+    if (!oldest)
+      break;
+    free(oldest->loaded);
+    oldest->loaded = NULL;
+    g_asset_resident_bytes -= g_asset_sizes[oldest - g_compressed_assets];
+    ArenaAccount("assets", -(ptrdiff_t)g_asset_sizes[oldest - g_compressed_assets]);
+  }
+}
+
+// The result of applying zelda3_assets.bps is kept in zelda3_assets.cache,
+// together with the checksums of the two files it was created from.
+static uint8 *LoadPatchedAssets(size_t *length) {
+  static const char kBpsCacheMagic[8] = "Z3BPSC1";
+  size_t bps_length, bps_src_length, cache_length;
+  uint8 *bps, *bps_src, *cache, *data;
+  bps = ReadWholeFile("zelda3_assets.bps", &bps_length);
+  if (!bps)
+    Die("Failed to read zelda3_assets.dat. Please see the README for information about how you get this file.");
+  bps_src = ReadWholeFile("zelda3.sfc", &bps_src_length);
+  if (!bps_src)
+    Die("Missing file: zelda3.sfc");
+  uint32 key[2] = { Crc32(bps, bps_length), Crc32(bps_src, bps_src_length) };
+  cache = ReadWholeFile("zelda3_assets.cache", &cache_length);
+  if (cache && cache_length >= 16 && memcmp(cache, kBpsCacheMagic, 8) == 0 && memcmp(cache + 8, key, 8) == 0) {
+    data = cache + 16;
+    *length = cache_length - 16;
+  } else {
+    free(cache);
+    data = ApplyBps(bps_src, bps_src_length, bps, bps_length, length);
     if (!data)
       Die("Unable to apply zelda3_assets.bps. Please make sure you got the right version of 'zelda3.sfc'");
+    // Written under a temporary name so an interrupted write is never used
+    FILE *f = fopen("zelda3_assets.cache.tmp", "wb");
+    bool ok = f && fwrite(kBpsCacheMagic, 1, 8, f) == 8 && fwrite(key, 1, 8, f) == 8 &&
+              fwrite(data, 1, *length, f) == *length;
+    if (f && fclose(f) != 0)
+      ok = false;
+    remove("zelda3_assets.cache");
+    if (!ok || rename("zelda3_assets.cache.tmp", "zelda3_assets.cache") != 0)
+      fprintf(stderr, "Unable to write zelda3_assets.cache\n");
   }
+  free(bps);
+  free(bps_src);
+  return data;
+}
+
+static void LoadAssets() {
+  size_t length = 0;
+  uint8 *data = ReadWholeFile("zelda3_assets.dat", &length);
+  if (!data)
+    data = LoadPatchedAssets(&length);
+
+  ArenaAccount("assets file", length);
 
   static const char kAssetsSig[] = { kAssets_Sig };
+  static const char kCompressedMagic[16] = "Zelda3_v0lz4  \n";
+
+  // The compressed variant has a second table with the sizes of the LZ4 blocks.
+  bool compressed = length >= 16 && memcmp(data, kCompressedMagic, 16) == 0;
+  uint32 num_tables = compressed ? 2 : 1;
 
-  if (length < 16 + 32 + 32 + 8 + kNumberOfAssets * 4 ||
-      memcmp(data, kAssetsSig, 48) != 0 ||
+  if (length < 16 + 32 + 32 + 8 + kNumberOfAssets * 4 * num_tables ||
+      memcmp(data, compressed ? kCompressedMagic : kAssetsSig, 16) != 0 ||
+      memcmp(data + 16, kAssetsSig + 16, 32) != 0 ||
       *(uint32*)(data + 80) != kNumberOfAssets)
     Die("Invalid assets file");
 
-  uint32 offset = 88 + kNumberOfAssets * 4 + *(uint32 *)(data + 84);
+  const uint32 *sizes = (uint32 *)(data + 88);
+  const uint32 *stored_sizes = sizes + kNumberOfAssets * (num_tables - 1);
+  uint32 offset = 88 + kNumberOfAssets * 4 * num_tables + *(uint32 *)(data + 84);
+
+  if (compressed)
+    g_compressed_assets = calloc(kNumberOfAssets, sizeof(CompressedAsset));
 
   for (size_t i = 0; i < kNumberOfAssets; i++) {
-    uint32 size = *(uint32 *)(data + 88 + i * 4);
+    uint32 size = stored_sizes[i];
     offset = (offset + 3) & ~3;
     if ((uint64)offset + size > length)
       Die("Assets file corruption");
-    g_asset_sizes[i] = size;
-    g_asset_ptrs[i] = data + offset;
+    g_asset_sizes[i] = sizes[i];
+    if (compressed) {
+      g_compressed_assets[i].data = data + offset;
+      g_compressed_assets[i].size = size;
+    } else {
+      g_asset_ptrs[i] = data + offset;
+    }
     offset += size;
   }
 
@@ -881,6 +1547,7 @@ static void LoadAssets() {
     kPalette_DungBgMain[0x484] = 0x70;
     kPalette_DungBgMain[0x485] = 0x95;
     kPalette_DungBgMain[0x486] = 0x57;
+    PinAsset(kPalette_DungBgMain);
   }
 }
 
@@ -911,5 +1578,5 @@ static void SwitchDirectory() {
 }
 
 MemBlk FindInAssetArray(int asset, int idx) {
-  return FindIndexInMemblk((MemBlk) { g_asset_ptrs[asset], g_asset_sizes[asset] }, idx);
+  return FindIndexInMemblk((MemBlk) { GetAsset(asset), g_asset_sizes[asset] }, idx);
 }
@@ -5,6 +5,8 @@
 #include "types.h"
 #include "util.h"
 #include "config.h"
+#include "arena.h"
+#include "snes/ppu.h"
 
 // Platform OpenGL ES includes, without glext.h dependency
 #include <GLES/gl.h>
@@ -35,8 +37,6 @@ typedef struct {
 static SDL_Window *g_window;
 static uint8 *g_screen_buffer;
 static size_t g_screen_buffer_size;
-static uint8 *g_upload_buffer;
-static size_t g_upload_buffer_size;
 static int g_draw_width, g_draw_height;
 static GlTextureWithSize g_texture;
 static GLuint g_tex = 0;
@@ -140,13 +140,23 @@ static void OpenGLRenderer_Destroy() {
     glDeleteTextures(1, &g_tex);
     g_tex = 0;
   }
-  free(g_upload_buffer); g_upload_buffer = NULL; g_upload_buffer_size = 0;
+  ArenaAccount("screen buffer", -(ptrdiff_t)g_screen_buffer_size);
   free(g_screen_buffer); g_screen_buffer = NULL; g_screen_buffer_size = 0;
 }
 
-static void OpenGLRenderer_BeginDraw(int width, int height, uint8 **pixels, int *pitch) {
-  const size_t needed = (size_t)width * (size_t)height * 4;
+// The PPU draws directly in the format that gets uploaded, so no conversion pass is needed.
+static uint32 OpenGLRenderer_PixelFormat() {
+  if (g_use_rgb565)
+    return kPpuRenderFlags_Rgb565;
+  return g_has_bgra_ext ? kPpuRenderFlags_Xrgb8888 : kPpuRenderFlags_Rgba8888;
+}
+
+static void OpenGLRenderer_BeginDraw(int width, int height, uint8 **pixels, int *pitch, uint32 *pixel_format) {
+  const int bpp = g_use_rgb565 ? 2 : 4;
+  const size_t needed = (size_t)width * (size_t)height * bpp;
   if (needed > g_screen_buffer_size) {
+    // Grows when the render scale changes, so it stays outside of the arena
+    ArenaAccount("screen buffer", ALIGN_UP(needed, 4096) - g_screen_buffer_size);
     g_screen_buffer_size = ALIGN_UP(needed, 4096);
     free(g_screen_buffer);
     g_screen_buffer = (uint8*)malloc(g_screen_buffer_size);
@@ -154,40 +164,11 @@ static void OpenGLRenderer_BeginDraw(int width, int height, uint8 **pixels, int
   g_draw_width = width;
   g_draw_height = height;
   *pixels = g_screen_buffer;
-  *pitch = width * 4;
+  *pitch = width * bpp;
+  *pixel_format = OpenGLRenderer_PixelFormat();
 }
 
-static inline void ensure_upload_buffer(size_t bytes) {
-  if (bytes > g_upload_buffer_size) {
-    g_upload_buffer_size = ALIGN_UP(bytes, 4096);
-    g_upload_buffer = (uint8*)realloc(g_upload_buffer, g_upload_buffer_size);
-  }
-}
-
-// Fast BGRA -> RGBA swizzle
-static void swizzle_bgra_to_rgba(uint8 *dst, const uint8 *src, size_t px_count) {
-  const uint32_t *s32 = (const uint32_t*)src;
-  uint32_t *d32 = (uint32_t*)dst;
-  for (size_t i = 0; i < px_count; ++i) {
-    uint32_t v = s32[i];
-    d32[i] = (v >> 16) | (v & 0xFF00FF00) | (v << 16);
-  }
-}
-
-// Pack BGRA8888 -> RGB565 (little-endian)
-static void pack_bgra8888_to_rgb565(uint16_t *dst, const uint8 *src, size_t px_count) {
-  for (size_t i = 0; i < px_count; ++i) {
-    uint8 b = src[i * 4 + 0];
-    uint8 g = src[i * 4 + 1];
-    uint8 r = src[i * 4 + 2];
-    uint16_t rv = (uint16_t)((r >> 3) & 0x1F);
-    uint16_t gv = (uint16_t)((g >> 2) & 0x3F);
-    uint16_t bv = (uint16_t)((b >> 3) & 0x1F);
-    dst[i] = (uint16_t)((rv << 11) | (gv << 5) | (bv));
-  }
-}
-
-static void OpenGLRenderer_EndDraw() {
+static void OpenGLRenderer_EndDraw(const RendererRowSpan *spans, int num_spans) {
   int drawable_width = 0, drawable_height = 0;
   SDL_GL_GetDrawableSize(g_window, &drawable_width, &drawable_height);
 
@@ -212,24 +193,15 @@ static void OpenGLRenderer_EndDraw() {
 
   const GLsizei w = (GLsizei)g_draw_width;
   const GLsizei h = (GLsizei)g_draw_height;
-  const size_t px = (size_t)w * (size_t)h;
-  const void *pixels;
   GLenum src_fmt;
   GLenum src_type;
   if (g_use_rgb565) {
-    ensure_upload_buffer(px * 2);
-    pack_bgra8888_to_rgb565((uint16_t*)g_upload_buffer, g_screen_buffer, px);
-    pixels = g_upload_buffer;
     src_fmt = GL_RGB;
     src_type = GL_UNSIGNED_SHORT_5_6_5;
   } else if (g_has_bgra_ext) {
-    pixels = g_screen_buffer;
     src_fmt = GL_BGRA_EXT;
     src_type = GL_UNSIGNED_BYTE;
   } else {
-    ensure_upload_buffer(px * 4);
-    swizzle_bgra_to_rgba(g_upload_buffer, g_screen_buffer, px);
-    pixels = g_upload_buffer;
     src_fmt = GL_RGBA;
     src_type = GL_UNSIGNED_BYTE;
   }
@@ -256,7 +228,15 @@ static void OpenGLRenderer_EndDraw() {
     g_last_w = -1; g_last_h = -1;
   }
 
-  glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, w, h, src_fmt, src_type, pixels);
+  // The texture keeps the rows that didn't change, unless it was just resized
+  if (num_spans < 0 || g_last_w != w || g_last_h != h) {
+    glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, w, h, src_fmt, src_type, g_screen_buffer);
+  } else {
+    const size_t pitch = (size_t)w * (g_use_rgb565 ? 2 : 4);
+    for (int i = 0; i < num_spans; i++)
+      glTexSubImage2D(GL_TEXTURE_2D, 0, 0, spans[i].first, w, spans[i].count, src_fmt, src_type,
+                      g_screen_buffer + spans[i].first * pitch);
+  }
 
   if (g_last_w != w || g_last_h != h) {
     const GLfloat umax = (GLfloat)w / (GLfloat)g_tex_max_w;
@@ -11,6 +11,7 @@
 #include "player_oam.h"
 #include "snes/snes_regs.h"
 #include "assets.h"
+#include "arena.h"
 
 const uint16 kOverworld_OffsetBaseX[64] = {
   0,     0, 0x400, 0x600, 0x600, 0xa00, 0xa00, 0xe00,
@@ -2457,78 +2458,176 @@ static const uint8 *GetOverworldLobytes(int i) {
 }
 
 
+// Map32 definitions expanded into the four map16 tiles of each entry (top left,
+// top right, bottom left, bottom right), built the first time it's needed.
+static uint16 (*g_map32_to_map16)[4];
+static uint32 g_map32_to_map16_count;
+
+// The map32 indices and final contents of the decompression buffer of recently
+// drawn screens, so they don't need to be decompressed again. The least recently
+// used screens are freed to stay within g_overworld_screen_cache_budget bytes.
+typedef struct OverworldScreenCache {
+  uint32 last_used;
+  uint16 map32[256];
+  uint16 buf_size;
+  uint8 buf[];
+} OverworldScreenCache;
+static OverworldScreenCache *g_overworld_screen_cache[256];
+static uint32 g_overworld_screen_cache_budget, g_overworld_screen_cache_bytes;
+static uint32 g_overworld_screen_cache_counter;
+
+static void OverworldScreenCache_Free(int screen) {
+  OverworldScreenCache *c = g_overworld_screen_cache[screen];
+  uint32 size = sizeof(OverworldScreenCache) + c->buf_size;
+  free(c);
+  g_overworld_screen_cache[screen] = NULL;
+  g_overworld_screen_cache_bytes -= size;
+  ArenaAccount("overworld screens", -(ptrdiff_t)size);
+}
+
+void Overworld_SetScreenCacheSize(int kb) {
+  for (int i = 0; i < countof(g_overworld_screen_cache); i++) {
+    if (g_overworld_screen_cache[i])
+      OverworldScreenCache_Free(i);
+  }
+  g_overworld_screen_cache_budget = kb > 0 ? kb * 1024 : 0;
+}
+
+static void OverworldScreenCache_Store(int screen, int n) {
+  uint32 size = sizeof(OverworldScreenCache) + n;
+  if (size > g_overworld_screen_cache_budget)
+    return;
+  while (g_overworld_screen_cache_bytes + size > g_overworld_screen_cache_budget) {
+    int oldest = -1;
+    for (int i = 0; i < countof(g_overworld_screen_cache); i++) {
+      if (g_overworld_screen_cache[i] && (oldest < 0 ||
+          g_overworld_screen_cache[i]->last_used < g_overworld_screen_cache[oldest]->last_used))
+        oldest = i;
+    }
+    OverworldScreenCache_Free(oldest);
+  }
+  OverworldScreenCache *c = (OverworldScreenCache *)malloc(size);
+  if (!c)
+    return;
+  c->last_used = ++g_overworld_screen_cache_counter;
+  memcpy(c->map32, &g_ram[0x14000], sizeof(c->map32));
+  c->buf_size = n;
+  memcpy(c->buf, &g_ram[0x14400], n);
+  g_overworld_screen_cache[screen] = c;
+  g_overworld_screen_cache_bytes += size;
+  ArenaAccount("overworld screens", size);
+}
+
+static void Overworld_ExpandMap32ToMap16() {
+  const uint8 *tables[4] = { kMap32ToMap16_0, kMap32ToMap16_1, kMap32ToMap16_2, kMap32ToMap16_3 };
+  uint32 groups = UintMin(UintMin(kMap32ToMap16_0_SIZE, kMap32ToMap16_1_SIZE),
+                          UintMin(kMap32ToMap16_2_SIZE, kMap32ToMap16_3_SIZE)) / 6;
+  // Each group of 6 bytes holds the low bytes of 4 entries followed by their high nibbles
+  g_map32_to_map16 = (uint16(*)[4])ArenaAlloc("map32 table", groups * 4 * sizeof(uint16[4]));
+  for (uint32 i = 0; i < groups * 4; i++) {
+    for (int j = 0; j < 4; j++) {
+      const uint8 *ov = tables[j] + (i >> 2) * 6;
+      uint8 hi = ov[4 + ((i >> 1) & 1)];
+      g_map32_to_map16[i][j] = ov[i & 3] | ((i & 1) ? hi & 0xf : hi >> 4) << 8;
+    }
+  }
+  g_map32_to_map16_count = groups * 4;
+}
+
 void Overworld_DecompressAndDrawOneQuadrant(uint16 *dst, int screen) {  // 82f595
-  Decompress_bank02(&g_ram[0x14400], GetOverworldHibytes(screen));
-  for (int i = 0; i < 256; i++)
-    g_ram[0x14001 + i * 2] = g_ram[0x14400 + i];
+  OverworldScreenCache *c = (uint32)screen < countof(g_overworld_screen_cache) ? g_overworld_screen_cache[screen] : NULL;
+  if (c) {
+    c->last_used = ++g_overworld_screen_cache_counter;
+    memcpy(&g_ram[0x14000], c->map32, sizeof(c->map32));
+    memcpy(&g_ram[0x14400], c->buf, c->buf_size);
+  } else {
+    int n = Decompress_bank02(&g_ram[0x14400], GetOverworldHibytes(screen));
+    for (int i = 0; i < 256; i++)
+      g_ram[0x14001 + i * 2] = g_ram[0x14400 + i];
 
-  Decompress_bank02(&g_ram[0x14400], GetOverworldLobytes(screen));
-  for (int i = 0; i < 256; i++)
-    g_ram[0x14000 + i * 2] = g_ram[0x14400 + i];
+    n = IntMax(n, Decompress_bank02(&g_ram[0x14400], GetOverworldLobytes(screen)));
+    for (int i = 0; i < 256; i++)
+      g_ram[0x14000 + i * 2] = g_ram[0x14400 + i];
 
-  map16_decode_last = 0xffff;
+    if ((uint32)screen < countof(g_overworld_screen_cache))
+      OverworldScreenCache_Store(screen, n);
+  }
 
-  uint16 *src = (uint16 *)&g_ram[0x14000];
+  if (!g_map32_to_map16)
+    Overworld_ExpandMap32ToMap16();
+
+  const uint16 *src = (uint16 *)&g_ram[0x14000];
   for (int j = 0; j < 16; j++) {
     for (int i = 0; i < 16; i++) {
-      Overworld_ParseMap32Definition(dst, *src++ * 2);
+      uint16 m = *src++;
+      assert(m < g_map32_to_map16_count);
+      const uint16 *t = g_map32_to_map16[m];
+      dst[0] = t[0];
+      dst[1] = t[1];
+      dst[64] = t[2];
+      dst[65] = t[3];
       dst += 2;
     }
     dst += 96;
   }
+  // Leave the decoder state of the last entry behind like Overworld_ParseMap32Definition
+  Overworld_DecodeMap32Group((src[-1] * 2) & ~7);
 }
 
 void Overworld_ParseMap32Definition(uint16 *dst, uint16 input) {  // 82f691
   uint16 a = input & ~7;
-  if (a != map16_decode_last) {
-    map16_decode_last = a;
-    map16_decode_tmp = a >> 1;
-    int x = (a >> 1) + (a >> 2);
-    const uint8 *ov;
-    ov = kMap32ToMap16_0 + x;
-
-    map16_decode_0[0] = ov[0];
-    map16_decode_0[2] = ov[1];
-    map16_decode_0[4] = ov[2];
-    map16_decode_0[6] = ov[3];
-    map16_decode_0[1] = ov[4] >> 4;
-    map16_decode_0[3] = ov[4] & 0xf;
-    map16_decode_0[5] = ov[5] >> 4;
-    map16_decode_0[7] = ov[5] & 0xf;
-    ov = kMap32ToMap16_1 + x;
-    map16_decode_1[0] = ov[0];
-    map16_decode_1[2] = ov[1];
-    map16_decode_1[4] = ov[2];
-    map16_decode_1[6] = ov[3];
-    map16_decode_1[1] = ov[4] >> 4;
-    map16_decode_1[3] = ov[4] & 0xf;
-    map16_decode_1[5] = ov[5] >> 4;
-    map16_decode_1[7] = ov[5] & 0xf;
-    ov = kMap32ToMap16_2 + x;
-    map16_decode_2[0] = ov[0];
-    map16_decode_2[2] = ov[1];
-    map16_decode_2[4] = ov[2];
-    map16_decode_2[6] = ov[3];
-    map16_decode_2[1] = ov[4] >> 4;
-    map16_decode_2[3] = ov[4] & 0xf;
-    map16_decode_2[5] = ov[5] >> 4;
-    map16_decode_2[7] = ov[5] & 0xf;
-    ov = kMap32ToMap16_3 + x;
-    map16_decode_3[0] = ov[0];
-    map16_decode_3[2] = ov[1];
-    map16_decode_3[4] = ov[2];
-    map16_decode_3[6] = ov[3];
-    map16_decode_3[1] = ov[4] >> 4;
-    map16_decode_3[3] = ov[4] & 0xf;
-    map16_decode_3[5] = ov[5] >> 4;
-    map16_decode_3[7] = ov[5] & 0xf;
-  }
+  if (a != map16_decode_last)
+    Overworld_DecodeMap32Group(a);
   dst[0] = WORD(map16_decode_0[input & 7]);
   dst[64] = WORD(map16_decode_2[input & 7]);
   dst[1] = WORD(map16_decode_1[input & 7]);
   dst[65] = WORD(map16_decode_3[input & 7]);
 }
 
+void Overworld_DecodeMap32Group(uint16 a) {
+  map16_decode_last = a;
+  map16_decode_tmp = a >> 1;
+  int x = (a >> 1) + (a >> 2);
+  const uint8 *ov;
+  ov = kMap32ToMap16_0 + x;
+
+  map16_decode_0[0] = ov[0];
+  map16_decode_0[2] = ov[1];
+  map16_decode_0[4] = ov[2];
+  map16_decode_0[6] = ov[3];
+  map16_decode_0[1] = ov[4] >> 4;
+  map16_decode_0[3] = ov[4] & 0xf;
+  map16_decode_0[5] = ov[5] >> 4;
+  map16_decode_0[7] = ov[5] & 0xf;
+  ov = kMap32ToMap16_1 + x;
+  map16_decode_1[0] = ov[0];
+  map16_decode_1[2] = ov[1];
+  map16_decode_1[4] = ov[2];
+  map16_decode_1[6] = ov[3];
+  map16_decode_1[1] = ov[4] >> 4;
+  map16_decode_1[3] = ov[4] & 0xf;
+  map16_decode_1[5] = ov[5] >> 4;
+  map16_decode_1[7] = ov[5] & 0xf;
+  ov = kMap32ToMap16_2 + x;
+  map16_decode_2[0] = ov[0];
+  map16_decode_2[2] = ov[1];
+  map16_decode_2[4] = ov[2];
+  map16_decode_2[6] = ov[3];
+  map16_decode_2[1] = ov[4] >> 4;
+  map16_decode_2[3] = ov[4] & 0xf;
+  map16_decode_2[5] = ov[5] >> 4;
+  map16_decode_2[7] = ov[5] & 0xf;
+  ov = kMap32ToMap16_3 + x;
+  map16_decode_3[0] = ov[0];
+  map16_decode_3[2] = ov[1];
+  map16_decode_3[4] = ov[2];
+  map16_decode_3[6] = ov[3];
+  map16_decode_3[1] = ov[4] >> 4;
+  map16_decode_3[3] = ov[4] & 0xf;
+  map16_decode_3[5] = ov[5] >> 4;
+  map16_decode_3[7] = ov[5] & 0xf;
+}
+
 void OverworldLoad_LoadSubOverlayMap32() {  // 82f7cb
   int si = overworld_screen_index;
   Overworld_DecompressAndDrawOneQuadrant((uint16 *)&g_ram[0x4000], si);
@@ -123,7 +123,9 @@ uint16 *BufferAndBuildMap16Stripes_X(uint16 *dst);
 uint16 *BufferAndBuildMap16Stripes_Y(uint16 *dst);
 void Overworld_DecompressAndDrawAllQuadrants();
 void Overworld_DecompressAndDrawOneQuadrant(uint16 *dst, int screen);
+void Overworld_SetScreenCacheSize(int kb);
 void Overworld_ParseMap32Definition(uint16 *dst, uint16 input);
+void Overworld_DecodeMap32Group(uint16 a);
 void OverworldLoad_LoadSubOverlayMap32();
 void LoadOverworldOverlay();
 void Map16ToMap8(const uint8 *src, int r20);
@@ -0,0 +1,94 @@
+#include "ppu_bench.h"
+#include "zelda_rtl.h"
+#include "snes/ppu.h"
+#include "util.h"
+#include <SDL2/SDL.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+enum {
+  kPpuBenchMaxWidth = kPpuXPixels * 4,
+  kPpuBenchMaxHeight = 240 * 4,
+};
+
+typedef struct PpuBenchConfig {
+  const char *name;
+  uint32 render_flags;
+  // Has to draw the same pixels as this configuration
+  const char *same_as;
+} PpuBenchConfig;
+
+static const PpuBenchConfig kPpuBenchConfigs[] = {
+  { "old", 0, NULL },
+  { "new", kPpuRenderFlags_NewRenderer, NULL },
+  { "new-rgb565", kPpuRenderFlags_NewRenderer | kPpuRenderFlags_Rgb565, NULL },
+  { "new-mode7x4", kPpuRenderFlags_NewRenderer | kPpuRenderFlags_4x4Mode7, NULL },
+  { "new-nospritelimits", kPpuRenderFlags_NewRenderer | kPpuRenderFlags_NoSpriteLimits, NULL },
+  { "new-bglayercache", kPpuRenderFlags_NewRenderer | kPpuRenderFlags_BgLayerCache, "new" },
+  { "new-linecache", kPpuRenderFlags_NewRenderer | kPpuRenderFlags_LineCache, "new" },
+  { "new-bglayercache-linecache", kPpuRenderFlags_NewRenderer | kPpuRenderFlags_BgLayerCache | kPpuRenderFlags_LineCache, "new" },
+};
+
+static uint32 PpuBench_Checksum(const uint8 *pixels, size_t pitch, size_t row_size, int height) {
+  uint32 crc = 0;
+  for (int y = 0; y < height; y++)
+    crc = crc * 0x01000193 ^ Crc32(pixels + pitch * y, row_size);
+  return crc;
+}
+
+int PpuBench_Run(int iterations, char **files, int num_files) {
+  size_t pitch = kPpuBenchMaxWidth * 4;
+  uint8 *pixels = (uint8 *)malloc(pitch * kPpuBenchMaxHeight);
+  ZeldaPpuPacket *packet = ZeldaPpuPacket_Create();
+  Ppu *ppu = ppu_init(NULL);
+  ppu_reset(ppu);
+  double ticks_to_ns = 1e9 / SDL_GetPerformanceFrequency();
+  uint32 crcs[countof(kPpuBenchConfigs)];
+  int errors = 0;
+
+#if defined(__SSE2__) || defined(_M_X64)
+  printf("%d iterations, SSE2 kernels\n", iterations);
+#else
+  printf("%d iterations, scalar kernels\n", iterations);
+#endif
+  for (int fi = 0; fi < num_files; fi++) {
+    if (!ZeldaPpuPacket_Load(packet, files[fi])) {
+      fprintf(stderr, "Unable to load %s\n", files[fi]);
+      errors++;
+      continue;
+    }
+    for (int ci = 0; ci < countof(kPpuBenchConfigs); ci++) {
+      const PpuBenchConfig *bc = &kPpuBenchConfigs[ci];
+      uint32 render_flags = bc->render_flags | (packet->render_flags & kPpuRenderFlags_Height240);
+      int scale = PpuGetCurrentRenderScale(packet->ppu, render_flags);
+      size_t row_size = (256 + packet->ppu->extraLeftRight * 2) * scale *
+          ((render_flags & kPpuRenderFlags_PixelFormatMask) == kPpuRenderFlags_Rgb565 ? 2 : 4);
+      int height = packet->height * scale;
+
+      // The first draw allocates the caches and fills them
+      ZeldaDrawPpuPacket(ppu, packet, pixels, pitch, render_flags);
+      crcs[ci] = PpuBench_Checksum(pixels, pitch, row_size, height);
+      uint64 before = SDL_GetPerformanceCounter();
+      for (int i = 0; i < iterations; i++)
+        ZeldaDrawPpuPacket(ppu, packet, pixels, pitch, render_flags);
+      uint64 ticks = SDL_GetPerformanceCounter() - before;
+      uint32 crc = PpuBench_Checksum(pixels, pitch, row_size, height);
+
+      printf("%s %-26s %8.1f ns/line %08x\n", files[fi], bc->name,
+             ticks * ticks_to_ns / ((double)iterations * packet->height), crcs[ci]);
+      if (crc != crcs[ci]) {
+        fprintf(stderr, "%s, %s: draws differently when repeated\n", files[fi], bc->name);
+        errors++;
+      }
+      for (int j = 0; bc->same_as && j < ci; j++) {
+        if (strcmp(kPpuBenchConfigs[j].name, bc->same_as) == 0 && crcs[j] != crcs[ci]) {
+          fprintf(stderr, "%s, %s: differs from %s\n", files[fi], bc->name, bc->same_as);
+          errors++;
+        }
+      }
+    }
+  }
+  free(pixels);
+  return errors != 0;
+}
@@ -0,0 +1,10 @@
+#ifndef ZELDA3_PPU_BENCH_H_
+#define ZELDA3_PPU_BENCH_H_
+
+// Draws each ppu frame captured with the CapturePpuFrame key |iterations| times
+// per renderer configuration, and prints the time per line and a checksum of
+// the pixels. Configurations that should draw the same pixels are compared.
+// Returns the process exit code.
+int PpuBench_Run(int iterations, char **files, int num_files);
+
+#endif  // ZELDA3_PPU_BENCH_H_
@@ -0,0 +1,163 @@
+#include "replay_journal.h"
+#include <SDL2/SDL.h>
+#include <string.h>
+
+static const char kReplayJournalMagic[4] = { 'Z', 'R', 'J', '1' };
+
+enum {
+  // Larger records can only come from a corrupt header
+  kMaxRecordSize = 16 << 20,
+};
+
+typedef struct JournalRecord {
+  struct JournalRecord *next;
+  uint32 type;
+  ByteArray payload;
+} JournalRecord;
+
+struct ReplayJournal {
+  FILE *f;
+  char *filename;
+  SDL_Thread *thread;
+  SDL_mutex *mutex;
+  SDL_cond *cond;
+  bool quit;
+  int pending;
+  // Waiting to be written, and written records that the main thread frees, so
+  // that all allocations happen on the main thread.
+  JournalRecord *queue, **queue_tail;
+  JournalRecord *done;
+};
+
+static bool ReplayJournal_Truncate(ReplayJournal *j) {
+  if (j->f)
+    fclose(j->f);
+  j->f = fopen(j->filename, "wb");
+  return j->f && fwrite(kReplayJournalMagic, 1, 4, j->f) == 4;
+}
+
+static void ReplayJournal_WriteRecord(ReplayJournal *j, JournalRecord *r) {
+  if (r->type == kReplayJournal_Start && !ReplayJournal_Truncate(j))
+    return;
+  if (!j->f)
+    return;
+  uint32 hdr[3] = { r->type, (uint32)r->payload.size, Crc32(r->payload.data, r->payload.size) };
+  fwrite(hdr, 1, sizeof(hdr), j->f);
+  fwrite(r->payload.data, 1, r->payload.size, j->f);
+  fflush(j->f);
+}
+
+static int SDLCALL ReplayJournal_WriterThread(void *data) {
+  ReplayJournal *j = data;
+  SDL_LockMutex(j->mutex);
+  for (;;) {
+    JournalRecord *r = j->queue;
+    if (r == NULL) {
+      if (j->quit)
+        break;
+      SDL_CondWait(j->cond, j->mutex);
+      continue;
+    }
+    if (!(j->queue = r->next))
+      j->queue_tail = &j->queue;
+    SDL_UnlockMutex(j->mutex);
+    ReplayJournal_WriteRecord(j, r);
+    SDL_LockMutex(j->mutex);
+    r->next = j->done;
+    j->done = r;
+    j->pending--;
+    SDL_CondBroadcast(j->cond);
+  }
+  SDL_UnlockMutex(j->mutex);
+  return 0;
+}
+
+static void ReplayJournal_FreeDone(ReplayJournal *j) {
+  SDL_LockMutex(j->mutex);
+  JournalRecord *r = j->done;
+  j->done = NULL;
+  SDL_UnlockMutex(j->mutex);
+  while (r) {
+    JournalRecord *next = r->next;
+    ByteArray_Destroy(&r->payload);
+    free(r);
+    r = next;
+  }
+}
+
+ReplayJournal *ReplayJournal_Open(const char *filename) {
+  ReplayJournal *j = (ReplayJournal *)calloc(1, sizeof(ReplayJournal));
+  StrSet(&j->filename, filename);
+  j->queue_tail = &j->queue;
+  j->mutex = SDL_CreateMutex();
+  j->cond = SDL_CreateCond();
+  if (!j->mutex || !j->cond || !ReplayJournal_Truncate(j))
+    Die("Unable to create the replay journal");
+  j->thread = SDL_CreateThread(&ReplayJournal_WriterThread, "replay_journal", j);
+  if (!j->thread)
+    Die("Unable to create the replay journal thread");
+  return j;
+}
+
+void ReplayJournal_Close(ReplayJournal *j) {
+  SDL_LockMutex(j->mutex);
+  j->quit = true;
+  SDL_CondBroadcast(j->cond);
+  SDL_UnlockMutex(j->mutex);
+  SDL_WaitThread(j->thread, NULL);
+  ReplayJournal_FreeDone(j);
+  if (j->f)
+    fclose(j->f);
+  remove(j->filename);
+  SDL_DestroyCond(j->cond);
+  SDL_DestroyMutex(j->mutex);
+  free(j->filename);
+  free(j);
+}
+
+void ReplayJournal_Append(ReplayJournal *j, uint32 type, ByteArray *payload) {
+  ReplayJournal_FreeDone(j);
+  JournalRecord *r = (JournalRecord *)malloc(sizeof(JournalRecord));
+  if (!r)
+    Die("memory allocation failed");
+  r->next = NULL;
+  r->type = type;
+  r->payload = *payload;
+  memset(payload, 0, sizeof(*payload));
+  SDL_LockMutex(j->mutex);
+  *j->queue_tail = r;
+  j->queue_tail = &r->next;
+  j->pending++;
+  SDL_CondBroadcast(j->cond);
+  SDL_UnlockMutex(j->mutex);
+}
+
+void ReplayJournal_Flush(ReplayJournal *j) {
+  SDL_LockMutex(j->mutex);
+  while (j->pending)
+    SDL_CondWait(j->cond, j->mutex);
+  SDL_UnlockMutex(j->mutex);
+  ReplayJournal_FreeDone(j);
+}
+
+FILE *ReplayJournal_OpenForReading(const char *filename) {
+  FILE *f = fopen(filename, "rb");
+  char magic[4];
+  if (f && (fread(magic, 1, 4, f) != 4 || memcmp(magic, kReplayJournalMagic, 4) != 0)) {
+    fclose(f);
+    f = NULL;
+  }
+  return f;
+}
+
+bool ReplayJournal_ReadRecord(FILE *f, uint32 *type, ByteArray *payload) {
+  uint32 hdr[3];
+  if (fread(hdr, 1, sizeof(hdr), f) != sizeof(hdr) || hdr[1] > kMaxRecordSize)
+    return false;
+  ByteArray_Resize(payload, hdr[1]);
+  if (fread(payload->data, 1, hdr[1], f) != hdr[1] ||
+      Crc32(payload->data, hdr[1]) != hdr[2])
+    return false;
+  *type = hdr[0];
+  return true;
+}
@@ -0,0 +1,31 @@
+#ifndef ZELDA3_REPLAY_JOURNAL_H_
+#define ZELDA3_REPLAY_JOURNAL_H_
+
+#include <stdio.h>
+#include "types.h"
+#include "util.h"
+
+// An append-only file of checksummed records, written by a background thread.
+// The state recorder streams its log into it so that a session can be
+// recovered after a crash, see StateRecorder_ConvertJournal.
+enum {
+  kReplayJournal_Start = 1,       // base snapshot, resets the log. Truncates the file.
+  kReplayJournal_Log = 2,         // bytes appended to the log
+  kReplayJournal_Checkpoint = 3,  // 4 uint32 of recorder state, then a snapshot
+};
+
+typedef struct ReplayJournal ReplayJournal;
+
+ReplayJournal *ReplayJournal_Open(const char *filename);
+// Stops the writer and deletes the file, as it's not needed after a clean exit.
+void ReplayJournal_Close(ReplayJournal *j);
+// Queues a record for writing. Takes ownership of the payload and clears it.
+void ReplayJournal_Append(ReplayJournal *j, uint32 type, ByteArray *payload);
+// Waits until all queued records are on disk.
+void ReplayJournal_Flush(ReplayJournal *j);
+
+FILE *ReplayJournal_OpenForReading(const char *filename);
+// Returns false at the end of the file or at the first truncated or corrupt record.
+bool ReplayJournal_ReadRecord(FILE *f, uint32 *type, ByteArray *payload);
+
+#endif  // ZELDA3_REPLAY_JOURNAL_H_
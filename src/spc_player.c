@@ -3,6 +3,7 @@
 #include <stdlib.h>
 #include <assert.h>
 #include "types.h"
+#include "arena.h"
 
 #include "snes/spc.h"
 #include "snes/dsp_regs.h"
@@ -1186,7 +1187,7 @@ static void Interrupt_Reset(SpcPlayer *p) {
 }
 
 SpcPlayer *SpcPlayer_Create() {
-  SpcPlayer *p = (SpcPlayer *)malloc(sizeof(SpcPlayer));
+  SpcPlayer *p = (SpcPlayer *)ArenaAlloc("spc player", sizeof(SpcPlayer));
   p->dsp = dsp_init(p->ram);
   p->reg_write_history = 0;
   return p;
@@ -5,11 +5,18 @@
 
 typedef struct SDL_Window SDL_Window;
 
+// Rows [first, first + count) of a frame
+typedef struct RendererRowSpan {
+  int first, count;
+} RendererRowSpan;
+
 struct RendererFuncs {
   bool (*Initialize)(SDL_Window *window);
   void (*Destroy)();
-  void (*BeginDraw)(int width, int height, uint8 **pixels, int *pitch);
-  void (*EndDraw)();
+  // pixel_format receives the kPpuRenderFlags_PixelFormatMask bits the PPU should draw with
+  void (*BeginDraw)(int width, int height, uint8 **pixels, int *pitch, uint32 *pixel_format);
+  // Only the rows in spans differ from the last frame, or all of them if num_spans is -1
+  void (*EndDraw)(const RendererRowSpan *spans, int num_spans);
 };
 
 
@@ -35,7 +42,9 @@ const char *SkipPrefix(const char *big, const char *little);
 void StrSet(char **rv, const char *s);
 char *StrFmt(const char *fmt, ...);
 char *ReplaceFilenameWithNewPath(const char *old_path, const char *new_path);
+uint32 Crc32(const void *data, size_t length);
 uint8 *ApplyBps(const uint8 *src, size_t src_size_in,
   const uint8 *bps, size_t bps_size, size_t *length_out);
+bool Lz4DecompressBlock(const uint8 *src, size_t src_size, uint8 *dst, size_t dst_size);
 
 #endif  // ZELDA3_UTIL_H_
\ No newline at end of file
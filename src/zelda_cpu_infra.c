@@ -10,10 +10,13 @@
 #include "snes/cpu.h"
 #include "snes/cart.h"
 #include "snes/tracing.h"
+#include "config.h"
+#include "arena.h"
 
 Snes *g_snes;
 Cpu *g_cpu;
-uint8 g_emulated_ram[0x20000];
+uint8 *g_emulated_ram;
+static uint8 *g_emulated_ram_backup;
 
 static void PatchRom(uint8 *rom);
 
@@ -35,7 +38,8 @@ typedef struct Snapshot {
   uint16 sram[0x2000];
 } Snapshot;
 
-static Snapshot g_snapshot_mine, g_snapshot_theirs, g_snapshot_before;
+// Allocated by EmuInitialize, as they are only needed when comparing against the rom
+static Snapshot *g_snapshot_mine, *g_snapshot_theirs, *g_snapshot_before;
 
 static void MakeSnapshot(Snapshot *s) {
   Cpu *c = g_cpu;
@@ -168,6 +172,14 @@ static void VerifySnapshotsEq(Snapshot *b, Snapshot *a, Snapshot *prev) {
       }
     }
   }
+
+  if (g_fail && g_snes->cpuTrace) {
+    if (cpuTrace_dump(g_snes->cpuTrace, "cpu_trace.bin"))
+      fprintf(stderr, "  wrote the last %d instructions to cpu_trace.bin\n",
+              (int)UintMin(g_snes->cpuTrace->count, g_snes->cpuTrace->mask + 1));
+    else
+      fprintf(stderr, "  unable to write cpu_trace.bin\n");
+  }
 }
 
 uint8_t *RomByte(Cart *cart, uint32_t addr) {
@@ -200,9 +212,7 @@ void RunEmulatedFuncSilent(uint32 pc, uint16 a, uint16 x, uint16 y, bool mf, boo
   if (b == -3)
     g_cpu->dp = 0x1f00;
 
-  static uint8 *rambak;
-  if (rambak == 0) rambak = (uint8 *)malloc(0x20000);
-  memcpy(rambak, g_emulated_ram, 0x20000);
+  memcpy(g_emulated_ram_backup, g_emulated_ram, 0x20000);
   memcpy(g_emulated_ram, g_ram, 0x20000);
 
   if (whatflags & 2)
@@ -242,7 +252,7 @@ void RunEmulatedFuncSilent(uint32 pc, uint16 a, uint16 x, uint16 y, bool mf, boo
   g_cpu->pc = org_pc;
 
   memcpy(g_ram, g_emulated_ram, 0x20000);
-  memcpy(g_emulated_ram, rambak, 0x20000);
+  memcpy(g_emulated_ram, g_emulated_ram_backup, 0x20000);
 }
 
 void RunOrigAsmCodeOneLoop(Snes *snes) {
@@ -255,7 +265,7 @@ void RunOrigAsmCodeOneLoop(Snes *snes) {
   // Run until the wait loop in Interrupt_Reset,
   // Or the polyhedral main function.
   for(int loops = 0;;loops++) {
-    snes_printCpuLine(snes);
+    snes_traceCpu(snes);
     cpu_runOpcode(snes->cpu);
     while (snes->dma->dmaBusy)
       dma_doDma(snes->dma);
@@ -264,6 +274,8 @@ void RunOrigAsmCodeOneLoop(Snes *snes) {
     if (pc == 0x8034 || pc == 0x9f81d && loops >= 10 || pc == 0x8225 || pc == 0x82D2)
       break;
   }
+  if (snes->cpuTrace)
+    snes->cpuTrace->cur = NULL;
 }
 
 static void RunEmulatedSnesFrame(Snes *snes, int run_what) {
@@ -328,12 +340,12 @@ static void EmuSynchronizeWholeState() {
 }
 
 void EmuRunFrameWithCompare(uint16 input_state, int run_what) {
-  MakeSnapshot(&g_snapshot_before);
-  MakeMySnapshot(&g_snapshot_mine);
-  MakeSnapshot(&g_snapshot_theirs);
+  MakeSnapshot(g_snapshot_before);
+  MakeMySnapshot(g_snapshot_mine);
+  MakeSnapshot(g_snapshot_theirs);
 
   // Compare both snapshots before we run the frame, to see they match
-  VerifySnapshotsEq(&g_snapshot_mine, &g_snapshot_theirs, &g_snapshot_before);
+  VerifySnapshotsEq(g_snapshot_mine, g_snapshot_theirs, g_snapshot_before);
   if (g_fail) {
     printf("early fail\n");
     assert(0);
@@ -344,30 +356,30 @@ void EmuRunFrameWithCompare(uint16 input_state, int run_what) {
 again_theirs:
   g_snes->input1->currentState = input_state;
   RunEmulatedSnesFrame(g_snes, run_what);
-  MakeSnapshot(&g_snapshot_theirs);
+  MakeSnapshot(g_snapshot_theirs);
 
   // Run my version and snapshot
 again_mine:
   ZeldaRunFrameInternal(input_state, run_what);
 
-  MakeMySnapshot(&g_snapshot_mine);
+  MakeMySnapshot(g_snapshot_mine);
 
   // Compare both snapshots
-  VerifySnapshotsEq(&g_snapshot_mine, &g_snapshot_theirs, &g_snapshot_before);
+  VerifySnapshotsEq(g_snapshot_mine, g_snapshot_theirs, g_snapshot_before);
 
   if (g_fail) {
     g_fail = false;
     if (1) {
-      RestoreMySnapshot(&g_snapshot_before);
+      RestoreMySnapshot(g_snapshot_before);
       //SaveLoadSlot(kSaveLoad_Save, 0);
       if (0)
         goto again_mine;
-      RestoreSnapshot(&g_snapshot_before);
+      RestoreSnapshot(g_snapshot_before);
       goto again_theirs;
     }
     if (1) {
-      MakeSnapshot(&g_snapshot_theirs);
-      RestoreMySnapshot(&g_snapshot_theirs);
+      MakeSnapshot(g_snapshot_theirs);
+      RestoreMySnapshot(g_snapshot_theirs);
     }
   }
 }
@@ -577,8 +589,15 @@ static void PatchRom(uint8_t *rom) {
 
 bool EmuInitialize(uint8 *data, size_t size) {
   PatchRom(data);
+  g_emulated_ram = (uint8 *)ArenaAlloc("emulated ram", 0x20000 * 2);
+  g_emulated_ram_backup = g_emulated_ram + 0x20000;
+  g_snapshot_mine = (Snapshot *)ArenaAlloc("verify snapshots", sizeof(Snapshot) * 3);
+  g_snapshot_theirs = g_snapshot_mine + 1;
+  g_snapshot_before = g_snapshot_mine + 2;
   g_snes = snes_init(g_emulated_ram);
   g_cpu = g_snes->cpu;
+  if (g_config.cpu_trace_length)
+    g_snes->cpuTrace = cpuTrace_init(g_config.cpu_trace_length);
 
   ZeldaSetupEmuCallbacks(g_emulated_ram, &EmuRunFrameWithCompare, &EmuSynchronizeWholeState);
   return snes_loadRom(g_snes, data, (int)size);
@@ -2,7 +2,7 @@
 #define ZELDA3_ZELDA_CPU_INFRA_H_
 #include "types.h"
 
-extern uint8 g_emulated_ram[0x20000];
+extern uint8 *g_emulated_ram;
 
 uint8 *GetPtr(uint32 addr);
 
@@ -11,6 +11,8 @@
 #include "util.h"
 #include "audio.h"
 #include "assets.h"
+#include "arena.h"
+#include "replay_journal.h"
 ZeldaEnv g_zenv;
 uint8 g_ram[131072];
 
@@ -18,6 +20,10 @@ uint32 g_wanted_zelda_features;
 
 static void Startup_InitializeMemory();
 
+// Set while ZeldaCapturePpuFrame records the writes done during a frame
+static ZeldaPpuPacket *g_ppu_packet;
+static int g_ppu_packet_line;
+
 typedef struct SimpleHdma {
   const uint8 *table;
   const uint8 *indir_ptr;
@@ -70,6 +76,20 @@ void zelda_ppu_write_word(uint32_t adr, uint16_t val) {
   zelda_ppu_write(adr + 1, val >> 8);
 }
 
+// Register writes done in the middle of a frame
+static void ZeldaPpuFrameWrite(uint32 adr, uint8 val) {
+  zelda_ppu_write(adr, val);
+  ZeldaPpuPacket *packet = g_ppu_packet;
+  if (packet && packet->valid) {
+    if (packet->num_writes == kPpuPacketMaxWrites) {
+      packet->valid = false;
+      return;
+    }
+    PpuPacketWrite *w = &packet->writes[packet->num_writes++];
+    w->line = g_ppu_packet_line, w->adr = (uint8)adr, w->val = val;
+  }
+}
+
 static const uint8 *SimpleHdma_GetPtr(uint32 p) {
   switch (p) {
 
@@ -131,7 +151,7 @@ static void SimpleHdma_DoLine(SimpleHdma *c) {
   if(do_transfer || c->rep_count & 0x80) {
     for(int j = 0, j_end = transferLength[c->mode & 7]; j < j_end; j++) {
       uint8 v = c->mode & 0x40 ? *c->indir_ptr++ : *c->table++;
-      zelda_ppu_write(0x2100 + c->ppu_addr + bAdrOffsets[c->mode & 7][j], v);
+      ZeldaPpuFrameWrite(0x2100 + c->ppu_addr + bAdrOffsets[c->mode & 7][j], v);
     }
   }
   c->rep_count--;
@@ -172,11 +192,8 @@ static void ConfigurePpuSideSpace() {
   PpuSetExtraSideSpace(g_zenv.ppu, extra_left, extra_right, extra_bottom);
 }
 
-void ZeldaDrawPpuFrame(uint8 *pixel_buffer, size_t pitch, uint32 render_flags) {
-  SimpleHdma hdma_chans[2];
-
-  PpuBeginDrawing(g_zenv.ppu, pixel_buffer, pitch, render_flags);
-
+// Sets up the hdma and the ppu for drawing a frame, returns the number of lines
+static int ZeldaBeginPpuFrame(SimpleHdma *hdma_chans, uint32 render_flags) {
   dma_startDma(g_zenv.dma, HDMAEN_copy, true);
 
   SimpleHdma_Init(&hdma_chans[0], &g_zenv.dma->channel[6]);
@@ -197,23 +214,94 @@ void ZeldaDrawPpuFrame(uint8 *pixel_buffer, size_t pitch, uint32 render_flags) {
   if (g_zenv.ppu->extraLeftRight != 0 || render_flags & kPpuRenderFlags_Height240)
     ConfigurePpuSideSpace();
 
-  int height = render_flags & kPpuRenderFlags_Height240 ? 240 : 224;
+  return render_flags & kPpuRenderFlags_Height240 ? 240 : 224;
+}
 
-  for (int i = 0; i <= height; i++) {
-    if (i == 128 && irq_flag) {
-      zelda_ppu_write(BG3HOFS, selectfile_var8);
-      zelda_ppu_write(BG3HOFS, selectfile_var8 >> 8);
-      zelda_ppu_write(BG3VOFS, 0);
-      zelda_ppu_write(BG3VOFS, 0);
-      if (irq_flag & 0x80) {
-        irq_flag = 0;
-        zelda_snes_dummy_write(NMITIMEN, 0x81);
-      }
+// The irq that happens before line |i| is drawn
+static void ZeldaPpuFrameIrq(int i) {
+  if (i == 128 && irq_flag) {
+    ZeldaPpuFrameWrite(BG3HOFS, selectfile_var8);
+    ZeldaPpuFrameWrite(BG3HOFS, selectfile_var8 >> 8);
+    ZeldaPpuFrameWrite(BG3VOFS, 0);
+    ZeldaPpuFrameWrite(BG3VOFS, 0);
+    if (irq_flag & 0x80) {
+      irq_flag = 0;
+      zelda_snes_dummy_write(NMITIMEN, 0x81);
     }
+  }
+}
+
+void ZeldaDrawPpuFrame(uint8 *pixel_buffer, size_t pitch, uint32 render_flags) {
+  SimpleHdma hdma_chans[2];
+
+  PpuBeginDrawing(g_zenv.ppu, pixel_buffer, pitch, render_flags);
+
+  int height = ZeldaBeginPpuFrame(hdma_chans, render_flags);
+
+  for (int i = 0; i <= height; i++) {
+    ZeldaPpuFrameIrq(i);
     ppu_runLine(g_zenv.ppu, i);
     SimpleHdma_DoLine(&hdma_chans[0]);
     SimpleHdma_DoLine(&hdma_chans[1]);
   }
+  PpuEndDrawing(g_zenv.ppu);
+}
+
+ZeldaPpuPacket *ZeldaPpuPacket_Create() {
+  ZeldaPpuPacket *packet = (ZeldaPpuPacket *)ArenaAlloc("ppu packet", sizeof(ZeldaPpuPacket));
+  packet->ppu = ppu_init(NULL);
+  packet->num_writes = 0;
+  packet->height = 0;
+  packet->valid = false;
+  return packet;
+}
+
+bool ZeldaCapturePpuFrame(ZeldaPpuPacket *packet, uint32 render_flags) {
+  SimpleHdma hdma_chans[2];
+
+  int height = ZeldaBeginPpuFrame(hdma_chans, render_flags);
+
+  PpuCopyState(packet->ppu, g_zenv.ppu);
+  packet->render_flags = render_flags;
+  packet->height = height;
+  packet->num_writes = 0;
+  packet->valid = true;
+  uint8 saved_irq_flag = irq_flag;
+
+  // Do the same writes as ZeldaDrawPpuFrame without drawing, the hdma
+  // writes after line i happen before line i + 1 is drawn.
+  g_ppu_packet = packet;
+  for (int i = 0; i <= height; i++) {
+    g_ppu_packet_line = i;
+    ZeldaPpuFrameIrq(i);
+    g_ppu_packet_line = i + 1;
+    SimpleHdma_DoLine(&hdma_chans[0]);
+    SimpleHdma_DoLine(&hdma_chans[1]);
+  }
+  g_ppu_packet = NULL;
+
+  // Too many writes to record. Undo them so that ZeldaDrawPpuFrame can draw the frame.
+  if (!packet->valid) {
+    PpuCopyState(g_zenv.ppu, packet->ppu);
+    irq_flag = saved_irq_flag;
+  }
+  return packet->valid;
+}
+
+void ZeldaDrawPpuPacket(Ppu *ppu, const ZeldaPpuPacket *packet, uint8 *pixel_buffer, size_t pitch, uint32 render_flags) {
+  PpuCopyState(ppu, packet->ppu);
+  PpuBeginDrawing(ppu, pixel_buffer, pitch, render_flags);
+
+  const PpuPacketWrite *w = packet->writes, *w_end = w + packet->num_writes;
+  for (int i = 0; i <= packet->height; i++) {
+    for (; w != w_end && w->line == i; w++)
+      ppu_write(ppu, w->adr, w->val);
+    ppu_runLine(ppu, i);
+  }
+  // The writes after the last line, so that |ppu| ends up like after ZeldaDrawPpuFrame
+  for (; w != w_end; w++)
+    ppu_write(ppu, w->adr, w->val);
+  PpuEndDrawing(ppu);
 }
 
 void HdmaSetup(uint32 addr6, uint32 addr7, uint8 transfer_unit, uint8 reg6, uint8 reg7, uint8 indirect_bank) {
@@ -266,7 +354,8 @@ void ZeldaInitialize() {
   g_zenv.dma = dma_init(NULL);
   g_zenv.ppu = ppu_init(NULL);
   g_zenv.ram = g_ram;
-  g_zenv.sram = (uint8*)calloc(8192, 1);
+  ArenaAccount("ram", sizeof(g_ram));
+  g_zenv.sram = (uint8*)ArenaAlloc("sram", 8192);
   g_zenv.vram = g_zenv.ppu->vram;
   g_zenv.player = SpcPlayer_Create();
   SpcPlayer_Initialize(g_zenv.player);
@@ -377,6 +466,56 @@ void loadFunc(void *ctx, void *data, size_t data_size) {
   st->p += data_size;
 }
 
+static const char kPpuPacketMagic[4] = { 'Z', 'P', 'F', '1' };
+
+static void sizeFunc(void *ctx, void *data, size_t data_size) {
+  *(size_t *)ctx += data_size;
+}
+
+bool ZeldaPpuPacket_Save(const ZeldaPpuPacket *packet, const char *filename) {
+  FILE *f = fopen(filename, "wb");
+  if (!f)
+    return false;
+  ByteArray arr = { 0 };
+  PpuSaveLoadDrawState(packet->ppu, &saveFunc, &arr);
+  // The Ppu struct is stored as is, so a capture only loads into the same layout.
+  uint32 hdr[5] = { sizeof(Ppu), (uint32)arr.size, packet->render_flags, packet->height, packet->num_writes };
+  ByteArray_AppendData(&arr, (const uint8 *)packet->writes, packet->num_writes * sizeof(PpuPacketWrite));
+  bool ok = fwrite(kPpuPacketMagic, 1, 4, f) == 4 &&
+            fwrite(hdr, 1, sizeof(hdr), f) == sizeof(hdr) &&
+            fwrite(arr.data, 1, arr.size, f) == arr.size;
+  ok &= (fclose(f) == 0);
+  ByteArray_Destroy(&arr);
+  return ok;
+}
+
+bool ZeldaPpuPacket_Load(ZeldaPpuPacket *packet, const char *filename) {
+  size_t size;
+  uint8 *data = ReadWholeFile(filename, &size);
+  if (!data)
+    return false;
+  uint32 hdr[5];
+  size_t state_size = 0;
+  PpuSaveLoadDrawState(packet->ppu, &sizeFunc, &state_size);
+  bool ok = size >= 4 + sizeof(hdr) && memcmp(data, kPpuPacketMagic, 4) == 0;
+  if (ok) {
+    memcpy(hdr, data + 4, sizeof(hdr));
+    ok = hdr[0] == sizeof(Ppu) && hdr[1] == state_size && hdr[3] <= 240 && hdr[4] <= kPpuPacketMaxWrites &&
+         size == 4 + sizeof(hdr) + state_size + hdr[4] * sizeof(PpuPacketWrite);
+  }
+  if (ok) {
+    LoadFuncState st = { data + 4 + sizeof(hdr), data + size };
+    PpuSaveLoadDrawState(packet->ppu, &loadFunc, &st);
+    memcpy(packet->writes, st.p, hdr[4] * sizeof(PpuPacketWrite));
+    packet->render_flags = hdr[2];
+    packet->height = hdr[3];
+    packet->num_writes = hdr[4];
+    packet->valid = true;
+  }
+  free(data);
+  return ok;
+}
+
 static void InternalSaveLoad(SaveLoadFunc *func, void *ctx) {
   uint8 junk[58] = { 0 };
   func(ctx, junk, 27);
@@ -439,10 +578,21 @@ typedef struct StateRecorder {
 
   ByteArray log;
   ByteArray base_snapshot;
+
+  // For the replay journal. The first log_dropped bytes of the log were
+  // streamed and are no longer in memory, and log_streamed bytes of |log|
+  // are already in the journal.
+  uint32 log_dropped, log_streamed;
+  bool journal_restart;
 } StateRecorder;
 
 static StateRecorder state_recorder;
 
+static const char kReplayJournalFile[] = "saves/journal.bin";
+static const char kReplayRecoveredFile[] = "saves/recovered.sav";
+static ReplayJournal *g_replay_journal;
+static uint32 g_journal_frames, g_journal_checkpoint_frames;
+
 void StateRecorder_Init(StateRecorder *sr) {
   memset(sr, 0, sizeof(*sr));
 }
@@ -514,6 +664,8 @@ void StateRecorder_Load(StateRecorder *sr, FILE *f, bool replay_mode) {
   ReadFromFile(f, sr->base_snapshot.data, sr->base_snapshot.size);
 
   sr->replay_next_cmd_at = 0;
+  sr->log_dropped = sr->log_streamed = 0;
+  sr->journal_restart = true;
 
   sr->replay_mode = replay_mode;
   if (replay_mode) {
@@ -546,9 +698,91 @@ void StateRecorder_Load(StateRecorder *sr, FILE *f, bool replay_mode) {
   }
 }
 
+static void StateRecorder_WriteJournal(StateRecorder *sr, bool checkpoint) {
+  ReplayJournal *j = g_replay_journal;
+  ByteArray arr = { 0 };
+  if (sr->journal_restart) {
+    sr->journal_restart = false;
+    sr->log_streamed = 0;
+    ByteArray_AppendData(&arr, sr->base_snapshot.data, sr->base_snapshot.size);
+    ReplayJournal_Append(j, kReplayJournal_Start, &arr);
+  }
+  if (sr->log.size > sr->log_streamed) {
+    if (sr->replay_mode) {
+      // The replay reads from the log, so keep it in memory.
+      ByteArray_AppendData(&arr, sr->log.data + sr->log_streamed, sr->log.size - sr->log_streamed);
+      ReplayJournal_Append(j, kReplayJournal_Log, &arr);
+      sr->log_streamed = (uint32)sr->log.size;
+    } else {
+      sr->log_dropped += (uint32)sr->log.size;
+      if (sr->log_streamed == 0) {
+        ReplayJournal_Append(j, kReplayJournal_Log, &sr->log);
+      } else {
+        ByteArray_AppendData(&arr, sr->log.data + sr->log_streamed, sr->log.size - sr->log_streamed);
+        ReplayJournal_Append(j, kReplayJournal_Log, &arr);
+        ByteArray_Destroy(&sr->log);
+        sr->log.size = 0;
+        sr->log_streamed = 0;
+      }
+    }
+  }
+  if (checkpoint) {
+    uint32 v[4] = { sr->total_frames, sr->last_inputs, sr->frames_since_last, sr->log_dropped + (uint32)sr->log.size };
+    ByteArray_AppendData(&arr, (uint8 *)v, sizeof(v));
+    SaveSnesState(&saveFunc, &arr);
+    ReplayJournal_Append(j, kReplayJournal_Checkpoint, &arr);
+  }
+}
+
+// Writes the last checkpoint of a journal in the format of StateRecorder_Save,
+// with the log and base snapshot of the recording it belongs to.
+static bool StateRecorder_ConvertJournal(const char *filename, FILE *out) {
+  FILE *f = ReplayJournal_OpenForReading(filename);
+  if (!f)
+    return false;
+  ByteArray base = { 0 }, log = { 0 }, cp = { 0 }, rec = { 0 };
+  uint32 type, v[4] = { 0 };
+  while (ReplayJournal_ReadRecord(f, &type, &rec)) {
+    if (type == kReplayJournal_Start) {
+      ByteArray t = base; base = rec; rec = t;
+      log.size = cp.size = 0;
+    } else if (type == kReplayJournal_Log) {
+      ByteArray_AppendData(&log, rec.data, rec.size);
+    } else if (type == kReplayJournal_Checkpoint && rec.size > sizeof(v)) {
+      ByteArray t = cp; cp = rec; rec = t;
+      memcpy(v, cp.data, sizeof(v));
+    }
+  }
+  fclose(f);
+  bool ok = cp.size != 0 && v[3] <= log.size &&
+            (base.size == 0 || base.size == cp.size - sizeof(v));
+  if (ok) {
+    uint32 hdr[8] = { 1, v[0], v[3], v[1], v[2], base.size ? 1 : 0, (uint32)(cp.size - sizeof(v)), 0 };
+    fwrite(hdr, 1, sizeof(hdr), out);
+    fwrite(log.data, 1, v[3], out);
+    fwrite(base.data, 1, base.size, out);
+    fwrite(cp.data + sizeof(v), 1, cp.size - sizeof(v), out);
+  }
+  ByteArray_Destroy(&base);
+  ByteArray_Destroy(&log);
+  ByteArray_Destroy(&cp);
+  ByteArray_Destroy(&rec);
+  return ok;
+}
+
 void StateRecorder_Save(StateRecorder *sr, FILE *f) {
   uint32 hdr[8] = { 0 };
   ByteArray arr = { 0 };
+
+  if (sr->log_dropped) {
+    // The start of the log is only in the journal, so save through a checkpoint.
+    StateRecorder_WriteJournal(sr, true);
+    ReplayJournal_Flush(g_replay_journal);
+    if (!StateRecorder_ConvertJournal(kReplayJournalFile, f))
+      fprintf(stderr, "Unable to read back %s\n", kReplayJournalFile);
+    return;
+  }
+
   SaveSnesState(&saveFunc, &arr);
   assert(sr->base_snapshot.size == 0 || sr->base_snapshot.size == arr.size);
 
@@ -608,6 +842,8 @@ void StateRecorder_ClearKeyLog(StateRecorder *sr) {
   }
   ByteArray_Destroy(&old_log);
   sr->frames_since_last = 0;
+  sr->log_dropped = sr->log_streamed = 0;
+  sr->journal_restart = true;
 }
 
 uint16 StateRecorder_ReadNextReplayState(StateRecorder *sr) {
@@ -667,6 +903,50 @@ void StateRecorder_StopReplay(StateRecorder *sr) {
   sr->replay_mode = false;
   sr->total_frames = sr->replay_frame_counter;
   sr->log.size = sr->replay_pos_last_complete;
+  sr->journal_restart = true;
+}
+
+void ZeldaEnableReplayJournal(int checkpoint_seconds) {
+  if (checkpoint_seconds <= 0)
+    return;
+  // The journal is deleted on a clean exit, so if it's still there the last session crashed.
+  FILE *f = fopen(kReplayJournalFile, "rb");
+  if (f) {
+    fclose(f);
+    f = fopen(kReplayRecoveredFile, "wb");
+    if (f) {
+      bool ok = StateRecorder_ConvertJournal(kReplayJournalFile, f);
+      fclose(f);
+      if (ok)
+        fprintf(stderr, "Recovered the previous session into %s\n", kReplayRecoveredFile);
+      else
+        remove(kReplayRecoveredFile);
+    }
+  }
+  g_replay_journal = ReplayJournal_Open(kReplayJournalFile);
+  g_journal_checkpoint_frames = checkpoint_seconds * 60;
+  state_recorder.journal_restart = true;
+}
+
+void ZeldaCloseReplayJournal() {
+  if (g_replay_journal) {
+    ReplayJournal_Close(g_replay_journal);
+    g_replay_journal = NULL;
+  }
+}
+
+// Streams the new part of the log about once a second, and writes a
+// checkpoint of the whole state every g_journal_checkpoint_frames.
+static void ZeldaUpdateReplayJournal() {
+  StateRecorder *sr = &state_recorder;
+  if (!g_replay_journal)
+    return;
+  bool checkpoint = sr->journal_restart || ++g_journal_frames >= g_journal_checkpoint_frames;
+  if (checkpoint)
+    g_journal_frames = 0;
+  // A checkpoint in the middle of a replay would not match the log
+  if (checkpoint || g_journal_frames % 60 == 0)
+    StateRecorder_WriteJournal(sr, checkpoint && !sr->replay_mode);
 }
 
 #ifdef _DEBUG
@@ -763,6 +1043,7 @@ bool ZeldaRunFrame(int inputs) {
   }
 
   ZeldaPushApuState();
+  ZeldaUpdateReplayJournal();
 
   return is_replay;
 }
@@ -788,6 +1069,8 @@ void ZeldaSetLanguage(const char *language) {
   g_zenv.dialogue_blk = kDialogue(found.ptr[0]);
   g_zenv.dialogue_font_blk = kDialogueFont(found.ptr[1]);
   g_zenv.dialogue_flags = found.ptr[2];
+  PinAsset(g_zenv.dialogue_blk.ptr);
+  PinAsset(g_zenv.dialogue_font_blk.ptr);
 }
 
 
@@ -807,6 +1090,10 @@ static const char *const kReferenceSaves[] = {
   "Chapter 13 - After Ganon's Tower.sav",
 };
 
+const char *ZeldaGetReferenceSaveName(int which) {
+  return (uint)which < countof(kReferenceSaves) ? kReferenceSaves[which] : NULL;
+}
+
 void SaveLoadSlot(int cmd, int which) {
   char name[128];
   if (which & 256) {
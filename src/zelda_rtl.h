@@ -13,6 +13,7 @@
 
 struct Snes;
 struct Dsp;
+struct Ppu;
 
 typedef struct ZeldaEnv {
   uint8 *ram;
@@ -47,6 +48,36 @@ void HdmaSetup(uint32 addr6, uint32 addr7, uint8 transfer_unit, uint8 reg6, uint
 void ZeldaInitialize();
 void ZeldaReset(bool preserve_sram);
 void ZeldaDrawPpuFrame(uint8 *pixel_buffer, size_t pitch, uint32 render_flags);
+
+enum {
+  kPpuPacketMaxWrites = 4096,
+};
+
+typedef struct PpuPacketWrite {
+  uint8 line, adr, val;
+} PpuPacketWrite;
+
+// The ppu state at the start of a frame and the register writes done while it is drawn,
+// sorted by the line they happen before.
+typedef struct ZeldaPpuPacket {
+  struct Ppu *ppu;
+  uint32 render_flags;
+  int height;
+  int num_writes;
+  // False if the frame had more than kPpuPacketMaxWrites writes
+  bool valid;
+  PpuPacketWrite writes[kPpuPacketMaxWrites];
+} ZeldaPpuPacket;
+
+// Splits ZeldaDrawPpuFrame in two: the capture does everything the game sees and
+// the packet can then be drawn with another ppu, for example on another thread.
+// When the capture returns false, the frame has to be drawn with ZeldaDrawPpuFrame instead.
+ZeldaPpuPacket *ZeldaPpuPacket_Create();
+bool ZeldaCapturePpuFrame(ZeldaPpuPacket *packet, uint32 render_flags);
+void ZeldaDrawPpuPacket(struct Ppu *ppu, const ZeldaPpuPacket *packet, uint8 *pixel_buffer, size_t pitch, uint32 render_flags);
+// Packets in a file, for benchmarking the ppu with --ppu-bench
+bool ZeldaPpuPacket_Save(const ZeldaPpuPacket *packet, const char *filename);
+bool ZeldaPpuPacket_Load(ZeldaPpuPacket *packet, const char *filename);
 void ZeldaRunFrameInternal(uint16 input, int run_what);
 bool ZeldaRunFrame(int input_state);
 void LoadSongBank(const uint8 *p);
@@ -66,8 +97,12 @@ enum {
 };
 
 void SaveLoadSlot(int cmd, int which);
+// Returns NULL past the last reference save in saves/ref
+const char *ZeldaGetReferenceSaveName(int which);
 void ZeldaWriteSram();
 void ZeldaReadSram();
+void ZeldaEnableReplayJournal(int checkpoint_seconds);
+void ZeldaCloseReplayJournal();
 
 typedef void ZeldaRunFrameFunc(uint16 input, int run_what);
 typedef void ZeldaSyncAllFunc();